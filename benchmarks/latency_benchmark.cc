@@ -0,0 +1,132 @@
+/// MIT License
+/// Copyright (c) 2020
+///
+/// Description:
+/// Loopback ping-pong between TcpClient and an echoing TcpServer. Prints
+/// round trip percentiles so pinned/busy-poll I/O threads can be compared
+/// with the default blocking threads. With --timestamps the server also
+/// reports how long requests waited in its socket buffer and how long
+/// replies took from sendToClient to the device, from kernel timestamps.
+///
+/// Usage: latency_benchmark [iterations] [--busy-poll] [--cpus 2,3]
+///        [--timestamps]
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstdlib>
+#include <iostream>
+
+#include "tcp_udp_srv_cli.h"
+
+using std::cout;
+using std::endl;
+
+namespace {
+constexpr int PORT = 19100;
+TcpServer *server = nullptr;
+std::atomic<bool> replied{false};
+
+void onServerMsg(const Client &client, const char *msg, size_t size) {
+  server->sendToClient(client, msg, size);
+}
+
+void onClientMsg(const char *msg, size_t size) {
+  replied.store(true, std::memory_order_release);
+}
+
+/// Return 0 unless text is a whole positive number that fits an int
+int parse_count(const char *text) {
+  char *end = nullptr;
+  errno = 0;
+  long count = std::strtol(text, &end, 10);
+  if (errno != 0 || end == text || *end != '\0' || count <= 0 ||
+      count > INT_MAX) {
+    return 0;
+  }
+  return int(count);
+}
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  int iterations = 100000;
+  io_thread_config_t config;
+  timestamping_config_t timestamping;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--busy-poll") {
+      config.busyPoll = true;
+    } else if (arg == "--timestamps") {
+      timestamping.rx = true;
+      timestamping.tx = true;
+    } else if (arg == "--cpus" && i + 1 < argc) {
+      config.cpus = parse_cpulist(argv[++i]);
+      if (config.cpus.empty()) {
+	std::cerr << "Invalid CPU list: " << argv[i] << endl;
+	return EXIT_FAILURE;
+      }
+    } else if ((iterations = parse_count(argv[i])) == 0) {
+      std::cerr << "Usage: " << argv[0]
+		<< " [iterations] [--busy-poll] [--cpus 2,3] [--timestamps]"
+		<< endl;
+      return EXIT_FAILURE;
+    }
+  }
+
+  // The server and the client live until the process exits, the echo
+  // observer keeps referring to them
+  server = new TcpServer;
+  server->setIoThreadConfig(config);
+  server->setTimestamping(timestamping);
+  pipe_ret_t ret = server->start(PORT);
+  if (!ret.success) {
+    std::cerr << "Server setup failed: " << ret.message() << endl;
+    return EXIT_FAILURE;
+  }
+  server_observer_t serverObserver;
+  serverObserver.incoming_packet_func = onServerMsg;
+  server->subscribe(serverObserver);
+
+  TcpClient *client = new TcpClient;
+  io_thread_config_t clientConfig = config;
+  if (clientConfig.cpus.size() > 1) {
+    clientConfig.cpus.erase(clientConfig.cpus.begin());
+  }
+  client->setIoThreadConfig(clientConfig);
+  client_observer_t clientObserver;
+  clientObserver.incoming_packet_func = onClientMsg;
+  client->subscribe(clientObserver);
+  ret = client->connectTo("127.0.0.1", PORT);
+  if (!ret.success) {
+    std::cerr << "Connection failed: " << ret.message() << endl;
+    return EXIT_FAILURE;
+  }
+  server->acceptClient(0);
+
+  char payload[64] = {};
+  latency_histogram rtts;
+  for (int i = 0; i < iterations; i++) {
+    replied.store(false, std::memory_order_relaxed);
+    auto begin = std::chrono::steady_clock::now();
+    client->sendMsg(payload, sizeof(payload));
+    while (!replied.load(std::memory_order_acquire)) {
+      if (!config.busyPoll) {
+	std::this_thread::yield();
+      }
+    }
+    auto end = std::chrono::steady_clock::now();
+    rtts.record(std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin).count());
+  }
+
+  cout << (config.busyPoll ? "busy-poll" : "blocking") << ", "
+       << (config.cpus.empty() ? "unpinned" : "pinned")
+       << ", round trips (usec): " << rtts.summary(1000) << endl;
+  if (timestamping.rx) {
+    cout << "server socket buffer wait (usec): "
+	 << server->getRxDelayHistogram().summary(1000) << endl;
+    cout << "server reply send to TX stamp (usec): "
+	 << server->getTxDelayHistogram().summary(1000) << endl;
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,319 @@
+/// MIT License
+/// Copyright (c) 2020
+///
+/// Description:
+/// Opens idle loopback connections to a TcpServer in growing steps and
+/// reports after every step the resident and virtual memory a connection
+/// costs the process, the accept rate of the step and how long a
+/// sendToAllClients broadcast takes to arrive at every connection.
+/// The client ends are plain non-blocking sockets without threads, bound to
+/// consecutive 127.0.0.x source addresses so that no address runs out of
+/// ephemeral ports; their socket buffers are kernel memory, so the growth
+/// of the resident set is what the server spends per connection.
+/// With --budget the run fails if a connection costs more resident bytes,
+/// which catches footprint regressions in CI.
+///
+/// Every connection takes two descriptors and a server thread: runs beyond
+/// a few thousand connections need ulimit -n above twice the count and
+/// kernel.threads-max, kernel.pid_max and vm.max_map_count (a thread stack
+/// is two mappings) above it.
+///
+/// Usage: scale_benchmark [--connections N] [--budget bytes]
+///        [--port port]
+
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <system_error>
+
+#include "tcp_udp_srv_cli.h"
+
+using std::cout;
+using std::endl;
+
+namespace {
+constexpr int CONNECT_BATCH = 256;
+/// Connections waiting in the accept queue before connecting pauses,
+/// below the default somaxconn so that no handshake is dropped.
+constexpr size_t MAX_UNACCEPTED = 1024;
+constexpr uint32_t CONNECTIONS_PER_ADDRESS = 20000;
+constexpr size_t BROADCAST_SIZE = 64;
+
+typedef std::chrono::steady_clock clock_type;
+
+struct memory_t {
+  uint64_t residentBytes = 0;
+  uint64_t virtualBytes = 0;
+};
+
+memory_t process_memory() {
+  memory_t memory;
+  std::ifstream statm("/proc/self/statm");
+  uint64_t sizePages = 0, residentPages = 0;
+  if (statm >> sizePages >> residentPages) {
+    uint64_t page = sysconf(_SC_PAGESIZE);
+    memory.virtualBytes = sizePages * page;
+    memory.residentBytes = residentPages * page;
+  }
+  return memory;
+}
+
+/// Growth from base to now, 0 if the process shrank meanwhile.
+uint64_t growth(uint64_t base, uint64_t now) {
+  return now > base ? now - base : 0;
+}
+
+/// Wait until the resident set stops growing, receive threads start
+/// asynchronously after accept.
+memory_t settled_memory() {
+  memory_t memory = process_memory();
+  for (int i = 0; i < 100; i++) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    memory_t now = process_memory();
+    bool settled = now.residentBytes <= memory.residentBytes;
+    memory = now;
+    if (settled) {
+      break;
+    }
+  }
+  return memory;
+}
+
+/// 1, 2, 5, 10, 20, 50... thousand connections up to the requested count.
+std::vector<size_t> connection_steps(size_t connections) {
+  std::vector<size_t> steps;
+  for (size_t decade = 1000; decade < connections; decade *= 10) {
+    for (size_t factor : {1, 2, 5}) {
+      if (decade * factor < connections) {
+	steps.push_back(decade * factor);
+      }
+    }
+  }
+  steps.push_back(connections);
+  return steps;
+}
+
+bool raise_descriptor_limit(size_t needed) {
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == -1) {
+    return false;
+  }
+  if (limit.rlim_cur < needed) {
+    limit.rlim_cur = std::min<rlim_t>(limit.rlim_max, needed);
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+  return limit.rlim_cur >= needed;
+}
+
+/// Open a non-blocking connection from the index-th source address.
+/// Return the socket, -1 with errno set on failure.
+int open_connection(size_t index, int port) {
+  int sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (sockfd == -1) {
+    return -1;
+  }
+  // the port is picked at connect, unique per 4-tuple instead of per address
+  int enable = 1;
+  setsockopt(sockfd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &enable,
+	     sizeof(enable));
+  struct sockaddr_in source = {};
+  source.sin_family = AF_INET;
+  source.sin_addr.s_addr =
+      htonl(INADDR_LOOPBACK + 1 + uint32_t(index / CONNECTIONS_PER_ADDRESS));
+  struct sockaddr_in server = {};
+  server.sin_family = AF_INET;
+  server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  server.sin_port = htons(port);
+  if (bind(sockfd, (struct sockaddr *)&source, sizeof(source)) == -1 ||
+      (connect(sockfd, (struct sockaddr *)&server, sizeof(server)) == -1 &&
+       errno != EINPROGRESS)) {
+    int err = errno;
+    close(sockfd);
+    errno = err;
+    return -1;
+  }
+  return sockfd;
+}
+
+/// Broadcast a message and record when it arrived at each connection.
+/// Return false if it didn't arrive everywhere within timeoutMs.
+bool measure_broadcast(TcpServer &server, int epollfd,
+		       const std::vector<int> &sockets, latency_histogram &arrivals,
+		       uint64_t &sendNs, int timeoutMs) {
+  char payload[BROADCAST_SIZE] = {};
+  std::vector<size_t> received(sockets.size(), 0);
+  size_t complete = 0;
+  auto begin = clock_type::now();
+  if (!server.sendToAllClients(payload, sizeof(payload)).success) {
+    return false;
+  }
+  auto sent = clock_type::now();
+  sendNs = std::chrono::duration_cast<std::chrono::nanoseconds>(sent - begin).count();
+  auto deadline = begin + std::chrono::milliseconds(timeoutMs);
+  struct epoll_event events[256];
+  while (complete < sockets.size() && clock_type::now() < deadline) {
+    int ready = epoll_wait(epollfd, events, 256, 100);
+    auto now = clock_type::now();
+    for (int i = 0; i < ready; i++) {
+      size_t index = events[i].data.u64;
+      char buffer[BROADCAST_SIZE];
+      ssize_t size = recv(sockets[index], buffer, sizeof(buffer), MSG_DONTWAIT);
+      if (size <= 0) {
+	continue;
+      }
+      received[index] += size;
+      if (received[index] == BROADCAST_SIZE) {
+	arrivals.record(
+	    std::chrono::duration_cast<std::chrono::nanoseconds>(now - begin).count());
+	complete++;
+      }
+    }
+  }
+  return complete == sockets.size();
+}
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  size_t connections = 10000;
+  uint64_t budget = 0;
+  int port = 19130;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--connections" && i + 1 < argc) {
+      connections = std::strtoull(argv[++i], nullptr, 10);
+    } else if (arg == "--budget" && i + 1 < argc) {
+      budget = std::strtoull(argv[++i], nullptr, 10);
+    } else if (arg == "--port" && i + 1 < argc) {
+      port = std::atoi(argv[++i]);
+    } else {
+      std::cerr << "Usage: " << argv[0]
+		<< " [--connections N] [--budget bytes] [--port port]" << endl;
+      return EXIT_FAILURE;
+    }
+  }
+  if (connections == 0) {
+    std::cerr << "Nothing to measure" << endl;
+    return EXIT_FAILURE;
+  }
+  if (!raise_descriptor_limit(2 * connections + 64)) {
+    std::cerr << "Not enough file descriptors for " << connections
+	      << " connections, raise ulimit -n" << endl;
+    return EXIT_FAILURE;
+  }
+
+  // The server lives until the process exits
+  TcpServer *server = new TcpServer;
+  pipe_ret_t ret = server->start(port);
+  if (!ret.success) {
+    std::cerr << "Server setup failed: " << ret.message() << endl;
+    return EXIT_FAILURE;
+  }
+  std::atomic<size_t> accepted{0};
+  std::atomic<bool> acceptFailed{false};
+  std::atomic<bool> done{false};
+  std::thread acceptor([&] {
+    std::vector<Client> batch;
+    while (!done) {
+      batch.clear();
+      try {
+	server->acceptClients(1, batch);
+      } catch (const std::system_error &e) {  // out of threads
+	std::cerr << "Accept failed: " << e.what() << endl;
+	acceptFailed = true;
+	return;
+      }
+      accepted += batch.size();
+    }
+  });
+
+  std::vector<int> sockets;
+  sockets.reserve(connections);
+  int epollfd = epoll_create1(EPOLL_CLOEXEC);
+  memory_t base = settled_memory();
+  bool failed = false;
+  memory_t memory;
+
+  cout << "connections, resident bytes/conn, virtual bytes/conn, accepts/s, "
+	  "broadcast send ms, arrival usec"
+       << endl;
+  for (size_t step : connection_steps(connections)) {
+    size_t before = sockets.size();
+    auto begin = clock_type::now();
+    while (sockets.size() < step && !acceptFailed) {
+      size_t batch = std::min<size_t>(CONNECT_BATCH, step - sockets.size());
+      for (size_t i = 0; i < batch; i++) {
+	int sockfd = open_connection(sockets.size(), port);
+	if (sockfd == -1) {
+	  std::cerr << "Connection " << sockets.size()
+		    << " failed: " << pipe_ret_t::systemError(errno).message()
+		    << endl;
+	  failed = true;
+	  break;
+	}
+	struct epoll_event event = {};
+	event.events = EPOLLIN;
+	event.data.u64 = sockets.size();
+	epoll_ctl(epollfd, EPOLL_CTL_ADD, sockfd, &event);
+	sockets.push_back(sockfd);
+      }
+      while (!acceptFailed && sockets.size() - accepted > MAX_UNACCEPTED) {
+	std::this_thread::yield();
+      }
+      if (failed) {
+	break;
+      }
+    }
+    auto deadline = clock_type::now() + std::chrono::seconds(30);
+    while (!acceptFailed && accepted < sockets.size() &&
+	   clock_type::now() < deadline) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    double seconds = std::chrono::duration<double>(clock_type::now() - begin).count();
+    if (failed || acceptFailed || accepted < sockets.size()) {
+      std::cerr << "Only " << accepted << " of " << sockets.size()
+		<< " connections were accepted" << endl;
+      failed = true;
+      break;
+    }
+
+    memory = settled_memory();
+    latency_histogram arrivals;
+    uint64_t sendNs = 0;
+    if (!measure_broadcast(*server, epollfd, sockets, arrivals, sendNs, 30000)) {
+      std::cerr << "Broadcast did not arrive at every connection" << endl;
+      failed = true;
+      break;
+    }
+    cout << sockets.size() << ", "
+	 << growth(base.residentBytes, memory.residentBytes) / sockets.size() << ", "
+	 << growth(base.virtualBytes, memory.virtualBytes) / sockets.size() << ", "
+	 << uint64_t((sockets.size() - before) / seconds) << ", "
+	 << sendNs / 1e6 << ", " << arrivals.summary(1000) << endl;
+  }
+
+  if (!failed && budget > 0) {
+    uint64_t perConnection =
+	growth(base.residentBytes, memory.residentBytes) / sockets.size();
+    if (perConnection > budget) {
+      std::cerr << "Over budget: " << perConnection << " resident bytes per "
+		<< "connection, budget " << budget << endl;
+      failed = true;
+    }
+  }
+
+  done = true;
+  server->finish();  // wakes the acceptor
+  acceptor.join();
+  for (int sockfd : sockets) {
+    close(sockfd);
+  }
+  close(epollfd);
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,89 @@
+/// MIT License
+/// Copyright (c) 2020
+///
+/// Description:
+/// Sends small messages over loopback through TcpClient::sendMsg and
+/// TcpServer::sendToClient and counts heap allocations made by the sending
+/// thread. Both paths are expected to allocate nothing per send.
+///
+/// Usage: send_benchmark [messages]
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+
+#include "tcp_udp_srv_cli.h"
+
+using std::cout;
+using std::endl;
+
+namespace {
+constexpr int PORT = 19120;
+thread_local uint64_t allocations = 0;
+
+template <typename Func>
+void measure(const char *name, int messages, Func &&send) {
+  uint64_t before = allocations;
+  uint64_t failures = 0;
+  auto begin = std::chrono::steady_clock::now();
+  for (int i = 0; i < messages; i++) {
+    if (!send().success) {
+      failures++;
+    }
+  }
+  auto end = std::chrono::steady_clock::now();
+  double ns = std::chrono::duration<double, std::nano>(end - begin).count();
+  cout << name << ": " << ns / messages << " ns/send, "
+       << double(allocations - before) / messages << " allocations/send, "
+       << failures << " failed" << endl;
+}
+
+void onMsg(const Client &, const char *, size_t) {}
+void onServerMsg(const char *, size_t) {}
+}  // namespace
+
+void *operator new(size_t size) {
+  allocations++;
+  if (void *ptr = std::malloc(size)) {
+    return ptr;
+  }
+  throw std::bad_alloc();
+}
+
+void operator delete(void *ptr) noexcept { std::free(ptr); }
+void operator delete(void *ptr, size_t) noexcept { std::free(ptr); }
+
+int main(int argc, char *argv[]) {
+  int messages = (argc > 1) ? std::atoi(argv[1]) : 100000;
+
+  // The server and the client live until the process exits
+  TcpServer *server = new TcpServer;
+  pipe_ret_t ret = server->start(PORT);
+  if (!ret.success) {
+    std::cerr << "Server setup failed: " << ret.message() << endl;
+    return EXIT_FAILURE;
+  }
+  server_observer_t serverObserver;
+  serverObserver.incoming_packet_func = onMsg;
+  server->subscribe(serverObserver);
+
+  TcpClient *client = new TcpClient;
+  client_observer_t clientObserver;
+  clientObserver.incoming_packet_func = onServerMsg;
+  client->subscribe(clientObserver);
+  ret = client->connectTo("127.0.0.1", PORT);
+  if (!ret.success) {
+    std::cerr << "Connection failed: " << ret.message() << endl;
+    return EXIT_FAILURE;
+  }
+  Client accepted = server->acceptClient(0);
+
+  char payload[64] = {};
+  measure("TcpClient::sendMsg", messages,
+	  [&] { return client->sendMsg(payload, sizeof(payload)); });
+  measure("TcpServer::sendToClient", messages, [&] {
+    return server->sendToClient(accepted, payload, sizeof(payload));
+  });
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,77 @@
+/// MIT License
+/// Copyright (c) 2020
+///
+/// Description:
+/// Compares split() against split_view(), for_each_token() and
+/// delimiter_framer on a large input.
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+
+#include "common.h"
+
+using std::cout;
+using std::endl;
+
+namespace {
+template <typename Func>
+double measure_ms(int iterations, Func &&func) {
+  auto begin = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; i++) {
+    func();
+  }
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::milli>(end - begin).count() /
+	 iterations;
+}
+
+std::string make_input(size_t size) {
+  std::string text;
+  text.reserve(size + 64);
+  for (size_t i = 0; text.size() < size; i++) {
+    text.append(8 + i % 57, static_cast<char>('a' + i % 26));
+    text.push_back('\n');
+  }
+  return text;
+}
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  size_t size = (argc > 1) ? std::strtoul(argv[1], nullptr, 10) : 64 << 20;
+  const int iterations = 5;
+  const std::string text = make_input(size);
+  size_t tokens = 0;
+
+  double splitMs = measure_ms(iterations, [&] {
+    tokens = split(text, '\n').size();
+  });
+  double splitViewMs = measure_ms(iterations, [&] {
+    tokens = split_view(text, '\n').size();
+  });
+  double forEachMs = measure_ms(iterations, [&] {
+    tokens = 0;
+    for_each_token(std::string_view(text), '\n',
+		   [&tokens](std::string_view) { tokens++; });
+  });
+  double framerMs = measure_ms(iterations, [&] {
+    tokens = 0;
+    delimiter_framer<char> framer('\n');
+    for (size_t pos = 0; pos < text.size(); pos += 4096) {
+      framer.feed(text.data() + pos, std::min<size_t>(4096, text.size() - pos),
+		  [&tokens](std::string_view) { tokens++; });
+    }
+  });
+
+  double mb = text.size() / (1024.0 * 1024.0);
+  cout << "input: " << mb << " MB, " << tokens << " tokens" << endl;
+  cout << "split           " << splitMs << " ms, " << mb * 1000 / splitMs
+       << " MB/s" << endl;
+  cout << "split_view      " << splitViewMs << " ms, "
+       << mb * 1000 / splitViewMs << " MB/s" << endl;
+  cout << "for_each_token  " << forEachMs << " ms, " << mb * 1000 / forEachMs
+       << " MB/s" << endl;
+  cout << "framer (4 KiB)  " << framerMs << " ms, " << mb * 1000 / framerMs
+       << " MB/s" << endl;
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,154 @@
+/// MIT License
+/// Copyright (c) 2020
+///
+/// Permission is hereby granted, free of charge, to any person obtaining a copy
+/// of this software and associated documentation files (the "Software"), to
+/// deal in the Software without restriction, including without limitation the
+/// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+/// sell copies of the Software, and to permit persons to whom the Software is
+/// furnished to do so, subject to the following conditions:
+///
+/// The above copyright notice and this permission notice shall be included in
+/// all copies or substantial portions of the Software.
+///
+/// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+/// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+/// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+/// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+/// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+/// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+/// IN THE SOFTWARE.
+///
+/// Description:
+/// C++ program replays a capture made with TcpServer::startCapture against a
+/// server. Every captured connection gets its own TCP connection and
+/// messages are sent in capture order, at original speed scaled by the
+/// speed factor (0 sends as fast as possible).
+
+#include <getopt.h>
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <memory>
+
+#include "tcp_udp_srv_cli.h"
+
+using std::cerr;
+using std::cout;
+using std::endl;
+
+namespace {
+char *app_name = NULL;
+constexpr char MESSAGE_OPTIONS_HELP[] =
+    "  Options:\n"
+    "   -h --help                            Print this help\n"
+    "   -f --capture-file    <path>          Capture file to replay\n"
+    "   -n --number-of-port  <integer>       Assign of the used number of "
+    "port\n"
+    "   -a --ip-address      <IPv4 address>  Assign of IP address for server "
+    "(by default is: 127.0.0.1)\n"
+    "   -s --speed           <factor>        Replay speed, 1 is original "
+    "speed, 0 is as fast as possible (by default is: 1)\n\n";
+
+inline void print_help() {
+  cout << "Usage: " << app_name << " [OPTIONS]" << endl;
+  cout << MESSAGE_OPTIONS_HELP;
+}
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  int c;
+  app_name = argv[0];
+  std::string capture_file;
+  std::string ip_address = "127.0.0.1";
+  int number_of_port = 9000;
+  double speed = 1.0;
+
+  for (;;) {
+    int option_index = 0;
+    static struct option long_options[] = {
+	{"capture-file", required_argument, 0, 'f'},
+	{"number-of-port", required_argument, 0, 'n'},
+	{"ip-address", required_argument, 0, 'a'},
+	{"speed", required_argument, 0, 's'},
+	{"help", no_argument, 0, 'h'},
+	{0, 0, 0, 0}};
+
+    c = getopt_long(argc, argv, "hf:n:a:s:", long_options, &option_index);
+    if (c == -1) {
+      break;
+    }
+
+    switch (c) {
+      case 'f':
+	capture_file = optarg;
+	break;
+
+      case 'a':
+	ip_address = optarg;
+	break;
+
+      case 'n':
+	number_of_port = std::atoi(optarg);
+	break;
+
+      case 's':
+	speed = std::atof(optarg);
+	break;
+
+      case 'h':
+	(void)print_help();
+	return EXIT_SUCCESS;
+
+      default:
+	cerr << "?? getopt returned not defined character code" << endl;
+	(void)print_help();
+	return EXIT_FAILURE;
+    }
+  }
+
+  capture_reader reader;
+  if (capture_file.empty() || !reader.open(capture_file)) {
+    logger::instance().log("Failed to open capture file: " + capture_file);
+    return EXIT_FAILURE;
+  }
+
+  std::map<uint32_t, std::unique_ptr<TcpClient>> connections;
+  capture_record_header_t header;
+  std::string payload;
+  uint64_t messages = 0;
+  auto begin = std::chrono::steady_clock::now();
+  while (reader.next(header, payload)) {
+    if (speed > 0) {
+      auto due = begin + std::chrono::nanoseconds(
+			     uint64_t(header.timestampNs / speed));
+      std::this_thread::sleep_until(due);
+    }
+    std::unique_ptr<TcpClient> &client = connections[header.connectionId];
+    if (client == nullptr) {
+      client.reset(new TcpClient);
+      pipe_ret_t ret = client->connectTo(ip_address, number_of_port);
+      if (!ret.success) {
+	logger::instance().log("Connection failed: " + ret.message());
+	return EXIT_FAILURE;
+      }
+    }
+    pipe_ret_t ret = client->sendMsg(payload.data(), payload.size());
+    if (!ret.success) {
+      logger::instance().log("Sending failed: " + ret.message());
+      return EXIT_FAILURE;
+    }
+    messages++;
+  }
+
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - begin;
+  cout << "Replayed " << messages << " messages over " << connections.size()
+       << " connections in " << elapsed.count() << " s" << endl;
+  for (auto &connection : connections) {
+    connection.second->finish();
+  }
+  return EXIT_SUCCESS;
+}
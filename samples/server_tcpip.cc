@@ -42,6 +42,12 @@ constexpr char MESSAGE_OPTIONS_HELP[] =
     "   -t --type-protocol   <tcp|udp>  Assign of the used protocol (TCP or "
     "UDP)\n"
     "   -n --number-of-port  <integer>  Assign of the used number of port\n"
+    "   -c --capture-file    <path>     Record received messages for "
+    "replay_tcpip\n"
+    "   -p --pubsub                     Handle SUB/UNSUB/PUB topic commands "
+    "sent by clients\n"
+    "   -r --trace-file      <path>     Trace the server and write Chrome "
+    "trace JSON on quit\n"
     "   -v --verbose                    Enable logs to output to screen (by "
     "default disabled)\n\n";
 
@@ -52,11 +58,16 @@ inline void print_help() {
 
 int number_of_port = 9000;
 std::string type_protocol = "tcp";
+std::string capture_file;
+std::string trace_file;
+bool pubsub = false;
 TcpServer server;
 server_observer_t observer1, observer2;
 
+// temporaries come from the client's message arena, which the server
+// empties when the callback returns
 void onIncomingMsg1(const Client &client, const char *msg, size_t size) {
-  std::string msgStr = msg;
+  arena_string msgStr(msg, size, client.getArena());
   // print the message content
   std::cout << "Observer1 got client msg: " << msgStr << std::endl;
   // if client sent the string "quit", close server
@@ -64,16 +75,24 @@ void onIncomingMsg1(const Client &client, const char *msg, size_t size) {
   // else just print the client message
   if (msgStr.find("quit") != std::string::npos) {
     std::cout << "Closing server..." << std::endl;
+    server.stopCapture();
+    if (!trace_file.empty()) {
+      tracer::instance().stop();
+      if (!tracer::instance().dumpChromeTrace(trace_file)) {
+	std::cout << "Failed writing trace to " << trace_file << std::endl;
+      }
+    }
     pipe_ret_t finishRet = server.finish();
     if (finishRet.success) {
       std::cout << "Server closed." << std::endl;
     } else {
-      std::cout << "Failed closing server: " << finishRet.msg << std::endl;
+      std::cout << "Failed closing server: " << finishRet.message() << std::endl;
     }
   } else if (msgStr.find("print") != std::string::npos) {
     server.printClients();
   } else {
-    std::string replyMsg = "server got this msg: " + msgStr;
+    arena_string replyMsg("server got this msg: ", client.getArena());
+    replyMsg += msgStr;
     server.sendToAllClients(replyMsg.c_str(), replyMsg.length());
   }
 }
@@ -81,13 +100,14 @@ void onIncomingMsg1(const Client &client, const char *msg, size_t size) {
 // observer callback. will be called for every new message received by clients
 // with the requested IP address
 void onIncomingMsg2(const Client &client, const char *msg, size_t size) {
-  std::string msgStr = msg;
+  arena_string msgStr(msg, size, client.getArena());
   // print client message
   std::cout << "Observer2 got client msg: " << msgStr << std::endl;
 
   // reply back to client
-  std::string replyMsg = "server got this msg: " + msgStr;
-  server.sendToClient(client, msg, size);
+  arena_string replyMsg("server got this msg: ", client.getArena());
+  replyMsg += msgStr;
+  server.sendToClient(client, replyMsg.c_str(), replyMsg.length());
 }
 
 // observer callback. will be called when client disconnects
@@ -107,11 +127,14 @@ int main(int argc, char *argv[]) {
     static struct option long_options[] = {
 	{"type-protocol", required_argument, 0, 't'},
 	{"number-of-port", required_argument, 0, 'n'},
+	{"capture-file", required_argument, 0, 'c'},
+	{"pubsub", no_argument, 0, 'p'},
+	{"trace-file", required_argument, 0, 'r'},
 	{"verbose", no_argument, 0, 'v'},
 	{"help", no_argument, 0, 'h'},
 	{0, 0, 0, 0}};
 
-    c = getopt_long(argc, argv, "vhn:t:", long_options, &option_index);
+    c = getopt_long(argc, argv, "vphn:t:c:r:", long_options, &option_index);
     if (c == -1) {
       break;
     }
@@ -126,6 +149,21 @@ int main(int argc, char *argv[]) {
 	type_protocol = optarg;
 	break;
 
+      case 'c':
+	cout << "option 'capture-file' with value " << optarg << endl;
+	capture_file = optarg;
+	break;
+
+      case 'p':
+	cout << "option pubsub" << endl;
+	pubsub = true;
+	break;
+
+      case 'r':
+	cout << "option 'trace-file' with value " << optarg << endl;
+	trace_file = optarg;
+	break;
+
       case 'n':
 	cout << "option 'number-of-port' with value " << optarg << endl;
 	try {
@@ -157,10 +195,23 @@ int main(int argc, char *argv[]) {
   if (startRet.success) {
     logger::instance().log("Server setup succeeded");
   } else {
-    logger::instance().log("Server setup failed: " + startRet.msg);
+    logger::instance().log("Server setup failed: " + startRet.message());
     return EXIT_FAILURE;
   }
 
+  if (!capture_file.empty()) {
+    pipe_ret_t captureRet = server.startCapture(capture_file);
+    if (!captureRet.success) {
+      logger::instance().log("Capture setup failed: " + captureRet.message());
+      return EXIT_FAILURE;
+    }
+  }
+
+  server.enableTopicCommands(pubsub);
+  if (!trace_file.empty()) {
+    tracer::instance().start();
+  }
+
   // configure and register observer1
   observer1.incoming_packet_func = onIncomingMsg1;
   observer1.disconnected_func = onClientDisconnected;
@@ -174,17 +225,25 @@ int main(int argc, char *argv[]) {
 					  // messages from any IP address
   server.subscribe(observer2);
 
-  // receive clients
+  // receive clients, all connections pending at a wakeup at once
+  std::vector<Client> clients;
   for (;;) {
-    Client client = server.acceptClient(0);
-    if (client.isConnected()) {
+    clients.clear();
+    pipe_ret_t acceptRet = server.acceptClients(0, clients);
+    for (const Client &client : clients) {
       std::cout << "Got client with IP: " << client.getIp() << std::endl;
+    }
+    if (!clients.empty()) {
       server.printClients();
-    } else {
-      std::cout << "Accepting client failed: " << client.getInfoMessage()
+    }
+    if (!acceptRet.success) {
+      std::cout << "Accepting client failed: " << acceptRet.message()
 		<< std::endl;
+      if (acceptRet.category == error_category_t::SYSTEM &&
+	  acceptRet.code == EBADF) {  // server was closed
+	break;
+      }
     }
-    sleep(1);
   }
 
   return EXIT_SUCCESS;
@@ -0,0 +1,78 @@
+/// MIT License
+/// Copyright (c) 2020
+///
+/// Description:
+/// This file contains non-template helpers declared in common.h.
+
+#include "common.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define COMMON_HAVE_X86_SIMD 1
+#endif
+
+namespace {
+using find_delimiter_func_t = const char *(*)(const char *, const char *,
+					      char) noexcept;
+
+const char *find_delimiter_scalar(const char *first, const char *last,
+				  char delimiter) noexcept {
+  for (; first != last; ++first) {
+    if (*first == delimiter) {
+      return first;
+    }
+  }
+  return last;
+}
+
+#ifdef COMMON_HAVE_X86_SIMD
+__attribute__((target("sse2"))) const char *find_delimiter_sse2(
+    const char *first, const char *last, char delimiter) noexcept {
+  const __m128i needle = _mm_set1_epi8(delimiter);
+  while (last - first >= 16) {
+    __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(first));
+    int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle));
+    if (mask != 0) {
+      return first + __builtin_ctz(mask);
+    }
+    first += 16;
+  }
+  return find_delimiter_scalar(first, last, delimiter);
+}
+
+__attribute__((target("avx2"))) const char *find_delimiter_avx2(
+    const char *first, const char *last, char delimiter) noexcept {
+  const __m256i needle = _mm256_set1_epi8(delimiter);
+  while (last - first >= 32) {
+    __m256i chunk =
+	_mm256_loadu_si256(reinterpret_cast<const __m256i *>(first));
+    unsigned mask = static_cast<unsigned>(
+	_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, needle)));
+    if (mask != 0) {
+      return first + __builtin_ctz(mask);
+    }
+    first += 32;
+  }
+  return find_delimiter_sse2(first, last, delimiter);
+}
+#endif
+
+find_delimiter_func_t select_find_delimiter() noexcept {
+#ifdef COMMON_HAVE_X86_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    return find_delimiter_avx2;
+  }
+  if (__builtin_cpu_supports("sse2")) {
+    return find_delimiter_sse2;
+  }
+#endif
+  return find_delimiter_scalar;
+}
+}  // namespace
+
+const char *find_delimiter(const char *first, const char *last,
+			   char delimiter) noexcept {
+  static const find_delimiter_func_t impl = select_find_delimiter();
+  return impl(first, last, delimiter);
+}
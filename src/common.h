@@ -16,6 +16,9 @@
 #include <mutex>
 #include <algorithm>
 #include <string>
+#include <string_view>
+#include <sstream>
+#include <vector>
 #include <exception>
 
 /// Here is one possible implementation of System handle wrapper.
@@ -122,3 +125,117 @@ inline std::vector<tstring<Elem>> split(tstring<Elem> text,
 
   return tokens;
 }
+
+template <class Elem>
+using tstring_view = std::basic_string_view<Elem, std::char_traits<Elem>>;
+
+/// Return pointer to the first delimiter in [first, last) or last if there
+/// is none. The char overload scans 16 or 32 bytes at a time with SSE2/AVX2,
+/// the instruction set is chosen at runtime from what the CPU supports.
+const char *find_delimiter(const char *first, const char *last,
+			   char delimiter) noexcept;
+
+template <typename Elem>
+inline const Elem *find_delimiter(const Elem *first, const Elem *last,
+				  Elem const delimiter) noexcept {
+  return std::find(first, last, delimiter);
+}
+
+/// Call func for every non-empty token of text. Tokens are views into the
+/// original buffer, so nothing is copied or allocated.
+template <typename Elem, typename Func>
+inline void for_each_token(tstring_view<Elem> text, Elem const delimiter,
+			   Func &&func) {
+  const Elem *pos = text.data();
+  const Elem *last = pos + text.size();
+  while (pos != last) {
+    const Elem *next = find_delimiter(pos, last, delimiter);
+    if (next != pos) {
+      func(tstring_view<Elem>(pos, next - pos));
+    }
+    if (next == last) {
+      break;
+    }
+    pos = next + 1;
+  }
+}
+
+/// Same tokens as split() but returned as views into text. The views are
+/// valid only as long as the buffer behind text.
+template <typename Elem>
+inline std::vector<tstring_view<Elem>> split_view(tstring_view<Elem> text,
+						  Elem const delimiter) {
+  auto tokens = std::vector<tstring_view<Elem>>{};
+  for_each_token(text, delimiter,
+		 [&tokens](tstring_view<Elem> token) { tokens.push_back(token); });
+  return tokens;
+}
+
+template <typename Elem>
+inline std::vector<tstring_view<Elem>> split_view(const tstring<Elem> &text,
+						  Elem const delimiter) {
+  return split_view(tstring_view<Elem>(text), delimiter);
+}
+
+/// Streaming counterpart of split() for delimiter framed socket data.
+/// Chunks are fed as they arrive from recv(), every complete frame is passed
+/// to the callback without the delimiter. Frames lying entirely inside one
+/// chunk are passed as views into that chunk; only the unterminated tail is
+/// copied and kept until the next chunk completes it.
+template <typename Elem>
+class delimiter_framer {
+ public:
+  explicit delimiter_framer(Elem delimiter, size_t maxFrameSize = 1 << 20)
+      : m_delimiter{delimiter}, m_maxFrameSize{maxFrameSize} {}
+
+  /// Return false if a frame grew beyond maxFrameSize. Such a frame is
+  /// dropped whole: what arrives of it in later chunks is skipped up to its
+  /// delimiter, so its tail is never taken for a frame of its own.
+  template <typename Func>
+  bool feed(const Elem *data, size_t size, Func &&onFrame) {
+    bool accepted = true;
+    const Elem *pos = data;
+    const Elem *last = data + size;
+    while (pos != last) {
+      const Elem *next = find_delimiter(pos, last, m_delimiter);
+      if (next == last) {
+	break;
+      }
+      if (m_discarding) {  // delimiter of a dropped frame
+	m_discarding = false;
+      } else if (m_partial.size() + (next - pos) > m_maxFrameSize) {
+	m_partial.clear();
+	accepted = false;
+      } else if (m_partial.empty()) {
+	onFrame(tstring_view<Elem>(pos, next - pos));
+      } else {
+	m_partial.append(pos, next);
+	onFrame(tstring_view<Elem>(m_partial));
+	m_partial.clear();
+      }
+      pos = next + 1;
+    }
+    if (m_discarding) {
+      return accepted;
+    }
+    if (m_partial.size() + (last - pos) > m_maxFrameSize) {
+      m_partial.clear();
+      m_discarding = true;
+      return false;
+    }
+    m_partial.append(pos, last);
+    return accepted;
+  }
+
+  size_t pending() const noexcept { return m_partial.size(); }
+  void reset() noexcept {
+    m_partial.clear();
+    m_discarding = false;
+  }
+
+ private:
+  Elem m_delimiter;
+  size_t m_maxFrameSize;
+  tstring<Elem> m_partial;
+  bool m_discarding = false;  /// inside a dropped frame
+};
@@ -0,0 +1,129 @@
+/// MIT License
+/// Copyright (c) 2020
+///
+/// Description:
+/// This file contains implementation of epoch based reclamation. Reader
+/// records form a list that only grows; a guard claims a free record, so
+/// the list is as long as the highest number of concurrent readers.
+
+#include "epoch.h"
+
+#include <thread>
+
+epoch_domain::guard::guard(epoch_domain &domain)
+    : m_record(domain.acquireRecord()) {
+  uint64_t epoch = domain.m_epoch.load();
+  for (;;) {
+    m_record->epoch.store(epoch);
+    // the epoch may have advanced before the store became visible
+    uint64_t current = domain.m_epoch.load();
+    if (current == epoch) {
+      break;
+    }
+    epoch = current;
+  }
+}
+
+epoch_domain::guard::~guard() {
+  m_record->epoch.store(0, std::memory_order_release);
+  m_record->inUse.store(false, std::memory_order_release);
+}
+
+epoch_domain::~epoch_domain() {
+  for (retired_t &retired : m_retired) {
+    retired.reclaim();
+  }
+  record_t *record = m_records.load();
+  while (record != nullptr) {
+    record_t *next = record->next;
+    delete record;
+    record = next;
+  }
+}
+
+epoch_domain::record_t *epoch_domain::acquireRecord() {
+  for (record_t *record = m_records.load(std::memory_order_acquire);
+       record != nullptr; record = record->next) {
+    bool expected = false;
+    if (!record->inUse.load(std::memory_order_relaxed) &&
+	record->inUse.compare_exchange_strong(expected, true,
+					      std::memory_order_acquire)) {
+      return record;
+    }
+  }
+  record_t *record = new record_t;
+  record->inUse.store(true, std::memory_order_relaxed);
+  record->next = m_records.load(std::memory_order_relaxed);
+  while (!m_records.compare_exchange_weak(record->next, record,
+					  std::memory_order_release,
+					  std::memory_order_relaxed)) {
+  }
+  return record;
+}
+
+/*
+ * Advance only if every reader inside a guard has seen the current epoch
+ */
+bool epoch_domain::tryAdvance() {
+  uint64_t epoch = m_epoch.load();
+  for (record_t *record = m_records.load(std::memory_order_acquire);
+       record != nullptr; record = record->next) {
+    uint64_t seen = record->epoch.load();
+    if (seen != 0 && seen != epoch) {
+      return false;
+    }
+  }
+  return m_epoch.compare_exchange_strong(epoch, epoch + 1);
+}
+
+void epoch_domain::retire(std::function<void()> reclaim) {
+  {
+    std::lock_guard<std::mutex> lock(m_retiredMtx);
+    m_retired.push_back({m_epoch.load(), std::move(reclaim)});
+  }
+  collect();
+}
+
+size_t epoch_domain::collect() {
+  // two steps make objects retired in the current epoch reclaimable when
+  // no reader is inside a guard
+  for (int i = 0; i < 2 && tryAdvance(); i++) {
+  }
+  std::vector<retired_t> ready;
+  {
+    std::lock_guard<std::mutex> lock(m_retiredMtx);
+    uint64_t epoch = m_epoch.load();
+    size_t kept = 0;
+    for (size_t i = 0; i < m_retired.size(); i++) {
+      if (m_retired[i].epoch + 2 <= epoch) {
+	ready.push_back(std::move(m_retired[i]));
+      } else {
+	if (kept != i) {
+	  m_retired[kept] = std::move(m_retired[i]);
+	}
+	kept++;
+      }
+    }
+    m_retired.resize(kept);
+  }
+  // outside the lock, reclaim may retire further objects
+  for (retired_t &retired : ready) {
+    retired.reclaim();
+  }
+  return ready.size();
+}
+
+void epoch_domain::synchronize() {
+  uint64_t target = m_epoch.load() + 2;
+  while (m_epoch.load() < target) {
+    if (!tryAdvance()) {
+      std::this_thread::yield();
+    }
+  }
+  collect();
+}
+
+size_t epoch_domain::pendingCount() const {
+  std::lock_guard<std::mutex> lock(m_retiredMtx);
+  return m_retired.size();
+}
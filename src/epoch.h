@@ -0,0 +1,82 @@
+#pragma once
+
+/// MIT License
+/// Copyright (c) 2020
+///
+/// Description:
+/// This file contains epoch based reclamation for data shared between
+/// threads without locks on the read side.
+///
+/// Readers enter a guard before loading a shared pointer and leave it when
+/// they are done with the object. Writers unlink an object, then retire it;
+/// the reclaim function of a retired object runs only once every reader
+/// that could have loaded it has left its guard. The global epoch advances
+/// when all readers inside a guard have seen the current epoch, and an
+/// object retired in epoch e is reclaimed when the epoch reaches e + 2.
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+class epoch_domain {
+ private:
+  struct record_t {
+    std::atomic<uint64_t> epoch{0};  /// 0 while not inside a guard
+    std::atomic<bool> inUse{false};
+    record_t *next = nullptr;
+  };
+
+  struct retired_t {
+    uint64_t epoch;
+    std::function<void()> reclaim;
+  };
+
+ public:
+  /// Keeps objects loaded while it lives from being reclaimed. Entering
+  /// and leaving never block and never allocate once the domain has as
+  /// many reader records as there were concurrent readers.
+  class guard {
+   public:
+    explicit guard(epoch_domain &domain);
+    ~guard();
+    guard(const guard &) = delete;
+    guard &operator=(const guard &) = delete;
+
+   private:
+    record_t *m_record;
+  };
+
+  epoch_domain() = default;
+  /// Runs the reclaim functions still pending, no guard may be alive.
+  ~epoch_domain();
+  epoch_domain(const epoch_domain &) = delete;
+  epoch_domain &operator=(const epoch_domain &) = delete;
+
+  /// Run reclaim once no reader can still see the unlinked object.
+  void retire(std::function<void()> reclaim);
+  template <typename T>
+  void retireDelete(T *ptr) {
+    retire([ptr] { delete ptr; });
+  }
+
+  /// Try to advance the epoch and run reclaim functions that became safe.
+  /// Return the number of objects reclaimed.
+  size_t collect();
+  /// Wait until everything retired before the call is reclaimed. Must not
+  /// be called from inside a guard.
+  void synchronize();
+
+  size_t pendingCount() const;
+  uint64_t epoch() const noexcept { return m_epoch.load(); }
+
+ private:
+  record_t *acquireRecord();
+  bool tryAdvance();
+
+  std::atomic<uint64_t> m_epoch{1};
+  std::atomic<record_t *> m_records{nullptr};
+  mutable std::mutex m_retiredMtx;
+  std::vector<retired_t> m_retired;
+};
@@ -0,0 +1,75 @@
+/// MIT License
+/// Copyright (c) 2020
+///
+/// Description:
+/// This file contains implementation of the latency histogram.
+
+#include "latency_histogram.h"
+
+#include <algorithm>
+#include <cmath>
+#include <sstream>
+
+latency_histogram::latency_histogram() { reset(); }
+
+size_t latency_histogram::bucketOf(uint64_t value) {
+  if (value < SUB_BUCKETS) {
+    return value;
+  }
+  int shift = 63 - __builtin_clzll(value) - SUB_BITS;
+  return (shift + 1) * SUB_BUCKETS + ((value >> shift) & (SUB_BUCKETS - 1));
+}
+
+uint64_t latency_histogram::bucketUpperBound(size_t bucket) {
+  if (bucket < SUB_BUCKETS) {
+    return bucket;
+  }
+  int shift = bucket / SUB_BUCKETS - 1;
+  uint64_t lower = uint64_t(SUB_BUCKETS + bucket % SUB_BUCKETS) << shift;
+  return lower + ((uint64_t(1) << shift) - 1);
+}
+
+void latency_histogram::record(uint64_t value) {
+  m_buckets[bucketOf(value)].fetch_add(1, std::memory_order_relaxed);
+  m_count.fetch_add(1, std::memory_order_relaxed);
+  uint64_t max = m_max.load(std::memory_order_relaxed);
+  while (value > max &&
+	 !m_max.compare_exchange_weak(max, value, std::memory_order_relaxed)) {
+  }
+}
+
+void latency_histogram::reset() {
+  for (std::atomic<uint64_t> &bucket : m_buckets) {
+    bucket.store(0, std::memory_order_relaxed);
+  }
+  m_count = 0;
+  m_max = 0;
+}
+
+uint64_t latency_histogram::count() const { return m_count.load(); }
+
+uint64_t latency_histogram::max() const { return m_max.load(); }
+
+uint64_t latency_histogram::percentile(double p) const {
+  uint64_t count = m_count.load();
+  if (count == 0) {
+    return 0;
+  }
+  uint64_t target = std::max<uint64_t>(1, std::ceil(p * count));
+  uint64_t seen = 0;
+  for (size_t bucket = 0; bucket < BUCKETS; bucket++) {
+    seen += m_buckets[bucket].load(std::memory_order_relaxed);
+    if (seen >= target) {
+      return std::min(bucketUpperBound(bucket), max());
+    }
+  }
+  return max();
+}
+
+std::string latency_histogram::summary(double scale) const {
+  std::ostringstream text;
+  text << "count " << count() << " p50 " << percentile(0.5) / scale << " p99 "
+       << percentile(0.99) / scale << " p99.9 " << percentile(0.999) / scale
+       << " max " << max() / scale;
+  return text.str();
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+/// MIT License
+/// Copyright (c) 2020
+///
+/// Description:
+/// This file contains a fixed size latency histogram. Values below 32 get
+/// a bucket each, above that every power of two range is split into 32
+/// buckets, so percentiles are within ~3% of the recorded values whatever
+/// their magnitude. Recording is a few relaxed atomic increments, safe
+/// from any number of threads.
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+class latency_histogram {
+ public:
+  latency_histogram();
+
+  void record(uint64_t value);
+  void reset();
+
+  uint64_t count() const;
+  uint64_t max() const;
+  /// Smallest value v such that a fraction p (0..1) of recorded values is
+  /// at most v, up to the bucket precision. 0 if nothing was recorded.
+  uint64_t percentile(double p) const;
+  /// "count N p50 X p99 X p99.9 X max X" with values divided by `scale`.
+  std::string summary(double scale = 1) const;
+
+ private:
+  static constexpr int SUB_BITS = 5;
+  static constexpr int SUB_BUCKETS = 1 << SUB_BITS;
+  static constexpr int BUCKETS = (64 - SUB_BITS + 1) * SUB_BUCKETS;
+
+  static size_t bucketOf(uint64_t value);
+  static uint64_t bucketUpperBound(size_t bucket);
+
+  std::atomic<uint64_t> m_buckets[BUCKETS];
+  std::atomic<uint64_t> m_count{0};
+  std::atomic<uint64_t> m_max{0};
+};
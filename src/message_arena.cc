@@ -0,0 +1,25 @@
+/// MIT License
+/// Copyright (c) 2020
+///
+/// Description:
+/// This file contains implementation of the message arena.
+
+#include "message_arena.h"
+
+message_arena::message_arena(std::pmr::memory_resource *upstream)
+    : m_upstream{upstream}, m_arena{m_inline, sizeof(m_inline), &m_upstream} {}
+
+void message_arena::reset() { m_arena.release(); }
+
+void *message_arena::counting_resource::do_allocate(size_t bytes,
+						    size_t alignment) {
+  void *p = m_upstream->allocate(bytes, alignment);
+  this->bytes += bytes;
+  return p;
+}
+
+void message_arena::counting_resource::do_deallocate(void *p, size_t bytes,
+						      size_t alignment) {
+  m_upstream->deallocate(p, bytes, alignment);
+  this->bytes -= bytes;
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+/// MIT License
+/// Copyright (c) 2020
+///
+/// Description:
+/// This file contains the arena backing temporary allocations made while a
+/// message is dispatched. Observers build their strings and buffers in it
+/// and the server releases all of them at once when the dispatch ends, so
+/// a temporary costs a pointer bump instead of a malloc and free, and
+/// lives in memory the receive thread touched a moment ago.
+
+#include <cstddef>
+#include <memory_resource>
+#include <string>
+#include <vector>
+
+#define MESSAGE_ARENA_INLINE_SIZE 4096
+
+typedef std::pmr::string arena_string;
+typedef std::pmr::vector<char> arena_buffer;
+
+/// Monotonic arena over an inline block; what doesn't fit is taken from
+/// upstream in growing chunks. Not thread safe, an arena belongs to the
+/// thread dispatching the messages of one connection.
+class message_arena {
+ public:
+  explicit message_arena(
+      std::pmr::memory_resource *upstream = std::pmr::new_delete_resource());
+  message_arena(const message_arena &) = delete;
+  message_arena &operator=(const message_arena &) = delete;
+
+  std::pmr::memory_resource *resource() noexcept { return &m_arena; }
+  /// Release everything allocated since the last reset. Memory taken from
+  /// upstream is returned, the inline block is reused.
+  void reset();
+  /// Bytes currently held from upstream.
+  size_t upstreamBytes() const noexcept { return m_upstream.bytes; }
+
+ private:
+  /// Forwards to the real upstream and counts what is held.
+  class counting_resource : public std::pmr::memory_resource {
+   public:
+    explicit counting_resource(std::pmr::memory_resource *upstream)
+	: m_upstream{upstream} {}
+    size_t bytes = 0;
+
+   private:
+    std::pmr::memory_resource *m_upstream;
+
+    void *do_allocate(size_t bytes, size_t alignment) override;
+    void do_deallocate(void *p, size_t bytes, size_t alignment) override;
+    bool do_is_equal(const std::pmr::memory_resource &other) const
+	noexcept override {
+      return this == &other;
+    }
+  };
+
+  alignas(std::max_align_t) char m_inline[MESSAGE_ARENA_INLINE_SIZE];
+  counting_resource m_upstream;
+  std::pmr::monotonic_buffer_resource m_arena;
+};
@@ -0,0 +1,85 @@
+/// MIT License
+/// Copyright (c) 2020
+///
+/// Description:
+/// This file contains implementation of the outbound priority scheduler.
+
+#include "priority_scheduler.h"
+
+#include <algorithm>
+
+priority_scheduler::priority_scheduler(const priority_config_t &config)
+    : m_config{config} {
+  m_config.chunkSize = std::max<size_t>(m_config.chunkSize, 1);
+  for (uint32_t &weight : m_config.weights) {
+    weight = std::max<uint32_t>(weight, 1);
+  }
+}
+
+void priority_scheduler::push(send_priority_t priority, const char *msg,
+			      size_t size) {
+  class_queue_t &queue = m_queues[size_t(priority)];
+  queue.messages.emplace_back(msg, size);
+  queue.bytes += size;
+  m_queuedBytes += size;
+  m_queuedMessages++;
+}
+
+/*
+ * Deficit round robin: a class gets weight * chunkSize bytes of credit when
+ * its turn starts and keeps the turn while the next frame fits the credit.
+ * An idle class loses its credit, so it can't save up for a burst
+ */
+bool priority_scheduler::next(std::string &out) {
+  if (empty()) {
+    return false;
+  }
+  while (true) {
+    class_queue_t &queue = m_queues[m_current];
+    if (queue.messages.empty() && queue.deficit > 0) {
+      queue.deficit = 0;
+    }
+    if (!queue.messages.empty()) {
+      if (!m_turnStarted) {
+	queue.deficit += m_config.weights[m_current] * m_config.chunkSize;
+	m_turnStarted = true;
+      }
+      const std::string &message = queue.messages.front();
+      size_t size = std::min(m_config.chunkSize, message.size() - queue.offset);
+      if (size <= queue.deficit) {
+	bool last = queue.offset + size == message.size();
+	priority_frame_header_t header = {};
+	header.priority = uint8_t(m_current);
+	header.flags = last ? PRIORITY_FRAME_END : 0;
+	header.size = htobe32(size);
+	out.append(reinterpret_cast<const char *>(&header), sizeof(header));
+	out.append(message, queue.offset, size);
+	queue.deficit -= size;
+	queue.offset += size;
+	queue.bytes -= size;
+	m_queuedBytes -= size;
+	if (last) {
+	  queue.messages.pop_front();
+	  queue.offset = 0;
+	  m_queuedMessages--;
+	}
+	return true;
+      }
+    }
+    m_current = (m_current + 1) % SEND_PRIORITY_CLASSES;
+    m_turnStarted = false;
+  }
+}
+
+size_t priority_scheduler::queuedBytes(send_priority_t priority) const noexcept {
+  return m_queues[size_t(priority)].bytes;
+}
+
+void priority_scheduler::clear() {
+  for (class_queue_t &queue : m_queues) {
+    queue = class_queue_t();
+  }
+  m_queuedBytes = 0;
+  m_queuedMessages = 0;
+  m_turnStarted = false;
+}
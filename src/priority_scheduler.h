@@ -0,0 +1,131 @@
+#pragma once
+
+/// MIT License
+/// Copyright (c) 2020
+///
+/// Description:
+/// This file contains the outbound priority scheduler of a connection.
+/// Messages are queued per priority class and cut into frames of at most
+/// chunkSize bytes; classes take turns by deficit round robin, each class
+/// sending up to weight * chunkSize bytes per turn. A control message thus
+/// waits for at most one turn of the other classes however large their
+/// messages are. Frames of different classes interleave on the wire, the
+/// peer reassembles messages with priority_frame_decoder.
+
+#include <endian.h>
+
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <string>
+
+enum class send_priority_t : uint8_t { CONTROL = 0, NORMAL = 1, BULK = 2 };
+
+#define SEND_PRIORITY_CLASSES 3
+
+/// Header in front of every frame, big endian. flags has
+/// PRIORITY_FRAME_END on the last frame of a message.
+struct priority_frame_header_t {
+  uint8_t priority;
+  uint8_t flags;
+  uint16_t reserved;
+  uint32_t size;
+};
+
+enum priority_frame_flags_t : uint8_t { PRIORITY_FRAME_END = 1 };
+
+/// Opt-in priority scheduling of a connection's sends; every byte sent on
+/// such a connection is framed. weights are per class in send_priority_t
+/// order. notSentLowat sets TCP_NOTSENT_LOWAT so that little data waits
+/// unsent in the kernel, where it can't be overtaken; 0 keeps the default.
+struct priority_config_t {
+  bool enabled = false;
+  size_t chunkSize = 16 * 1024;
+  uint32_t weights[SEND_PRIORITY_CLASSES] = {16, 4, 1};
+  size_t maxQueuedBytes = 16 << 20;  /// per class, sends fail beyond
+  int notSentLowat = 16 * 1024;
+};
+
+/// Not thread safe, the owner serializes access.
+class priority_scheduler {
+ public:
+  explicit priority_scheduler(const priority_config_t &config = {});
+
+  void push(send_priority_t priority, const char *msg, size_t size);
+  /// Append the next frame to out. Return false if nothing is queued.
+  bool next(std::string &out);
+  bool empty() const noexcept { return m_queuedBytes == 0 && m_queuedMessages == 0; }
+  size_t queuedBytes(send_priority_t priority) const noexcept;
+  void clear();
+
+ private:
+  struct class_queue_t {
+    std::deque<std::string> messages;
+    size_t offset = 0;  /// bytes of the front message already framed
+    size_t bytes = 0;
+    size_t deficit = 0;
+  };
+
+  priority_config_t m_config;
+  class_queue_t m_queues[SEND_PRIORITY_CLASSES];
+  size_t m_current = 0;
+  bool m_turnStarted = false;
+  size_t m_queuedBytes = 0;
+  size_t m_queuedMessages = 0;
+};
+
+/// Reassembles messages from frames produced by priority_scheduler.
+class priority_frame_decoder {
+ public:
+  explicit priority_frame_decoder(size_t maxMessageSize = 64 << 20)
+      : m_maxMessageSize{maxMessageSize} {}
+
+  /// Call onMessage(send_priority_t, const char *msg, size_t size) for
+  /// every complete message. Return false on a malformed frame or a
+  /// message beyond maxMessageSize; the decoder is reset in this case.
+  template <typename Func>
+  bool feed(const char *data, size_t size, Func &&onMessage);
+
+ private:
+  size_t m_maxMessageSize;
+  std::string m_input;  /// bytes of an incomplete frame
+  std::string m_messages[SEND_PRIORITY_CLASSES];
+};
+
+template <typename Func>
+bool priority_frame_decoder::feed(const char *data, size_t size,
+				  Func &&onMessage) {
+  m_input.append(data, size);
+  size_t pos = 0;
+  priority_frame_header_t header;
+  while (m_input.size() - pos >= sizeof(header)) {
+    memcpy(&header, m_input.data() + pos, sizeof(header));
+    size_t frameSize = be32toh(header.size);
+    if (header.priority >= SEND_PRIORITY_CLASSES ||
+	m_messages[header.priority].size() + frameSize > m_maxMessageSize) {
+      m_input.clear();
+      for (std::string &message : m_messages) {
+	message.clear();
+      }
+      return false;
+    }
+    if (m_input.size() - pos - sizeof(header) < frameSize) {
+      break;
+    }
+    const char *payload = m_input.data() + pos + sizeof(header);
+    std::string &message = m_messages[header.priority];
+    pos += sizeof(header) + frameSize;
+    if (!(header.flags & PRIORITY_FRAME_END)) {
+      message.append(payload, frameSize);
+    } else if (message.empty()) {  // single frame message
+      onMessage(send_priority_t(header.priority), payload, frameSize);
+    } else {
+      message.append(payload, frameSize);
+      onMessage(send_priority_t(header.priority), message.data(),
+		message.size());
+      message.clear();
+    }
+  }
+  m_input.erase(0, pos);
+  return true;
+}
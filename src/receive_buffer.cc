@@ -0,0 +1,39 @@
+/// MIT License
+/// Copyright (c) 2020
+///
+/// Description:
+/// This file contains implementation of the adaptive receive buffer.
+
+#include "receive_buffer.h"
+
+#include <algorithm>
+
+receive_buffer::receive_buffer(size_t minSize, size_t maxSize)
+    : m_minSize{std::max<size_t>(minSize, 1)},
+      m_maxSize{std::max(maxSize, m_minSize)},
+      m_size{m_minSize},
+      m_data{new char[m_size]} {}
+
+void receive_buffer::update(size_t bytes, size_t pending) {
+  size_t wanted = m_size;
+  if (bytes >= m_size) {
+    /* the stream outgrew the buffer, catch up with what is queued */
+    wanted = m_size * 2;
+    while (wanted < pending && wanted < m_maxSize) {
+      wanted *= 2;
+    }
+    m_smallReads = 0;
+  } else if (bytes < m_size / 4) {
+    if (++m_smallReads >= SHRINK_AFTER_READS) {
+      wanted = m_size / 2;
+      m_smallReads = 0;
+    }
+  } else {
+    m_smallReads = 0;
+  }
+  wanted = std::clamp(wanted, m_minSize, m_maxSize);
+  if (wanted != m_size) {
+    m_data.reset(new char[wanted]);
+    m_size = wanted;
+  }
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+/// MIT License
+/// Copyright (c) 2020
+///
+/// Description:
+/// This file contains the adaptive receive buffer of a connection. Its
+/// size follows the traffic: reads that fill the buffer grow it to what
+/// the kernel still has queued, so a bulk stream needs few large reads,
+/// and a run of small reads shrinks it again, so idle connections hold
+/// little memory.
+
+#include <cstddef>
+#include <memory>
+
+/// Opt-in adaptive reads; without it every read is MAX_PACKET_SIZE bytes.
+/// Read sizes stay within [minRead, maxRead]. A read that fills the buffer
+/// starts a burst: the socket is read on without blocking until it is
+/// drained (EAGAIN) or maxBurstBytes were read, and only then the receive
+/// loop goes back to its blocking wait.
+struct receive_config_t {
+  bool adaptive = false;
+  size_t minRead = 4096;
+  size_t maxRead = 256 * 1024;
+  size_t maxBurstBytes = 1 << 20;
+};
+
+class receive_buffer {
+ public:
+  /// Number of consecutive reads using less than a quarter of the buffer
+  /// after which it is halved.
+  static constexpr int SHRINK_AFTER_READS = 16;
+
+  receive_buffer(size_t minSize, size_t maxSize);
+
+  char *data() noexcept { return m_data.get(); }
+  size_t size() const noexcept { return m_size; }
+  /// Account a read of `bytes` bytes. pending is what the kernel still
+  /// holds (FIONREAD) after a read that filled the buffer, 0 if unknown.
+  /// The contents are lost when the buffer is resized.
+  void update(size_t bytes, size_t pending);
+
+ private:
+  size_t m_minSize;
+  size_t m_maxSize;
+  size_t m_size;
+  int m_smallReads = 0;
+  std::unique_ptr<char[]> m_data;
+};
@@ -0,0 +1,716 @@
+/// MIT License
+/// Copyright (c) 2020
+///
+/// Description:
+/// This file contains implementation of reliable ordered messaging over
+/// UDP.
+
+#include "reliable_udp.h"
+
+#include <endian.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+
+#include <algorithm>
+
+namespace {
+uint64_t address_key(const struct sockaddr_in &address) {
+  return uint64_t(ntohl(address.sin_addr.s_addr)) << 16 |
+	 ntohs(address.sin_port);
+}
+
+std::string make_datagram(uint8_t type, uint8_t flags, uint16_t stream,
+			  uint64_t sequence, const char *payload,
+			  size_t size) {
+  rudp_header_t header = {};
+  header.type = type;
+  header.flags = flags;
+  header.stream = htobe16(stream);
+  header.sequence = htobe64(sequence);
+  std::string datagram(reinterpret_cast<const char *>(&header),
+		       sizeof(header));
+  datagram.append(payload, size);
+  return datagram;
+}
+
+std::string make_datagram(uint8_t type, uint16_t stream, uint64_t sequence,
+			  uint64_t value) {
+  value = htobe64(value);
+  return make_datagram(type, 0, stream, sequence,
+		       reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+uint64_t elapsed_usec(std::chrono::steady_clock::time_point from,
+		      std::chrono::steady_clock::time_point to) {
+  return to <= from ? 0
+		    : std::chrono::duration_cast<std::chrono::microseconds>(
+			  to - from)
+			  .count();
+}
+}  // namespace
+
+void rtt_estimator::sample(uint64_t rttUsec) {
+  if (m_srtt == 0) {  // first sample
+    m_srtt = std::max<uint64_t>(rttUsec, 1);
+    m_rttvar = rttUsec / 2;
+  } else {
+    uint64_t deviation = m_srtt > rttUsec ? m_srtt - rttUsec : rttUsec - m_srtt;
+    m_rttvar = (3 * m_rttvar + deviation) / 4;
+    m_srtt = std::max<uint64_t>((7 * m_srtt + rttUsec) / 8, 1);
+  }
+  m_rto = std::min(std::max(m_srtt + 4 * m_rttvar, m_minRto), m_maxRto);
+}
+
+uint64_t rtt_estimator::timeoutUsec(int transmissions) const {
+  int shift = std::min(std::max(transmissions - 1, 0), 20);
+  return std::min(m_rto << shift, std::max(m_rto, m_maxRto));
+}
+
+ReliableUdpEndpoint::~ReliableUdpEndpoint() { finish(); }
+
+void ReliableUdpEndpoint::setConfig(const reliable_udp_config_t &config) {
+  std::lock_guard<std::mutex> lock(m_mtx);
+  m_config = config;
+}
+
+void ReliableUdpEndpoint::setLossInjection(const loss_injection_t &injection) {
+  std::lock_guard<std::mutex> lock(m_mtx);
+  m_injection = injection;
+  m_random.seed(injection.seed);
+}
+
+reliable_udp_stats_t ReliableUdpEndpoint::getStats() {
+  std::lock_guard<std::mutex> lock(m_mtx);
+  return m_stats;
+}
+
+int ReliableUdpEndpoint::getPort() const { return m_port; }
+
+pipe_ret_t ReliableUdpEndpoint::open(int port) {
+  if (m_serviceTask != nullptr) {
+    return pipe_ret_t::error(error_category_t::ALREADY_RUNNING);
+  }
+  m_sockfd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (m_sockfd == -1) {	 // socket failed
+    return pipe_ret_t::systemError(errno);
+  }
+  struct sockaddr_in address;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_ANY);
+  address.sin_port = htons(port);
+  socklen_t addressSize = sizeof(address);
+  if (bind(m_sockfd, (struct sockaddr *)&address, sizeof(address)) == -1 ||
+      getsockname(m_sockfd, (struct sockaddr *)&address, &addressSize) == -1) {
+    pipe_ret_t ret = pipe_ret_t::systemError(errno);
+    finish();
+    return ret;
+  }
+  m_port = ntohs(address.sin_port);
+  m_wakeupFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (m_wakeupFd == -1) {  // eventfd failed
+    pipe_ret_t ret = pipe_ret_t::systemError(errno);
+    finish();
+    return ret;
+  }
+  {
+    std::lock_guard<std::mutex> lock(m_mtx);
+    m_pacer.reset(new token_bucket(m_config.pacingRate, m_config.pacingBurst));
+    m_stats = reliable_udp_stats_t();
+  }
+  m_stop = false;
+  m_serviceTask = new std::thread(&ReliableUdpEndpoint::serviceTask, this);
+  return pipe_ret_t::ok();
+}
+
+uint32_t ReliableUdpEndpoint::addPeer(const struct sockaddr_in &address) {
+  std::lock_guard<std::mutex> lock(m_mtx);
+  return createPeer(address);
+}
+
+uint32_t ReliableUdpEndpoint::createPeer(const struct sockaddr_in &address) {
+  uint32_t id = m_nextPeerId++;
+  peer_t &peer = m_peers[id];
+  peer.address = address;
+  peer.client.setFileDescriptor(m_sockfd);
+  peer.client.setIp(inet_ntoa(address.sin_addr));
+  peer.client.setConnectionId(id);
+  peer.client.setConnected();
+  peer.lastHeard = clock::now();
+  peer.rtt = rtt_estimator(m_config.initialRtoUsec, m_config.minRtoUsec,
+			   m_config.maxRtoUsec);
+  m_peerIds[address_key(address)] = id;
+  return id;
+}
+
+/*
+ * Split the message into datagrams and send as many as the window and the
+ * pacer allow, the service thread sends the rest
+ */
+pipe_ret_t ReliableUdpEndpoint::send(uint32_t peerId, uint16_t stream,
+				     const char *msg, size_t size) {
+  std::lock_guard<std::mutex> lock(m_mtx);
+  auto peer = m_peers.find(peerId);
+  if (peer == m_peers.end()) {
+    return pipe_ret_t::error(error_category_t::PEER_CLOSED);
+  }
+  send_stream_t &state = peer->second.sendStreams[stream];
+  if (state.queuedBytes + size > m_config.maxQueuedBytes) {
+    return pipe_ret_t::error(error_category_t::NOT_READY);
+  }
+  const size_t maxPayload = m_config.maxDatagram - sizeof(rudp_header_t);
+  size_t offset = 0;
+  do {
+    size_t fragment = std::min(maxPayload, size - offset);
+    uint8_t flags = (offset + fragment == size) ? RUDP_MESSAGE_END : 0;
+    packet_t packet;
+    packet.sequence = state.nextSequence++;
+    packet.datagram = make_datagram(RUDP_DATA, flags, stream, packet.sequence,
+				    msg + offset, fragment);
+    state.queuedBytes += packet.datagram.size();
+    state.unsent.push_back(std::move(packet));
+    offset += fragment;
+  } while (offset < size);
+  transmit(peer->second, state, clock::now());
+  if (!state.unsent.empty()) {
+    wakeUp();
+  }
+  return pipe_ret_t::ok();
+}
+
+void ReliableUdpEndpoint::wakeUp() { eventfd_write(m_wakeupFd, 1); }
+
+/*
+ * The window spans maxInFlight sequences from the oldest unacknowledged
+ * one, so the receiver never has to drop a datagram for being too far ahead
+ */
+bool ReliableUdpEndpoint::windowOpen(const send_stream_t &state) const {
+  return !state.unsent.empty() &&
+	 (state.inFlight.empty() ||
+	  state.unsent.front().sequence <
+	      state.inFlight.begin()->first + m_config.maxInFlight);
+}
+
+/*
+ * Move unsent datagrams in flight while the window has room and the pacer
+ * has tokens
+ */
+void ReliableUdpEndpoint::transmit(peer_t &peer, send_stream_t &state,
+				   clock::time_point now) {
+  while (windowOpen(state)) {
+    packet_t &packet = state.unsent.front();
+    if (!m_pacer->unlimited()) {
+      if (m_pacer->available() < packet.datagram.size()) {
+	break;
+      }
+      m_pacer->consume(packet.datagram.size());
+    }
+    packet.sentAt = now;
+    packet.transmissions = 1;
+    sendDatagram(peer.address, packet.datagram);
+    uint64_t sequence = packet.sequence;
+    state.inFlight.emplace(sequence, std::move(packet));
+    state.unsent.pop_front();
+  }
+}
+
+void ReliableUdpEndpoint::retransmit(peer_t &peer, packet_t &packet,
+				     clock::time_point now) {
+  if (!m_pacer->unlimited()) {  // in debt rather than delaying recovery
+    m_pacer->consume(packet.datagram.size());
+  }
+  packet.sentAt = now;
+  packet.transmissions++;
+  m_stats.retransmissions++;
+  sendDatagram(peer.address, packet.datagram);
+}
+
+/*
+ * Apply loss injection, then send right away or at the injected delay
+ */
+void ReliableUdpEndpoint::sendDatagram(const struct sockaddr_in &address,
+				       const std::string &datagram) {
+  if (m_injection.lossRate > 0 &&
+      std::uniform_real_distribution<double>(0, 1)(m_random) <
+	  m_injection.lossRate) {
+    m_stats.datagramsDropped++;
+    return;
+  }
+  if (m_injection.delayUsec > 0 || m_injection.jitterUsec > 0) {
+    uint32_t delay = m_injection.delayUsec;
+    if (m_injection.jitterUsec > 0) {
+      delay += std::uniform_int_distribution<uint32_t>(
+	  0, m_injection.jitterUsec)(m_random);
+    }
+    m_delayed.emplace(clock::now() + std::chrono::microseconds(delay),
+		      delayed_datagram_t{address, datagram});
+    wakeUp();
+    return;
+  }
+  // a full socket buffer counts as a loss, retransmission recovers it
+  sendto(m_sockfd, datagram.data(), datagram.size(), 0,
+	 (const struct sockaddr *)&address, sizeof(address));
+  m_stats.datagramsSent++;
+}
+
+void ReliableUdpEndpoint::sendDelayed(clock::time_point now) {
+  auto it = m_delayed.begin();
+  while (it != m_delayed.end() && it->first <= now) {
+    sendto(m_sockfd, it->second.datagram.data(), it->second.datagram.size(),
+	   0, (const struct sockaddr *)&it->second.address,
+	   sizeof(it->second.address));
+    m_stats.datagramsSent++;
+    it = m_delayed.erase(it);
+  }
+}
+
+/*
+ * Receive in batches; after each batch acknowledge what arrived, run the
+ * timers and publish complete messages outside the lock
+ */
+void ReliableUdpEndpoint::serviceTask() {
+  size_t slotSize;
+  {
+    std::lock_guard<std::mutex> lock(m_mtx);
+    slotSize = m_config.maxDatagram;
+  }
+  std::vector<char> buffer(RUDP_BATCH_SIZE * slotSize);
+  struct iovec iovs[RUDP_BATCH_SIZE];
+  struct mmsghdr msgs[RUDP_BATCH_SIZE];
+  struct sockaddr_in addresses[RUDP_BATCH_SIZE];
+  std::vector<delivery_t> deliveries;
+  while (!m_stop) {
+    uint64_t timeoutUsec;
+    {
+      std::lock_guard<std::mutex> lock(m_mtx);
+      timeoutUsec = nextTimeoutUsec(clock::now());
+    }
+    struct timespec timeout = {time_t(timeoutUsec / 1000000),
+			       long(timeoutUsec % 1000000) * 1000};
+    struct pollfd pfds[2] = {{m_sockfd, POLLIN, 0}, {m_wakeupFd, POLLIN, 0}};
+    if (ppoll(pfds, 2, &timeout, nullptr) == -1 && errno != EINTR) {
+      break;
+    }
+    if (pfds[1].revents & POLLIN) {
+      eventfd_t value;
+      eventfd_read(m_wakeupFd, &value);
+    }
+    int received = 0;
+    if (pfds[0].revents & POLLIN) {
+      for (int i = 0; i < RUDP_BATCH_SIZE; i++) {
+	iovs[i].iov_base = &buffer[i * slotSize];
+	iovs[i].iov_len = slotSize;
+	memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+	msgs[i].msg_hdr.msg_iov = &iovs[i];
+	msgs[i].msg_hdr.msg_iovlen = 1;
+	msgs[i].msg_hdr.msg_name = &addresses[i];
+	msgs[i].msg_hdr.msg_namelen = sizeof(addresses[i]);
+      }
+      received = recvmmsg(m_sockfd, msgs, RUDP_BATCH_SIZE, 0, nullptr);
+    }
+    {
+      std::lock_guard<std::mutex> lock(m_mtx);
+      clock::time_point now = clock::now();
+      for (int i = 0; i < received; i++) {
+	if (!(msgs[i].msg_hdr.msg_flags & MSG_TRUNC)) {
+	  onDatagram(addresses[i], static_cast<const char *>(iovs[i].iov_base),
+		     msgs[i].msg_len, now);
+	}
+      }
+      sendDelayed(now);
+      for (auto it = m_peers.begin(); it != m_peers.end();) {
+	sendAcks(it->second);
+	bool idle = isIdle(it->second, now);
+	if (!idle && checkTimers(it->second, now)) {
+	  it++;
+	  continue;
+	}
+	// the peer went silent or stopped acknowledging, forget it
+	m_deliveries.push_back({it->second.client, 0, std::string(), true});
+	if (idle) {
+	  m_stats.peersIdle++;
+	} else {
+	  m_stats.peersLost++;
+	}
+	m_peerIds.erase(address_key(it->second.address));
+	it = m_peers.erase(it);
+      }
+      deliveries.swap(m_deliveries);
+    }
+    for (delivery_t &delivery : deliveries) {
+      if (delivery.disconnected) {
+	delivery.peer.setDisconnected();
+	publishDisconnected(delivery.peer);
+      } else {
+	publishMessage(delivery.peer, delivery.stream, delivery.message.data(),
+		       delivery.message.size());
+      }
+    }
+    deliveries.clear();
+  }
+}
+
+/*
+ * Time until the earliest retransmission timeout, paced datagram or
+ * delayed datagram, at most 100ms so that finish() is noticed
+ */
+uint64_t ReliableUdpEndpoint::nextTimeoutUsec(clock::time_point now) {
+  uint64_t timeout = 100000;
+  if (!m_delayed.empty()) {
+    timeout = std::min(timeout, elapsed_usec(now, m_delayed.begin()->first));
+  }
+  for (auto &peer : m_peers) {
+    for (auto &stream : peer.second.sendStreams) {
+      send_stream_t &state = stream.second;
+      for (auto &packet : state.inFlight) {
+	timeout = std::min(
+	    timeout, elapsed_usec(now, deadline(peer.second, packet.second)));
+      }
+      if (windowOpen(state)) {
+	timeout = std::min(
+	    timeout, m_pacer->waitTimeUsec(state.unsent.front().datagram.size()));
+      }
+    }
+  }
+  return timeout;
+}
+
+void ReliableUdpEndpoint::onDatagram(const struct sockaddr_in &from,
+				     const char *data, size_t size,
+				     clock::time_point now) {
+  rudp_header_t header;
+  if (size < sizeof(header)) {
+    return;
+  }
+  memcpy(&header, data, sizeof(header));
+  header.stream = be16toh(header.stream);
+  header.sequence = be64toh(header.sequence);
+  const char *payload = data + sizeof(header);
+  size -= sizeof(header);
+  m_stats.datagramsReceived++;
+
+  uint32_t peerId;
+  auto id = m_peerIds.find(address_key(from));
+  if (id != m_peerIds.end()) {
+    peerId = id->second;
+  } else if (m_acceptPeers && header.type == RUDP_DATA) {
+    if (m_peers.size() >= m_config.maxPeers) {
+      m_stats.peersRefused++;
+      return;
+    }
+    peerId = createPeer(from);
+    m_peers[peerId].accepted = true;
+  } else {
+    return;
+  }
+  peer_t &peer = m_peers[peerId];
+  peer.lastHeard = now;
+  uint64_t value = 0;
+  if (header.type != RUDP_DATA) {
+    if (size < sizeof(value)) {
+      return;
+    }
+    memcpy(&value, payload, sizeof(value));
+    value = be64toh(value);
+  }
+  switch (header.type) {
+    case RUDP_DATA:
+      onData(peer, header, payload, size);
+      break;
+    case RUDP_ACK:
+      onAck(peer, header.stream, header.sequence, value, now);
+      break;
+    case RUDP_NACK:
+      onNack(peer, header.stream, header.sequence, value, now);
+      break;
+  }
+}
+
+/*
+ * Deliver in order, hold datagrams after a gap and report each new gap
+ * once with a NACK
+ */
+void ReliableUdpEndpoint::onData(peer_t &peer, const rudp_header_t &header,
+				 const char *payload, size_t size) {
+  receive_stream_t &state = peer.receiveStreams[header.stream];
+  uint64_t sequence = header.sequence;
+  state.ackPending = true;  // also for duplicates, the ACK may have been lost
+  if (sequence < state.next || sequence >= state.next + m_config.maxInFlight ||
+      state.pending.count(sequence) > 0) {
+    return;
+  }
+  if (sequence > state.highestSeen + 1) {
+    sendDatagram(peer.address,
+		 make_datagram(RUDP_NACK, header.stream,
+			       std::max(state.next, state.highestSeen + 1),
+			       sequence - 1));
+  }
+  state.highestSeen = std::max(state.highestSeen, sequence);
+  if (sequence != state.next) {
+    state.pending.emplace(sequence,
+			  std::make_pair(header.flags, std::string(payload, size)));
+    return;
+  }
+  acceptFragment(peer, header.stream, state, header.flags, payload, size);
+  auto it = state.pending.begin();
+  while (it != state.pending.end() && it->first == state.next) {
+    acceptFragment(peer, header.stream, state, it->second.first,
+		   it->second.second.data(), it->second.second.size());
+    it = state.pending.erase(it);
+  }
+}
+
+void ReliableUdpEndpoint::acceptFragment(peer_t &peer, uint16_t stream,
+					 receive_stream_t &state,
+					 uint8_t flags, const char *payload,
+					 size_t size) {
+  state.next++;
+  state.message.append(payload, size);
+  if (flags & RUDP_MESSAGE_END) {
+    m_deliveries.push_back({peer.client, stream, std::move(state.message),
+			    false});
+    state.message.clear();
+    m_stats.messagesDelivered++;
+  }
+}
+
+void ReliableUdpEndpoint::sendAcks(peer_t &peer) {
+  for (auto &stream : peer.receiveStreams) {
+    receive_stream_t &state = stream.second;
+    if (!state.ackPending) {
+      continue;
+    }
+    state.ackPending = false;
+    uint64_t received = 0;
+    for (auto &pending : state.pending) {
+      uint64_t bit = pending.first - state.next - 1;
+      if (bit >= 64) {
+	break;
+      }
+      received |= uint64_t(1) << bit;
+    }
+    sendDatagram(peer.address,
+		 make_datagram(RUDP_ACK, stream.first, state.next, received));
+  }
+}
+
+/*
+ * Drop acknowledged datagrams and take an RTT sample from the newest one
+ * that was sent only once
+ */
+void ReliableUdpEndpoint::onAck(peer_t &peer, uint16_t stream, uint64_t next,
+				uint64_t received, clock::time_point now) {
+  auto found = peer.sendStreams.find(stream);
+  if (found == peer.sendStreams.end()) {
+    return;
+  }
+  send_stream_t &state = found->second;
+  clock::time_point newestSent;
+  bool sampled = false;
+  auto acknowledge = [&](std::map<uint64_t, packet_t>::iterator it) {
+    if (it->second.transmissions == 1 &&
+	(!sampled || it->second.sentAt > newestSent)) {
+      newestSent = it->second.sentAt;
+      sampled = true;
+    }
+    state.queuedBytes -= it->second.datagram.size();
+    return state.inFlight.erase(it);
+  };
+  auto it = state.inFlight.begin();
+  while (it != state.inFlight.end() && it->first < next) {
+    it = acknowledge(it);
+  }
+  for (int bit = 0; received != 0 && bit < 64; bit++) {
+    if (received & (uint64_t(1) << bit)) {
+      auto acked = state.inFlight.find(next + 1 + bit);
+      if (acked != state.inFlight.end()) {
+	acknowledge(acked);
+      }
+    }
+  }
+  if (sampled) {
+    peer.rtt.sample(elapsed_usec(newestSent, now));
+  }
+  transmit(peer, state, now);
+}
+
+/*
+ * Retransmit a reported gap at once, unless it was retransmitted less than
+ * a round trip ago
+ */
+void ReliableUdpEndpoint::onNack(peer_t &peer, uint16_t stream, uint64_t from,
+				 uint64_t to, clock::time_point now) {
+  auto found = peer.sendStreams.find(stream);
+  if (found == peer.sendStreams.end()) {
+    return;
+  }
+  std::map<uint64_t, packet_t> &inFlight = found->second.inFlight;
+  for (auto it = inFlight.lower_bound(from);
+       it != inFlight.end() && it->first <= to; it++) {
+    if (elapsed_usec(it->second.sentAt, now) >= peer.rtt.srttUsec()) {
+      retransmit(peer, it->second, now);
+    }
+  }
+}
+
+ReliableUdpEndpoint::clock::time_point ReliableUdpEndpoint::deadline(
+    const peer_t &peer, const packet_t &packet) const {
+  return packet.sentAt +
+	 std::chrono::microseconds(peer.rtt.timeoutUsec(packet.transmissions));
+}
+
+/*
+ * Retransmit datagrams whose timeout expired and send what pacing allows
+ * now. Return false if a datagram ran out of transmissions
+ */
+bool ReliableUdpEndpoint::checkTimers(peer_t &peer, clock::time_point now) {
+  for (auto &stream : peer.sendStreams) {
+    send_stream_t &state = stream.second;
+    for (auto &packet : state.inFlight) {
+      if (now < deadline(peer, packet.second)) {
+	continue;
+      }
+      if (packet.second.transmissions >= m_config.maxTransmissions) {
+	return false;
+      }
+      retransmit(peer, packet.second, now);
+    }
+    transmit(peer, state, now);
+  }
+  return true;
+}
+
+bool ReliableUdpEndpoint::isIdle(const peer_t &peer,
+				 clock::time_point now) const {
+  return peer.accepted && m_config.peerIdleMs > 0 &&
+	 now - peer.lastHeard >= std::chrono::milliseconds(m_config.peerIdleMs);
+}
+
+/*
+ * Called from an observer the service thread is detached instead of joined,
+ * it exits once the observer returns
+ */
+pipe_ret_t ReliableUdpEndpoint::finish() {
+  m_stop = true;
+  if (m_serviceTask != nullptr) {
+    wakeUp();
+    join_or_detach(m_serviceTask);
+  }
+  {
+    std::lock_guard<std::mutex> lock(m_mtx);
+    m_peers.clear();
+    m_peerIds.clear();
+    m_delayed.clear();
+    m_deliveries.clear();
+  }
+  if (m_wakeupFd != -1) {
+    close(m_wakeupFd);
+    m_wakeupFd = -1;
+  }
+  m_port = 0;
+  if (m_sockfd == -1) {
+    return pipe_ret_t::ok();
+  }
+  int closeRet = close(m_sockfd);
+  m_sockfd = -1;
+  return closeRet == -1 ? pipe_ret_t::systemError(errno) : pipe_ret_t::ok();
+}
+
+ReliableUdpServer::ReliableUdpServer() { m_acceptPeers = true; }
+
+// the service thread publishes through this object, stop it first
+ReliableUdpServer::~ReliableUdpServer() { finish(); }
+
+pipe_ret_t ReliableUdpServer::start(int port) { return open(port); }
+
+void ReliableUdpServer::subscribe(uint16_t stream,
+				  const server_observer_t &observer) {
+  m_subscibers[stream].push_back(observer);
+}
+
+void ReliableUdpServer::unsubscribeAll() { m_subscibers.clear(); }
+
+pipe_ret_t ReliableUdpServer::sendToClient(const Client &client,
+					   uint16_t stream, const char *msg,
+					   size_t size) {
+  return send(client.getConnectionId(), stream, msg, size);
+}
+
+void ReliableUdpServer::publishMessage(const Client &peer, uint16_t stream,
+				       const char *msg, size_t size) {
+  auto observers = m_subscibers.find(stream);
+  if (observers == m_subscibers.end()) {
+    return;
+  }
+  for (const server_observer_t &observer : observers->second) {
+    if (observer.incoming_packet_func != nullptr &&
+	(observer.wantedIp.empty() || observer.wantedIp == peer.getIpView())) {
+      observer.incoming_packet_func(peer, msg, size);
+    }
+  }
+}
+
+void ReliableUdpServer::publishDisconnected(const Client &peer) {
+  for (auto &observers : m_subscibers) {
+    for (const server_observer_t &observer : observers.second) {
+      if (observer.disconnected_func != nullptr &&
+	  (observer.wantedIp.empty() || observer.wantedIp == peer.getIpView())) {
+	observer.disconnected_func(peer);
+      }
+    }
+  }
+}
+
+ReliableUdpClient::~ReliableUdpClient() { finish(); }
+
+pipe_ret_t ReliableUdpClient::connectTo(const std::string &address, int port) {
+  struct sockaddr_in server;
+  memset(&server, 0, sizeof(server));
+  server.sin_family = AF_INET;
+  server.sin_port = htons(port);
+  if (!inet_aton(address.c_str(), &server.sin_addr)) {
+    return pipe_ret_t::error(error_category_t::INVALID_ADDRESS);
+  }
+  pipe_ret_t ret = open(0);
+  if (!ret.success) {
+    return ret;
+  }
+  m_serverId = addPeer(server);
+  return ret;
+}
+
+void ReliableUdpClient::subscribe(uint16_t stream,
+				  const client_observer_t &observer) {
+  m_subscibers[stream].push_back(observer);
+}
+
+void ReliableUdpClient::unsubscribeAll() { m_subscibers.clear(); }
+
+pipe_ret_t ReliableUdpClient::sendMsg(uint16_t stream, const char *msg,
+				      size_t size) {
+  return send(m_serverId, stream, msg, size);
+}
+
+void ReliableUdpClient::publishMessage(const Client &, uint16_t stream,
+				       const char *msg, size_t size) {
+  auto observers = m_subscibers.find(stream);
+  if (observers == m_subscibers.end()) {
+    return;
+  }
+  for (const client_observer_t &observer : observers->second) {
+    if (observer.incoming_packet_func != nullptr) {
+      observer.incoming_packet_func(msg, size);
+    }
+  }
+}
+
+void ReliableUdpClient::publishDisconnected(const Client &) {
+  for (auto &observers : m_subscibers) {
+    for (const client_observer_t &observer : observers.second) {
+      if (observer.disconnected_func != nullptr) {
+	observer.disconnected_func(
+	    pipe_ret_t::error(error_category_t::TIMEOUT));
+      }
+    }
+  }
+}
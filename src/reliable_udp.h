@@ -0,0 +1,261 @@
+#pragma once
+
+/// MIT License
+/// Copyright (c) 2020
+///
+/// Description:
+/// This file contains reliable ordered messaging over UDP. Every peer
+/// carries any number of independent streams; each stream numbers its
+/// datagrams, so a loss delays only the stream it happened on. Receivers
+/// acknowledge cumulatively with a selective bitmap and report gaps right
+/// away with a NACK; senders retransmit on NACK and after a retransmission
+/// timeout derived from the measured round trip time, and pace new data
+/// with a token bucket. Messages larger than a datagram are fragmented and
+/// observers get whole messages in order, per stream.
+
+#include <random>
+
+#include "tcp_udp_srv_cli.h"
+
+#define RUDP_BATCH_SIZE 32
+
+enum rudp_type_t : uint8_t { RUDP_DATA = 0, RUDP_ACK = 1, RUDP_NACK = 2 };
+enum rudp_flags_t : uint8_t { RUDP_MESSAGE_END = 1 };
+
+/// Header in front of every datagram, big endian. sequence is the stream
+/// sequence of DATA (starting at 1), the next expected sequence of ACK and
+/// the first missing sequence of NACK. ACK is followed by a 64 bit map of
+/// the sequences after the next expected one that were received, NACK by
+/// the last missing sequence.
+struct rudp_header_t {
+  uint8_t type;
+  uint8_t flags;
+  uint16_t stream;
+  uint32_t reserved;
+  uint64_t sequence;
+};
+
+/// Both ends must use the same maxDatagram and maxInFlight. pacingRate is
+/// in bytes per second of new data, 0 for no pacing; retransmissions are
+/// never held back. A peer whose datagram went out maxTransmissions times
+/// without being acknowledged is reported disconnected. Servers also drop
+/// peers they heard nothing from for peerIdleMs (0 to keep them) and
+/// ignore new sources while they have maxPeers.
+struct reliable_udp_config_t {
+  size_t maxDatagram = 1200;
+  size_t maxInFlight = 256;  /// datagrams per stream
+  size_t maxQueuedBytes = 4 << 20;  /// per stream, sendMsg fails beyond
+  double pacingRate = 0;
+  double pacingBurst = 64 * 1024;
+  uint32_t initialRtoUsec = 50000;
+  uint32_t minRtoUsec = 1000;
+  uint32_t maxRtoUsec = 1000000;
+  int maxTransmissions = 20;
+  uint32_t peerIdleMs = 30000;
+  size_t maxPeers = 4096;
+};
+
+/// Drops outgoing datagrams with probability lossRate and delays the rest
+/// by delayUsec plus a uniform random jitter, to test recovery on loopback.
+struct loss_injection_t {
+  double lossRate = 0;
+  uint32_t delayUsec = 0;
+  uint32_t jitterUsec = 0;
+  uint32_t seed = 1;
+};
+
+struct reliable_udp_stats_t {
+  uint64_t datagramsSent = 0;  /// including ACK, NACK and retransmissions
+  uint64_t datagramsReceived = 0;
+  uint64_t datagramsDropped = 0;  /// by the loss injector
+  uint64_t retransmissions = 0;
+  uint64_t messagesDelivered = 0;
+  uint64_t peersLost = 0;
+  uint64_t peersIdle = 0;  /// dropped after peerIdleMs of silence
+  uint64_t peersRefused = 0;  /// new sources ignored at maxPeers
+};
+
+/// Round trip time and retransmission timeout as in RFC 6298, in
+/// microseconds. Feed only samples of datagrams sent once (Karn).
+class rtt_estimator {
+ public:
+  rtt_estimator(uint64_t initialRtoUsec = 50000, uint64_t minRtoUsec = 1000,
+		uint64_t maxRtoUsec = 1000000)
+      : m_rto{initialRtoUsec}, m_minRto{minRtoUsec}, m_maxRto{maxRtoUsec} {}
+
+  void sample(uint64_t rttUsec);
+  uint64_t srttUsec() const noexcept { return m_srtt; }
+  uint64_t rtoUsec() const noexcept { return m_rto; }
+  /// Timeout of a datagram sent `transmissions` times: doubles with every
+  /// retransmission, up to the maximum.
+  uint64_t timeoutUsec(int transmissions) const;
+
+ private:
+  uint64_t m_srtt = 0;
+  uint64_t m_rttvar = 0;
+  uint64_t m_rto;
+  uint64_t m_minRto;
+  uint64_t m_maxRto;
+};
+
+/// Socket, service thread and per peer state shared by ReliableUdpServer
+/// and ReliableUdpClient. The service thread receives, acknowledges,
+/// retransmits and publishes; observers are called without locks held, so
+/// they may send.
+class ReliableUdpEndpoint {
+ public:
+  virtual ~ReliableUdpEndpoint();
+  /// Applies to the next start or connectTo.
+  void setConfig(const reliable_udp_config_t &config);
+  void setLossInjection(const loss_injection_t &injection);
+  reliable_udp_stats_t getStats();
+  /// Port the socket is bound to, 0 if it isn't open.
+  int getPort() const;
+  /// Stop and close the socket. Unacknowledged data is dropped.
+  pipe_ret_t finish();
+
+ protected:
+  using clock = std::chrono::steady_clock;
+
+  pipe_ret_t open(int port);
+  uint32_t addPeer(const struct sockaddr_in &address);
+  pipe_ret_t send(uint32_t peerId, uint16_t stream, const char *msg,
+		  size_t size);
+  virtual void publishMessage(const Client &peer, uint16_t stream,
+			      const char *msg, size_t size) = 0;
+  virtual void publishDisconnected(const Client &peer) = 0;
+
+  /// Server endpoints create a peer for every new address sending data,
+  /// clients talk only to the peer they added.
+  bool m_acceptPeers = false;
+
+ private:
+  struct packet_t {
+    uint64_t sequence;
+    std::string datagram;
+    clock::time_point sentAt;
+    int transmissions = 0;
+  };
+
+  struct send_stream_t {
+    uint64_t nextSequence = 1;
+    size_t queuedBytes = 0;
+    std::deque<packet_t> unsent;
+    std::map<uint64_t, packet_t> inFlight;
+  };
+
+  struct receive_stream_t {
+    uint64_t next = 1;
+    uint64_t highestSeen = 0;
+    bool ackPending = false;
+    std::map<uint64_t, std::pair<uint8_t, std::string>> pending;
+    std::string message;  /// fragments of the message being reassembled
+  };
+
+  struct peer_t {
+    struct sockaddr_in address;
+    Client client;
+    bool accepted = false;  /// created for a source, not added
+    clock::time_point lastHeard;
+    rtt_estimator rtt;
+    std::map<uint16_t, send_stream_t> sendStreams;
+    std::map<uint16_t, receive_stream_t> receiveStreams;
+  };
+
+  struct delivery_t {
+    Client peer;
+    uint16_t stream;
+    std::string message;
+    bool disconnected;
+  };
+
+  struct delayed_datagram_t {
+    struct sockaddr_in address;
+    std::string datagram;
+  };
+
+  int m_sockfd = -1;
+  int m_wakeupFd = -1;
+  int m_port = 0;
+  std::atomic<bool> m_stop{false};
+  std::thread *m_serviceTask = nullptr;
+
+  /// Guards everything below
+  std::mutex m_mtx;
+  reliable_udp_config_t m_config;
+  loss_injection_t m_injection;
+  std::mt19937 m_random;
+  std::unique_ptr<token_bucket> m_pacer;
+  std::map<uint32_t, peer_t> m_peers;
+  std::map<uint64_t, uint32_t> m_peerIds;  /// by address
+  uint32_t m_nextPeerId = 1;
+  std::multimap<clock::time_point, delayed_datagram_t> m_delayed;
+  std::vector<delivery_t> m_deliveries;
+  reliable_udp_stats_t m_stats;
+
+  void serviceTask();
+  void wakeUp();
+  uint32_t createPeer(const struct sockaddr_in &address);
+  bool windowOpen(const send_stream_t &state) const;
+  uint64_t nextTimeoutUsec(clock::time_point now);
+  void onDatagram(const struct sockaddr_in &from, const char *data,
+		  size_t size, clock::time_point now);
+  void onData(peer_t &peer, const rudp_header_t &header, const char *payload,
+	      size_t size);
+  void onAck(peer_t &peer, uint16_t stream, uint64_t next, uint64_t received,
+	     clock::time_point now);
+  void onNack(peer_t &peer, uint16_t stream, uint64_t from, uint64_t to,
+	      clock::time_point now);
+  void acceptFragment(peer_t &peer, uint16_t stream, receive_stream_t &state,
+		      uint8_t flags, const char *payload, size_t size);
+  void transmit(peer_t &peer, send_stream_t &state, clock::time_point now);
+  void retransmit(peer_t &peer, packet_t &packet, clock::time_point now);
+  void sendAcks(peer_t &peer);
+  bool checkTimers(peer_t &peer, clock::time_point now);
+  bool isIdle(const peer_t &peer, clock::time_point now) const;
+  clock::time_point deadline(const peer_t &peer, const packet_t &packet) const;
+  void sendDelayed(clock::time_point now);
+  void sendDatagram(const struct sockaddr_in &address,
+		    const std::string &datagram);
+};
+
+/// Accepts peers on a port. Clients are identified by the Client handed to
+/// observers (its connection id names the peer) and answered with
+/// sendToClient.
+class ReliableUdpServer : public ReliableUdpEndpoint {
+ private:
+  std::map<uint16_t, std::vector<server_observer_t>> m_subscibers;
+
+  void publishMessage(const Client &peer, uint16_t stream, const char *msg,
+		      size_t size) override;
+  void publishDisconnected(const Client &peer) override;
+
+ public:
+  ReliableUdpServer();
+  ~ReliableUdpServer();
+  pipe_ret_t start(int port);
+  /// Observe messages of one stream. Subscribe before start.
+  void subscribe(uint16_t stream, const server_observer_t &observer);
+  void unsubscribeAll();
+  pipe_ret_t sendToClient(const Client &client, uint16_t stream,
+			  const char *msg, size_t size);
+};
+
+class ReliableUdpClient : public ReliableUdpEndpoint {
+ private:
+  uint32_t m_serverId = 0;
+  std::map<uint16_t, std::vector<client_observer_t>> m_subscibers;
+
+  void publishMessage(const Client &peer, uint16_t stream, const char *msg,
+		      size_t size) override;
+  void publishDisconnected(const Client &peer) override;
+
+ public:
+  ~ReliableUdpClient();
+  /// Bind an ephemeral port and talk to the server at address (IPv4).
+  pipe_ret_t connectTo(const std::string &address, int port);
+  /// Observe messages of one stream. Subscribe before connectTo.
+  void subscribe(uint16_t stream, const client_observer_t &observer);
+  void unsubscribeAll();
+  pipe_ret_t sendMsg(uint16_t stream, const char *msg, size_t size);
+};
@@ -24,23 +24,369 @@
 
 #include "tcp_udp_srv_cli.h"
 
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#include <fcntl.h>
+#include <linux/sockios.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/un.h>
+
+#include <charconv>
+#include <fstream>
+
+namespace {
+inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#endif
+}
+
+uint64_t timespec_ns(const struct timespec &ts) {
+  return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+uint64_t realtime_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return timespec_ns(ts);
+}
+
+/// recv() that also returns the RX timestamps of the data when timestamps
+/// is set and the socket has SO_TIMESTAMPING enabled.
+ssize_t recv_timestamped(int sockfd, char *buf, size_t size, int flags,
+			 packet_timestamps_t *timestamps) {
+  if (timestamps == nullptr) {
+    return recv(sockfd, buf, size, flags);
+  }
+  struct iovec iov = {buf, size};
+  char control[CMSG_SPACE(sizeof(struct scm_timestamping))];
+  struct msghdr hdr = {};
+  hdr.msg_iov = &iov;
+  hdr.msg_iovlen = 1;
+  hdr.msg_control = control;
+  hdr.msg_controllen = sizeof(control);
+  ssize_t ret = recvmsg(sockfd, &hdr, flags);
+  *timestamps = packet_timestamps_t();
+  for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr); ret > 0 && cmsg != nullptr;
+       cmsg = CMSG_NXTHDR(&hdr, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPING) {
+      struct scm_timestamping stamps;
+      memcpy(&stamps, CMSG_DATA(cmsg), sizeof(stamps));
+      timestamps->softwareNs = timespec_ns(stamps.ts[0]);
+      timestamps->hardwareNs = timespec_ns(stamps.ts[2]);
+    }
+  }
+  return ret;
+}
+
+/// Receive without sleeping in the kernel: spin on MSG_DONTWAIT until data
+/// arrives, the socket fails or running() turns false.
+/// Return like recv()
+template <typename Running>
+ssize_t recv_spinning(int sockfd, char *buf, size_t size, Running &&running,
+		      packet_timestamps_t *timestamps = nullptr) {
+  for (;;) {
+    ssize_t ret = recv_timestamped(sockfd, buf, size, MSG_DONTWAIT, timestamps);
+    if (ret >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK) || !running()) {
+      return ret;
+    }
+    cpu_relax();
+  }
+}
+
+void enable_busy_poll(int sockfd, const io_thread_config_t &config) {
+  // Values above net.core.busy_poll need CAP_NET_ADMIN, spinning in user
+  // space still works without it
+  int usec = config.busyPollUsec;
+  setsockopt(sockfd, SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof(usec));
+}
+
+/// Return false if the kernel refused the flags.
+bool enable_timestamping(int sockfd, const timestamping_config_t &config) {
+  int flags = 0;
+  if (config.rx) {
+    flags |= SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+    if (config.hardware) {
+      flags |= SOF_TIMESTAMPING_RX_HARDWARE | SOF_TIMESTAMPING_RAW_HARDWARE;
+    }
+  }
+  if (config.tx) {
+    // OPT_ID tags every stamp with the byte offset of the send it covers
+    flags |= SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE |
+	     SOF_TIMESTAMPING_OPT_ID | SOF_TIMESTAMPING_OPT_TSONLY;
+    if (config.hardware) {
+      flags |= SOF_TIMESTAMPING_TX_HARDWARE | SOF_TIMESTAMPING_RAW_HARDWARE;
+    }
+  }
+  return flags == 0 ||
+	 setsockopt(sockfd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) == 0;
+}
+
+/// Return false if the kernel refused a size.
+bool set_socket_buffers(int sockfd, const socket_buffer_config_t &config) {
+  if (config.receiveBytes != SOCKET_BUFFER_AUTO &&
+      setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &config.receiveBytes,
+		 sizeof(config.receiveBytes)) == -1) {
+    return false;
+  }
+  return config.sendBytes == SOCKET_BUFFER_AUTO ||
+	 setsockopt(sockfd, SOL_SOCKET, SO_SNDBUF, &config.sendBytes,
+		    sizeof(config.sendBytes)) == 0;
+}
+
+/// Buffer for the reads of a connection: fixed MAX_PACKET_SIZE bytes
+/// unless the config is adaptive.
+receive_buffer make_receive_buffer(const receive_config_t &config) {
+  if (!config.adaptive) {
+    return receive_buffer(MAX_PACKET_SIZE, MAX_PACKET_SIZE);
+  }
+  return receive_buffer(config.minRead, config.maxRead);
+}
+
+/// Bytes queued for reading on the socket, 0 if unknown.
+size_t pending_bytes(int sockfd) {
+  int pending = 0;
+  return ioctl(sockfd, FIONREAD, &pending) == 0 && pending > 0 ? pending : 0;
+}
+
+/// Pass fd over a connected Unix socket as SCM_RIGHTS ancillary data.
+bool send_fd(int unixfd, int fd) {
+  char byte = 0;
+  struct iovec iov = {&byte, 1};
+  char control[CMSG_SPACE(sizeof(int))] = {};
+  struct msghdr hdr = {};
+  hdr.msg_iov = &iov;
+  hdr.msg_iovlen = 1;
+  hdr.msg_control = control;
+  hdr.msg_controllen = sizeof(control);
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+  return sendmsg(unixfd, &hdr, 0) == 1;
+}
+
+/// Return fd received over a Unix socket, -1 on failure.
+int recv_fd(int unixfd) {
+  char byte;
+  struct iovec iov = {&byte, 1};
+  char control[CMSG_SPACE(sizeof(int))] = {};
+  struct msghdr hdr = {};
+  hdr.msg_iov = &iov;
+  hdr.msg_iovlen = 1;
+  hdr.msg_control = control;
+  hdr.msg_controllen = sizeof(control);
+  if (recvmsg(unixfd, &hdr, MSG_CMSG_CLOEXEC) != 1) {
+    return -1;
+  }
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr);
+  if (cmsg == nullptr || cmsg->cmsg_level != SOL_SOCKET ||
+      cmsg->cmsg_type != SCM_RIGHTS) {
+    errno = EBADMSG;
+    return -1;
+  }
+  int fd;
+  memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+  return fd;
+}
+
+bool make_unix_address(const std::string &path, struct sockaddr_un &address) {
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(address.sun_path)) {
+    errno = ENAMETOOLONG;
+    return false;
+  }
+  memcpy(address.sun_path, path.c_str(), path.size());
+  return true;
+}
+
+/// Server whose receive thread is the calling thread, if any.
+thread_local const TcpServer *t_receiveServer = nullptr;
+
+io_thread_config_t resolve_io_config(const io_thread_config_t &config) {
+  io_thread_config_t resolved = config;
+  if (resolved.cpus.empty() && resolved.numaNode >= 0) {
+    resolved.cpus = numa_node_cpus(resolved.numaNode);
+  }
+  return resolved;
+}
+
+/// Send all of data on a blocking socket, resuming after interruptions.
+/// With a deadline, give up with TIMEOUT once the socket stays full until
+/// then.
+pipe_ret_t send_all(int sockfd, const char *data, size_t size,
+		    std::chrono::steady_clock::time_point deadline =
+			std::chrono::steady_clock::time_point::max()) {
+  const bool bounded = deadline != std::chrono::steady_clock::time_point::max();
+  size_t sent = 0;
+  while (sent < size) {
+    ssize_t numBytesSent = send(sockfd, data + sent, size - sent,
+				MSG_NOSIGNAL | (bounded ? MSG_DONTWAIT : 0));
+    if (numBytesSent < 0) {
+      if (errno == EINTR) {
+	continue;
+      }
+      pipe_ret_t ret = pipe_ret_t::systemError(errno);
+      if (bounded && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+	auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+	    deadline - std::chrono::steady_clock::now());
+	struct pollfd pfd = {sockfd, POLLOUT, 0};
+	if (left.count() > 0 && poll(&pfd, 1, left.count()) > 0) {
+	  continue;
+	}
+	ret = pipe_ret_t::error(error_category_t::TIMEOUT);
+      }
+      if (sent == 0) {	// send failed
+	return ret;
+      }
+      return pipe_ret_t::error(error_category_t::PARTIAL_SEND, sent, size);
+    }
+    sent += numBytesSent;
+  }
+  return pipe_ret_t::ok();
+}
+}  // namespace
+
+std::vector<int> numa_node_cpus(int node) {
+  std::ifstream cpulist("/sys/devices/system/node/node" +
+			std::to_string(node) + "/cpulist");
+  std::string text;
+  if (!std::getline(cpulist, text)) {
+    return {};
+  }
+  return parse_cpulist(text);
+}
+
+std::vector<int> parse_cpulist(std::string_view text) {
+  std::vector<int> cpus;
+  auto parseCpu = [](std::string_view number, int &cpu) {
+    while (!number.empty() && isspace((unsigned char)number.front())) {
+      number.remove_prefix(1);
+    }
+    while (!number.empty() && isspace((unsigned char)number.back())) {
+      number.remove_suffix(1);
+    }
+    const char *end = number.data() + number.size();
+    auto [ptr, ec] = std::from_chars(number.data(), end, cpu);
+    return ec == std::errc() && ptr == end && cpu >= 0 && cpu < CPU_SETSIZE;
+  };
+  // cpulist format is "0-3,8-11"
+  for_each_token(text, ',', [&cpus, &parseCpu](std::string_view range) {
+    size_t dash = range.find('-');
+    int first, last;
+    if (!parseCpu(range.substr(0, dash), first)) {
+      return;
+    }
+    if (dash == std::string_view::npos) {
+      last = first;
+    } else if (!parseCpu(range.substr(dash + 1), last)) {
+      return;
+    }
+    for (int cpu = first; cpu <= last; cpu++) {
+      cpus.push_back(cpu);
+    }
+  });
+  return cpus;
+}
+
+std::string pipe_ret_t::message() const {
+  switch (category) {
+    case error_category_t::NONE:
+      return "";
+    case error_category_t::SYSTEM: {
+      char buffer[128];
+      return strerror_r(code, buffer, sizeof(buffer));
+    }
+    case error_category_t::RESOLVER:
+      return std::string("Failed to resolve hostname: ") + hstrerror(code);
+    case error_category_t::PARTIAL_SEND:
+      return "Only " + std::to_string(code) + " bytes out of " +
+	     std::to_string(size) + " was sent";
+    case error_category_t::PEER_CLOSED:
+      return "Connection closed by peer";
+    case error_category_t::TIMEOUT:
+      return "Timeout";
+    case error_category_t::NOT_READY:
+      return "File descriptor is not set";
+    case error_category_t::CONNECTION_LIMIT:
+      return "Connection limit reached";
+    case error_category_t::DRAINING:
+      return "Server is draining";
+    case error_category_t::ALREADY_RUNNING:
+      return "Already running";
+    case error_category_t::INVALID_ADDRESS:
+      return "Invalid IPv4 address";
+    case error_category_t::DEADLINE_EXCEEDED:
+      return std::to_string(code) + " connections were closed at the deadline";
+    case error_category_t::MALFORMED_FRAME:
+      return "Malformed priority frame";
+  }
+  return "Unknown error";
+}
+
+bool pin_current_thread(int cpu) {
+  if (cpu < 0 || cpu >= CPU_SETSIZE) {  // CPU_SET would write out of bounds
+    return false;
+  }
+  cpu_set_t cpuset;
+  CPU_ZERO(&cpuset);
+  CPU_SET(cpu, &cpuset);
+  return pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset) == 0;
+}
+
+void join_or_detach(std::thread *&thread) {
+  if (thread != nullptr) {
+    if (thread->get_id() == std::this_thread::get_id()) {
+      thread->detach();
+    } else {
+      thread->join();
+    }
+    delete thread;
+    thread = nullptr;
+  }
+}
+
 Client::Client()
     : m_sockfd(0),
-      m_ip(""),
-      m_errorMsg(""),
+      m_connectionId(0),
       m_isConnected(false),
-      m_threadHandler(nullptr) {}
+      m_ip(""),
+      m_lastActivity(std::chrono::steady_clock::now()) {}
 
-Client::~Client() {
-  if (m_threadHandler != nullptr) {
-    m_threadHandler->detach();
-    delete m_threadHandler;
-    m_threadHandler = nullptr;
-  }
+Client::Client(const Client &other)
+    : m_sockfd(other.m_sockfd),
+      m_connectionId(other.m_connectionId),
+      m_isConnected(other.m_isConnected.load()),
+      m_status(other.m_status),
+      m_lastActivity(other.m_lastActivity),
+      m_txTimestamps(other.m_txTimestamps),
+      m_prioritySender(other.m_prioritySender) {
+  memcpy(m_ip, other.m_ip, sizeof(m_ip));
+}
+
+Client &Client::operator=(const Client &other) {
+  m_sockfd = other.m_sockfd;
+  memcpy(m_ip, other.m_ip, sizeof(m_ip));
+  m_connectionId = other.m_connectionId;
+  m_status = other.m_status;
+  m_isConnected = other.m_isConnected.load();
+  m_lastActivity = other.m_lastActivity;
+  m_txTimestamps = other.m_txTimestamps;
+  m_prioritySender = other.m_prioritySender;
+  return *this;
 }
 
 bool Client::operator==(const Client &other) {
-  if ((this->m_sockfd == other.m_sockfd) && (this->m_ip == other.m_ip)) {
+  if ((this->m_sockfd == other.m_sockfd) &&
+      (strcmp(this->m_ip, other.m_ip) == 0) &&
+      (this->m_connectionId == other.m_connectionId)) {
     return true;
   }
   return false;
@@ -49,30 +395,156 @@ bool Client::operator==(const Client &other) {
 void Client::setFileDescriptor(int sockfd) { m_sockfd = sockfd; }
 int Client::getFileDescriptor() const { return m_sockfd; }
 
-void Client::setIp(const std::string &ip) { m_ip = ip; }
+void Client::setIp(const std::string &ip) {
+  size_t size = std::min(ip.size(), sizeof(m_ip) - 1);
+  memcpy(m_ip, ip.data(), size);
+  m_ip[size] = '\0';
+}
 std::string Client::getIp() const { return m_ip; }
+std::string_view Client::getIpView() const { return m_ip; }
 
-void Client::setErrorMessage(const std::string &msg) { m_errorMsg = msg; }
-std::string Client::getInfoMessage() const { return m_errorMsg; }
+void Client::setConnectionId(uint32_t id) { m_connectionId = id; }
+uint32_t Client::getConnectionId() const { return m_connectionId; }
+
+void Client::setStatus(const pipe_ret_t &status) { m_status = status; }
+const pipe_ret_t &Client::getStatus() const { return m_status; }
+std::string Client::getInfoMessage() const { return m_status.message(); }
 
 void Client::setConnected() { m_isConnected = true; }
 
 void Client::setDisconnected() { m_isConnected = false; }
 bool Client::isConnected() { return m_isConnected; }
 
-void Client::setThreadHandler(std::function<void(void)> func) {
-  m_threadHandler = new std::thread(func);
+void Client::touch() { m_lastActivity = std::chrono::steady_clock::now(); }
+std::chrono::steady_clock::time_point Client::getLastActivity() const {
+  return m_lastActivity;
+}
+
+void Client::setTxTimestamps(std::shared_ptr<tx_timestamps_t> state) {
+  m_txTimestamps = state;
+}
+tx_timestamps_t *Client::getTxTimestamps() const { return m_txTimestamps.get(); }
+
+void Client::setPrioritySender(std::shared_ptr<priority_sender> sender) {
+  m_prioritySender = sender;
+}
+priority_sender *Client::getPrioritySender() const {
+  return m_prioritySender.get();
+}
+
+void Client::setArena(message_arena *arena) { m_arena = arena; }
+std::pmr::memory_resource *Client::getArena() const {
+  return m_arena != nullptr ? m_arena->resource()
+                            : std::pmr::get_default_resource();
+}
+
+priority_sender::priority_sender(const priority_config_t &config,
+				 write_func_t write)
+    : m_config{config}, m_write{write}, m_scheduler{config} {
+  m_writer = std::thread(&priority_sender::writeTask, this);
+}
+
+priority_sender::~priority_sender() { stop(); }
+
+pipe_ret_t priority_sender::send(send_priority_t priority, const char *msg,
+				 size_t size) {
+  std::lock_guard<std::mutex> lock(m_mtx);
+  if (!m_error.success) {
+    return m_error;
+  }
+  if (m_stop) {
+    return pipe_ret_t::error(error_category_t::PEER_CLOSED);
+  }
+  if (m_scheduler.queuedBytes(priority) + size > m_config.maxQueuedBytes) {
+    return pipe_ret_t::error(error_category_t::NOT_READY);
+  }
+  m_scheduler.push(priority, msg, size);
+  m_queuedCv.notify_one();
+  return pipe_ret_t::ok();
+}
+
+pipe_ret_t priority_sender::flush() {
+  std::unique_lock<std::mutex> lock(m_mtx);
+  m_writtenCv.wait(lock, [this] {
+    return m_stop || !m_error.success || (m_scheduler.empty() && !m_writing);
+  });
+  return m_error;
+}
+
+pipe_ret_t priority_sender::flush(std::chrono::milliseconds timeout) {
+  std::unique_lock<std::mutex> lock(m_mtx);
+  if (!m_writtenCv.wait_for(lock, timeout, [this] {
+	return m_stop || !m_error.success ||
+	       (m_scheduler.empty() && !m_writing);
+      })) {
+    return pipe_ret_t::error(error_category_t::TIMEOUT);
+  }
+  return m_error;
+}
+
+bool priority_sender::idle() {
+  std::lock_guard<std::mutex> lock(m_mtx);
+  return m_scheduler.empty() && !m_writing;
+}
+
+void priority_sender::stop() {
+  {
+    std::lock_guard<std::mutex> lock(m_mtx);
+    m_stop = true;
+    m_scheduler.clear();
+  }
+  m_queuedCv.notify_one();
+  m_writtenCv.notify_all();
+  if (m_writer.joinable()) {
+    m_writer.join();
+  }
+}
+
+/*
+ * Take the frames the scheduler picks until about a chunk is collected and
+ * write them without holding the lock, so senders keep queueing
+ */
+void priority_sender::writeTask() {
+  std::unique_lock<std::mutex> lock(m_mtx);
+  while (true) {
+    m_queuedCv.wait(lock, [this] { return m_stop || !m_scheduler.empty(); });
+    if (m_stop) {
+      break;
+    }
+    m_buffer.clear();
+    while (m_buffer.size() < m_config.chunkSize && m_scheduler.next(m_buffer)) {
+    }
+    m_writing = true;
+    lock.unlock();
+    pipe_ret_t ret = m_write(m_buffer.data(), m_buffer.size());
+    lock.lock();
+    m_writing = false;
+    if (!ret.success && m_error.success) {
+      m_error = ret;
+      m_scheduler.clear();
+    }
+    m_writtenCv.notify_all();
+  }
+}
+
+void Client::setThreadHandler(std::function<void(void)> func, int cpu) {
+  std::thread([func, cpu] {
+    if (cpu >= 0 && !pin_current_thread(cpu)) {
+      logger::instance().log("Failed to pin I/O thread to CPU " +
+			     std::to_string(cpu));
+    }
+    func();
+  }).detach();
 }
 
 pipe_ret_t TcpClient::connectTo(const std::string &address, int port) {
-  m_sockfd = 0;
+  finish();  // drop the previous connection, if any
+  stop = false;
   pipe_ret_t ret;
 
   m_sockfd = socket(AF_INET, SOCK_STREAM, 0);
   if (m_sockfd == -1) {	 // socket failed
-    ret.success = false;
-    ret.msg = strerror(errno);
-    return ret;
+    return pipe_ret_t::systemError(errno);
   }
 
   int inetSuccess = inet_aton(address.c_str(), &m_server.sin_addr);
@@ -82,9 +554,7 @@ pipe_ret_t TcpClient::connectTo(const std::string &address, int port) {
     struct hostent *host;
     struct in_addr **addrList;
     if ((host = gethostbyname(address.c_str())) == NULL) {
-      ret.success = false;
-      ret.msg = "Failed to resolve hostname";
-      return ret;
+      return pipe_ret_t::error(error_category_t::RESOLVER, h_errno);
     }
     addrList = (struct in_addr **)host->h_addr_list;
     m_server.sin_addr = *addrList[0];
@@ -92,38 +562,191 @@ pipe_ret_t TcpClient::connectTo(const std::string &address, int port) {
   m_server.sin_family = AF_INET;
   m_server.sin_port = htons(port);
 
+  // before connect, the window scale is fixed by the handshake
+  if (!set_socket_buffers(m_sockfd, m_socketBuffers)) {
+    return pipe_ret_t::systemError(errno);
+  }
+
+  // without a cookie yet the kernel falls back to a regular handshake
+  int fastOpen = 1;
+  if (m_fastOpen && setsockopt(m_sockfd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT,
+			       &fastOpen, sizeof(fastOpen)) == -1) {
+    return pipe_ret_t::systemError(errno);
+  }
+
   int connectRet =
       connect(m_sockfd, (struct sockaddr *)&m_server, sizeof(m_server));
   if (connectRet == -1) {
-    ret.success = false;
-    ret.msg = strerror(errno);
-    return ret;
+    return pipe_ret_t::systemError(errno);
+  }
+  if (m_ioConfig.busyPoll) {
+    enable_busy_poll(m_sockfd, m_ioConfig);
+  }
+  if (m_priorityConfig.enabled) {
+    int lowat = m_priorityConfig.notSentLowat;
+    if (lowat > 0 && setsockopt(m_sockfd, IPPROTO_TCP, TCP_NOTSENT_LOWAT,
+				&lowat, sizeof(lowat)) == -1) {
+      logger::instance().log("Failed to set TCP_NOTSENT_LOWAT: " +
+			     pipe_ret_t::systemError(errno).message());
+    }
+    int sockfd = m_sockfd;
+    m_prioritySender.reset(new priority_sender(
+	m_priorityConfig, [sockfd](const char *data, size_t size) {
+	  return send_all(sockfd, data, size);
+	}));
   }
-  m_receiveTask = new std::thread(&TcpClient::ReceiveTask, this);
+  {
+    std::lock_guard<std::mutex> lock(m_batchMtx);
+    m_batching = m_batchingConfig;
+    m_batch.clear();
+    m_batchMessages = 0;
+    m_stopFlush = !m_batching.enabled;
+    m_flushDeadline = std::chrono::steady_clock::time_point::max();
+    if (m_batching.enabled) {
+      m_batch.reserve(m_batching.maxBytes);
+    }
+  }
+  if (m_batching.enabled) {
+    m_flushTask = new std::thread(&TcpClient::FlushTask, this);
+  }
+  // last, observers may send as soon as the first message arrives
+  int cpu = m_ioConfig.cpus.empty() ? -1 : m_ioConfig.cpus.front();
+  m_receiveTask = new std::thread([this, cpu] {
+    if (cpu >= 0 && !pin_current_thread(cpu)) {
+      logger::instance().log("Failed to pin I/O thread to CPU " +
+			     std::to_string(cpu));
+    }
+    ReceiveTask();
+  });
   ret.success = true;
   return ret;
 }
 
-pipe_ret_t TcpClient::sendMsg(const char *msg, size_t size) {
+///
+/// Set placement and polling mode of the receive thread. Applies to the
+/// next connectTo call
+///
+void TcpClient::setIoThreadConfig(const io_thread_config_t &config) {
+  m_ioConfig = resolve_io_config(config);
+}
+
+void TcpClient::setFastOpen(bool enable) { m_fastOpen = enable; }
+
+void TcpClient::setReceiveConfig(const receive_config_t &config) {
+  m_receiveConfig = config;
+}
+
+void TcpClient::setSocketBuffers(const socket_buffer_config_t &config) {
+  m_socketBuffers = config;
+}
+
+void TcpClient::setSendBatching(const send_batching_config_t &config) {
+  m_batchingConfig = config;
+}
+
+void TcpClient::setPrioritySending(const priority_config_t &config) {
+  m_priorityConfig = config;
+}
+
+/*
+ * With batching the message is only buffered, unless it fills the batch:
+ * then the calling thread sends the batch and reports it to the observers
+ */
+pipe_ret_t TcpClient::sendMsg(const char *msg, size_t size,
+			      send_priority_t priority) {
   pipe_ret_t ret;
+  if (m_prioritySender) {
+    return m_prioritySender->send(priority, msg, size);
+  }
+  bool batched = false;
+  bool full = false;
+  {
+    /* m_stopFlush rather than m_flushTask, which finish() may be deleting */
+    std::lock_guard<std::mutex> lock(m_batchMtx);
+    if (m_batching.enabled && !m_stopFlush) {
+      if (m_batchMessages == 0) {  // start the linger time
+	m_batchStart = std::chrono::steady_clock::now();
+	m_batchCv.notify_one();
+      }
+      m_batch.append(msg, size);
+      m_batchMessages++;
+      full = m_batch.size() >= m_batching.maxBytes ||
+	     m_batchMessages >= m_batching.maxMessages;
+      batched = true;
+    }
+  }
+  if (batched) {
+    if (full) {
+      size_t bytes, messages;
+      pipe_ret_t flushed = flushBatch(bytes, messages);
+      if (messages > 0) {
+	publishFlushed(flushed, bytes, messages);
+      }
+    }
+    return pipe_ret_t::ok();
+  }
   int numBytesSent = send(m_sockfd, msg, size, 0);
   if (numBytesSent < 0) {  // send failed
-    ret.success = false;
-    ret.msg = strerror(errno);
-    return ret;
+    return pipe_ret_t::systemError(errno);
   }
   if ((uint)numBytesSent < size) {  // not all bytes were sent
-    ret.success = false;
-    char msg[100];
-    sprintf(msg, "Only %d bytes out of %lu was sent to client", numBytesSent,
-	    size);
-    ret.msg = msg;
-    return ret;
+    return pipe_ret_t::error(error_category_t::PARTIAL_SEND, numBytesSent,
+			     size);
   }
   ret.success = true;
   return ret;
 }
 
+pipe_ret_t TcpClient::flush() {
+  size_t bytes, messages;
+  return flushBatch(bytes, messages);
+}
+
+/*
+ * Send everything buffered so far with as few send calls as the socket
+ * buffer allows. The buffer is swapped out, so senders keep appending
+ */
+pipe_ret_t TcpClient::flushBatch(size_t &bytes, size_t &messages) {
+  std::lock_guard<std::timed_mutex> sendLock(m_sendMtx);
+  std::chrono::steady_clock::time_point deadline;
+  {
+    std::lock_guard<std::mutex> lock(m_batchMtx);
+    m_sending.clear();
+    m_sending.swap(m_batch);
+    messages = m_batchMessages;
+    m_batchMessages = 0;
+    deadline = m_flushDeadline;
+  }
+  bytes = m_sending.size();
+  return send_all(m_sockfd, m_sending.data(), bytes, deadline);
+}
+
+/*
+ * Send the batch once its oldest message waited for the linger time
+ */
+void TcpClient::FlushTask() {
+  std::unique_lock<std::mutex> lock(m_batchMtx);
+  while (!m_stopFlush) {
+    if (m_batchMessages == 0) {
+      m_batchCv.wait(lock);
+      continue;
+    }
+    std::chrono::steady_clock::time_point deadline =
+	m_batchStart + std::chrono::microseconds(m_batching.lingerUsec);
+    if (std::chrono::steady_clock::now() < deadline) {
+      m_batchCv.wait_until(lock, deadline);
+      continue;
+    }
+    lock.unlock();
+    size_t bytes, messages;
+    pipe_ret_t flushed = flushBatch(bytes, messages);
+    if (messages > 0) {
+      publishFlushed(flushed, bytes, messages);
+    }
+    lock.lock();
+  }
+}
+
 void TcpClient::subscribe(const client_observer_t &observer) {
   m_subscibers.push_back(observer);
 }
@@ -138,8 +761,8 @@ void TcpClient::unsubscribeAll() { m_subscibers.clear(); }
  */
 void TcpClient::publishServerMsg(const char *msg, size_t msgSize) {
   for (uint i = 0; i < m_subscibers.size(); i++) {
-    if (m_subscibers[i].incoming_packet_func != NULL) {
-      (*m_subscibers[i].incoming_packet_func)(msg, msgSize);
+    if (m_subscibers[i].incoming_packet_func != nullptr) {
+      m_subscibers[i].incoming_packet_func(msg, msgSize);
     }
   }
 }
@@ -152,8 +775,20 @@ void TcpClient::publishServerMsg(const char *msg, size_t msgSize) {
  */
 void TcpClient::publishServerDisconnected(const pipe_ret_t &ret) {
   for (uint i = 0; i < m_subscibers.size(); i++) {
-    if (m_subscibers[i].disconnected_func != NULL) {
-      (*m_subscibers[i].disconnected_func)(ret);
+    if (m_subscibers[i].disconnected_func != nullptr) {
+      m_subscibers[i].disconnected_func(ret);
+    }
+  }
+}
+
+/*
+ * Publish result of a batched send to observers
+ */
+void TcpClient::publishFlushed(const pipe_ret_t &ret, size_t bytes,
+			       size_t messages) {
+  for (uint i = 0; i < m_subscibers.size(); i++) {
+    if (m_subscibers[i].flushed_func != nullptr) {
+      m_subscibers[i].flushed_func(ret, bytes, messages);
     }
   }
 }
@@ -162,49 +797,121 @@ void TcpClient::publishServerDisconnected(const pipe_ret_t &ret) {
  * Receive server packets, and notify user
  */
 void TcpClient::ReceiveTask() {
+  const receive_config_t config = m_receiveConfig;
+  // the server frames its data too when priority sending is on
+  const bool framed = m_priorityConfig.enabled;
+  priority_frame_decoder decoder;
+  receive_buffer buffer = make_receive_buffer(config);
   while (!stop) {
-    char msg[MAX_PACKET_SIZE];
-    int numOfBytesReceived = recv(m_sockfd, msg, MAX_PACKET_SIZE, 0);
+    char *msg = buffer.data();
+    size_t size = buffer.size();
+    int numOfBytesReceived =
+	m_ioConfig.busyPoll
+	    ? recv_spinning(m_sockfd, msg, size, [this] { return !stop; })
+	    : recv(m_sockfd, msg, size, 0);
     if (numOfBytesReceived < 1) {
       pipe_ret_t ret;
-      ret.success = false;
       stop = true;
       if (numOfBytesReceived == 0) {  // server closed connection
-	ret.msg = "Server closed connection";
+	ret = pipe_ret_t::error(error_category_t::PEER_CLOSED);
       } else {
-	ret.msg = strerror(errno);
+	ret = pipe_ret_t::systemError(errno);
       }
+      // the socket stays open until finish() so that its descriptor can't
+      // be reused under a concurrent sendMsg
       publishServerDisconnected(ret);
-      finish();
       break;
     } else {
-      publishServerMsg(msg, numOfBytesReceived);
+      if (!framed) {
+	publishServerMsg(msg, numOfBytesReceived);
+      } else if (!decoder.feed(msg, numOfBytesReceived,
+			       [this](send_priority_t, const char *data,
+				      size_t size) {
+				 publishServerMsg(data, size);
+			       })) {
+	stop = true;
+	publishServerDisconnected(
+	    pipe_ret_t::error(error_category_t::MALFORMED_FRAME));
+	break;
+      }
+      if (config.adaptive) {
+	bool filled = size_t(numOfBytesReceived) == size;
+	buffer.update(numOfBytesReceived, filled ? pending_bytes(m_sockfd) : 0);
+      }
     }
   }
 }
 
+/*
+ * Send what is still batched, stop the receive thread and close the
+ * connection. A peer that stopped reading gets FINISH_FLUSH_TIMEOUT_MS to
+ * take what is queued, the rest is dropped. Safe to call from an observer
+ * callback and more than once
+ */
 pipe_ret_t TcpClient::finish() {
+  const auto timeout = std::chrono::milliseconds(FINISH_FLUSH_TIMEOUT_MS);
+  const auto deadline = std::chrono::steady_clock::now() + timeout;
+  bool stuck = false;
+  if (m_prioritySender) {
+    stuck = m_prioritySender->flush(timeout).category == error_category_t::TIMEOUT;
+  }
+  if (m_flushTask != nullptr) {
+    {
+      // batches sent from now on give up at the deadline
+      std::lock_guard<std::mutex> lock(m_batchMtx);
+      m_stopFlush = true;
+      m_flushDeadline = deadline;
+    }
+    m_batchCv.notify_one();
+    // a batch send that started earlier waits without one
+    std::unique_lock<std::timed_mutex> sendLock(m_sendMtx, deadline);
+    stuck = stuck || !sendLock.owns_lock();
+  }
+  if (stuck && m_sockfd != -1) {
+    shutdown(m_sockfd, SHUT_RDWR);  // fails the blocked send
+  }
+  if (m_flushTask != nullptr) {
+    terminateFlushThread();
+    size_t bytes, messages;
+    pipe_ret_t flushed = flushBatch(bytes, messages);
+    if (messages > 0) {
+      publishFlushed(flushed, bytes, messages);
+    }
+  }
   stop = true;
+  if (m_sockfd != -1) {
+    shutdown(m_sockfd, SHUT_RDWR);  // wake up a blocking recv
+  }
   terminateReceiveThread();
+  if (m_prioritySender) {
+    m_prioritySender->stop();
+    m_prioritySender.reset();
+  }
   pipe_ret_t ret;
-  if (close(m_sockfd) == -1) {	// close failed
-    ret.success = false;
-    ret.msg = strerror(errno);
+  if (m_sockfd != -1 && close(m_sockfd) == -1) {  // close failed
+    ret = pipe_ret_t::systemError(errno);
+    m_sockfd = -1;
     return ret;
   }
+  m_sockfd = -1;
   ret.success = true;
   return ret;
 }
 
 void TcpClient::terminateReceiveThread() {
-  if (m_receiveTask != nullptr) {
-    m_receiveTask->detach();
-    delete m_receiveTask;
-    m_receiveTask = nullptr;
+  join_or_detach(m_receiveTask);
+}
+
+void TcpClient::terminateFlushThread() {
+  {
+    std::lock_guard<std::mutex> lock(m_batchMtx);
+    m_stopFlush = true;
   }
+  m_batchCv.notify_one();
+  join_or_detach(m_flushTask);
 }
 
-TcpClient::~TcpClient() { terminateReceiveThread(); }
+TcpClient::~TcpClient() { finish(); }
 
 void TcpServer::subscribe(const server_observer_t &observer) {
     m_subscibers.push_back(observer);
@@ -215,62 +922,397 @@ void TcpServer::unsubscribeAll() {
 }
 
 void TcpServer::printClients() {
-    for (uint i = 0; i < m_clients.size(); i++) {
-        std::string connected = m_clients[i].isConnected() ? "True" : "False";
+    epoch_domain::guard guard(m_epoch);
+    const client_list_t *clients = m_clients.load();
+    if (clients == nullptr) {
+        return;
+    }
+    for (Client *client : *clients) {
+        std::string connected = client->isConnected() ? "True" : "False";
         std::cout << "-----------------\n" <<
-                  "IP address: " << m_clients[i].getIp() << std::endl <<
+                  "IP address: " << client->getIp() << std::endl <<
                   "Connected?: " << connected << std::endl <<
-                  "Socket FD: " << m_clients[i].getFileDescriptor() << std::endl <<
-                  "Message: " << m_clients[i].getInfoMessage().c_str() << std::endl;
+                  "Socket FD: " << client->getFileDescriptor() << std::endl <<
+                  "Message: " << client->getInfoMessage().c_str() << std::endl;
     }
 }
 
 ///
-/// Receive client packets, and notify user
+/// Receive client packets, and notify user.
+/// The thread owns client: it unregisters and retires it when the
+/// connection ends, and nobody else does. Its message arena lives on
+/// this thread's stack and is emptied after every dispatched message
 ///
-void TcpServer::receiveTask(/*TcpServer *context*/) {
+void TcpServer::receiveTask(Client *client) {
 
-    Client * client = &m_clients.back();
+    t_receiveServer = this;
+    const std::string ip = client->getIp();
+    const uint32_t connectionId = client->getConnectionId();
+    const uint32_t ipAddress = inet_addr(ip.c_str()); // as captured
+    std::shared_ptr<ip_state_t> ipState;
+    rate_limit_t perConnection;
+    bool busyPoll;
+    timestamping_config_t timestamping;
+    receive_config_t receive;
+    {
+        std::lock_guard<std::mutex> lock(m_limitsMtx);
+        ipState = m_ipStates[ip];
+        perConnection = m_limits.perConnection;
+        busyPoll = m_ioConfig.busyPoll;
+        timestamping = m_timestamping;
+        receive = m_receiveConfig;
+    }
+    packet_timestamps_t rx;
+    packet_timestamps_t *rxStamps = timestamping.rx ? &rx : nullptr;
+    token_bucket bytes(perConnection.bytesPerSec, perConnection.bytesBurst);
+    token_bucket messages(perConnection.messagesPerSec, perConnection.messagesBurst);
+    delimiter_framer<char> framer('\n', TOPIC_COMMAND_MAX_LINE);
+    // the peer of a connection with priority sending frames its data too
+    const bool framed = client->getPrioritySender() != nullptr;
+    priority_frame_decoder decoder;
+    message_arena arena;
+    client->setArena(&arena);
+    receive_buffer buffer = make_receive_buffer(receive);
+    size_t burstBytes = 0; // read since the last blocking wait
 
     while(client->isConnected()) {
-        char msg[MAX_PACKET_SIZE];
-        int numOfBytesReceived = recv(client->getFileDescriptor(), msg, MAX_PACKET_SIZE, 0);
+        char *msg = buffer.data();
+        size_t budget = waitForReadBudget(*client, bytes, messages, *ipState, buffer.size());
+        if (budget == 0) { // disconnected while throttled
+            continue;
+        }
+        const bool bursting = burstBytes > 0 && !busyPoll;
+        if (timestamping.tx && !busyPoll && !bursting) {
+            // TX stamps arrive on the error queue, which only poll reports
+            struct pollfd pfd = {client->getFileDescriptor(), POLLIN, 0};
+            if (poll(&pfd, 1, -1) > 0 && (pfd.revents & POLLERR)) {
+                readTxTimestamps(*client);
+                if (!(pfd.revents & (POLLIN | POLLHUP))) {
+                    continue;
+                }
+            }
+        }
+        int numOfBytesReceived = busyPoll
+            ? recv_spinning(client->getFileDescriptor(), msg, budget,
+                            [client] { return client->isConnected(); }, rxStamps)
+            : recv_timestamped(client->getFileDescriptor(), msg, budget,
+                               bursting ? MSG_DONTWAIT : 0, rxStamps);
+        if (bursting && numOfBytesReceived < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            burstBytes = 0; // drained, block again
+            continue;
+        }
         if(numOfBytesReceived < 1) {
             client->setDisconnected();
             if (numOfBytesReceived == 0) { //client closed connection
-                client->setErrorMessage("Client closed connection");
+                client->setStatus(pipe_ret_t::error(error_category_t::PEER_CLOSED));
                 //printf("client closed");
             } else {
-                client->setErrorMessage(strerror(errno));
+                client->setStatus(pipe_ret_t::systemError(errno));
             }
-            close(client->getFileDescriptor());
-            publishClientDisconnected(*client);
-            deleteClient(*client);
             break;
         } else {
-            publishClientMsg(*client, msg, numOfBytesReceived);
+            TRACE_POINT(trace_point_t::READ, read, connectionId, numOfBytesReceived);
+            if (rx.softwareNs != 0) {
+                uint64_t now = realtime_ns();
+                m_rxDelay.record(now > rx.softwareNs ? now - rx.softwareNs : 0);
+            }
+            if (timestamping.tx && busyPoll) {
+                readTxTimestamps(*client);
+            }
+            bytes.consume(numOfBytesReceived);
+            messages.consume(1);
+            ipState->bytes.consume(numOfBytesReceived);
+            ipState->messages.consume(1);
+            client->touch();
+            auto deliver = [&](const char *data, size_t size) {
+                if (m_capture.isActive()) {
+                    m_capture.record(connectionId, ipAddress, data, size);
+                }
+                if (m_topicCommands) {
+                    bool accepted = framer.feed(data, size, [this, client, connectionId, &rx, &arena](std::string_view line) {
+                        TRACE_POINT(trace_point_t::FRAME, frame, connectionId, line.size());
+                        if (!handleTopicCommand(*client, line)) {
+                            publishClientMsg(*client, line.data(), line.size(), rx);
+                            arena.reset();
+                        }
+                    });
+                    if (!accepted) { // dropped up to its newline
+                        replyTopicError(*client, "line too long");
+                    }
+                } else {
+                    publishClientMsg(*client, data, size, rx);
+                    arena.reset();
+                }
+            };
+            if (!framed) {
+                deliver(msg, numOfBytesReceived);
+            } else if (!decoder.feed(msg, numOfBytesReceived,
+                                     [&deliver](send_priority_t, const char *data, size_t size) {
+                                         deliver(data, size);
+                                     })) {
+                client->setDisconnected();
+                client->setStatus(pipe_ret_t::error(error_category_t::MALFORMED_FRAME));
+                break;
+            }
+            if (receive.adaptive) {
+                // a read that got all it asked for likely left more queued
+                bool filled = size_t(numOfBytesReceived) == budget;
+                burstBytes += numOfBytesReceived;
+                if (!filled || burstBytes >= receive.maxBurstBytes) {
+                    burstBytes = 0;
+                }
+                buffer.update(numOfBytesReceived,
+                              filled ? pending_bytes(client->getFileDescriptor()) : 0);
+            }
         }
     }
+
+    // also reached when deleteClient or finish disconnected the client
+    client->setArena(nullptr);
+    m_topics.unsubscribeAll(client->getFileDescriptor());
+    shutdown(client->getFileDescriptor(), SHUT_RDWR);
+    if (client->getPrioritySender() != nullptr) {
+        client->getPrioritySender()->stop();
+    }
+    releaseClient(ip);
+    publishClientDisconnected(*client);
+    removeClient(client);
+    m_epoch.retire([this, client] {
+        m_topics.unsubscribeAll(client->getFileDescriptor());
+        close(client->getFileDescriptor());
+        delete client;
+    });
 }
 
 ///
-/// Erase client from clients vector.
-/// If client isn't in the vector, return false. Return
-/// true if it is.
+/// Block until the connection and its source IP have budget for one more
+/// message of a full read (or a full burst if that is smaller). Sleeping
+/// instead of reading leaves data in the socket buffer, so TCP flow control
+/// pushes back on the sender.
+/// Return how many of readSize bytes may be read, 0 if client disconnected
+/// meanwhile
 ///
-bool TcpServer::deleteClient(Client & client) {
-    int clientIndex = -1;
-    for (uint i=0; i<m_clients.size(); i++) {
-        if (m_clients[i] == client) {
-            clientIndex = i;
+size_t TcpServer::waitForReadBudget(Client &client, token_bucket &bytes,
+                                    token_bucket &messages, ip_state_t &ipState,
+                                    size_t readSize) {
+    const uint64_t maxSleepUsec = 100000;
+    const double connChunk = std::min<double>(readSize, bytes.burst());
+    const double ipChunk = std::min<double>(readSize, ipState.bytes.burst());
+    bool throttled = false;
+    for (;;) {
+        uint64_t waitUsec = std::max({bytes.waitTimeUsec(connChunk), messages.waitTimeUsec(1),
+                                      ipState.bytes.waitTimeUsec(ipChunk),
+                                      ipState.messages.waitTimeUsec(1)});
+        if (waitUsec == 0) {
             break;
         }
+        if (!client.isConnected()) {
+            return 0;
+        }
+        waitUsec = std::min(waitUsec, maxSleepUsec);
+        throttled = true;
+        std::this_thread::sleep_for(std::chrono::microseconds(waitUsec));
+        m_throttledUsec += waitUsec;
     }
-    if (clientIndex > -1) {
-        m_clients.erase(m_clients.begin() + clientIndex);
-        return true;
+    if (throttled) {
+        m_throttledReads++;
     }
-    return false;
+    return std::min<uint64_t>({readSize, bytes.available(),
+                               ipState.bytes.available()});
+}
+
+///
+/// Check connection caps and register the connection of given IP.
+/// Return false if the connection must be refused
+///
+bool TcpServer::admitClient(const std::string &ip) {
+    std::lock_guard<std::mutex> lock(m_limitsMtx);
+    if (m_limits.maxConnections > 0 && m_connectionCount >= m_limits.maxConnections) {
+        return false;
+    }
+    std::shared_ptr<ip_state_t> &ipState = m_ipStates[ip];
+    if (!ipState) {
+        ipState = std::make_shared<ip_state_t>(m_limits.perIp);
+    }
+    if (m_limits.maxConnectionsPerIp > 0 && ipState->connections >= m_limits.maxConnectionsPerIp) {
+        return false;
+    }
+    ipState->connections++;
+    m_connectionCount++;
+    return true;
+}
+
+void TcpServer::releaseClient(const std::string &ip) {
+    std::lock_guard<std::mutex> lock(m_limitsMtx);
+    auto it = m_ipStates.find(ip);
+    if (it != m_ipStates.end() && --it->second->connections == 0) {
+        m_ipStates.erase(it);
+    }
+    m_connectionCount--;
+}
+
+///
+/// Set connection caps and rate limits. Rate limits apply to connections
+/// accepted after the call
+///
+void TcpServer::setAdmissionLimits(const admission_limits_t &limits) {
+    std::lock_guard<std::mutex> lock(m_limitsMtx);
+    m_limits = limits;
+}
+
+///
+/// Set placement and polling mode of receive threads. Applies to clients
+/// accepted after the call
+///
+void TcpServer::setIoThreadConfig(const io_thread_config_t &config) {
+    std::lock_guard<std::mutex> lock(m_limitsMtx);
+    m_ioConfig = resolve_io_config(config);
+}
+
+///
+/// Set SO_TIMESTAMPING options, see timestamping_config_t. Applies to
+/// clients accepted after the call
+///
+void TcpServer::setTimestamping(const timestamping_config_t &config) {
+    std::lock_guard<std::mutex> lock(m_limitsMtx);
+    m_timestamping = config;
+    enableListenerTimestamping();
+}
+
+///
+/// The kernel turns RX timestamping on lazily and leaves packets arriving
+/// meanwhile unstamped, so enable it on the listener ahead of accepting;
+/// accepted sockets inherit the RX flags. Must hold m_limitsMtx
+///
+void TcpServer::enableListenerTimestamping() {
+    timestamping_config_t listener = m_timestamping;
+    listener.tx = false; // OPT_ID must be set on each connection
+    if (m_sockfd != -1 && !enable_timestamping(m_sockfd, listener)) {
+        logger::instance().log("Failed to enable timestamping: " +
+                               pipe_ret_t::systemError(errno).message());
+    }
+}
+
+///
+/// Set priority scheduling of sends, see priority_config_t. Applies to
+/// clients accepted after the call
+///
+void TcpServer::setPrioritySending(const priority_config_t &config) {
+    std::lock_guard<std::mutex> lock(m_limitsMtx);
+    m_priorityConfig = config;
+}
+
+///
+/// Size reads adaptively on connections accepted from now on
+///
+void TcpServer::setReceiveConfig(const receive_config_t &config) {
+    std::lock_guard<std::mutex> lock(m_limitsMtx);
+    m_receiveConfig = config;
+}
+
+const latency_histogram &TcpServer::getRxDelayHistogram() const {
+    return m_rxDelay;
+}
+
+const latency_histogram &TcpServer::getTxDelayHistogram() const {
+    return m_txDelay;
+}
+
+rate_limit_stats_t TcpServer::getRateLimitStats() const {
+    rate_limit_stats_t stats;
+    stats.rejectedConnections = m_rejectedConnections;
+    stats.throttledReads = m_throttledReads;
+    stats.throttledUsec = m_throttledUsec;
+    return stats;
+}
+
+///
+/// Disconnect client. Its receive thread notices, notifies observers and
+/// releases the connection.
+/// If client isn't connected, return false. Return
+/// true if it is.
+///
+bool TcpServer::deleteClient(Client & client) {
+    epoch_domain::guard guard(m_epoch);
+    Client *registered = findClient(client);
+    if (registered == nullptr) {
+        return false;
+    }
+    registered->setDisconnected();
+    shutdown(registered->getFileDescriptor(), SHUT_RDWR);
+    return true;
+}
+
+///
+/// Publish a copy of the client list with client added
+///
+void TcpServer::addClient(Client *client) {
+    std::lock_guard<std::mutex> lock(m_clientsMtx);
+    client_list_t *old = m_clients.load();
+    client_list_t *updated = old ? new client_list_t(*old) : new client_list_t;
+    auto pos = std::lower_bound(updated->begin(), updated->end(), client,
+                                [](const Client *a, const Client *b) {
+                                    return a->getFileDescriptor() < b->getFileDescriptor();
+                                });
+    updated->insert(pos, client);
+    m_clients.store(updated);
+    if (old != nullptr) {
+        m_epoch.retireDelete(old);
+    }
+}
+
+///
+/// Publish a copy of the client list without client. Readers may still
+/// hold the old list, so client itself must be retired by the caller
+///
+bool TcpServer::removeClient(Client *client) {
+    std::lock_guard<std::mutex> lock(m_clientsMtx);
+    client_list_t *old = m_clients.load();
+    if (old == nullptr) {
+        return false;
+    }
+    auto it = std::find(old->begin(), old->end(), client);
+    if (it == old->end()) {
+        return false;
+    }
+    client_list_t *updated = new client_list_t;
+    updated->reserve(old->size() - 1);
+    updated->insert(updated->end(), old->begin(), it);
+    updated->insert(updated->end(), it + 1, old->end());
+    m_clients.store(updated);
+    m_epoch.retireDelete(old);
+    return true;
+}
+
+///
+/// Find the registered client equal to client, must be called inside a
+/// guard of m_epoch which also keeps the result alive.
+/// Return nullptr if client isn't connected
+///
+Client *TcpServer::findClient(const Client &client) const {
+    Client *registered = findClient(client.getFileDescriptor());
+    if (registered == nullptr || !(*registered == client)) {
+        return nullptr;
+    }
+    return registered;
+}
+
+///
+/// Find the registered client on socket sockfd, same rules as above
+///
+Client *TcpServer::findClient(int sockfd) const {
+    const client_list_t *clients = m_clients.load();
+    if (clients == nullptr) {
+        return nullptr;
+    }
+    auto it = std::lower_bound(clients->begin(), clients->end(), sockfd,
+                               [](const Client *a, int sockfd) {
+                                   return a->getFileDescriptor() < sockfd;
+                               });
+    if (it == clients->end() || (*it)->getFileDescriptor() != sockfd) {
+        return nullptr;
+    }
+    return *it;
 }
 
 ///
@@ -279,11 +1321,72 @@ bool TcpServer::deleteClient(Client & client) {
 /// from clients with IP address identical to
 /// the specific observer requested IP
 ///
-void TcpServer::publishClientMsg(const Client & client, const char * msg, size_t msgSize) {
+void TcpServer::publishClientMsg(const Client & client, const char * msg, size_t msgSize,
+                                 const packet_timestamps_t & rx) {
+    TRACE_POINT(trace_point_t::DISPATCH_BEGIN, dispatch_begin, client.getConnectionId(), msgSize);
     for (uint i=0; i<m_subscibers.size(); i++) {
-        if (m_subscibers[i].wantedIp == client.getIp() || m_subscibers[i].wantedIp.empty()) {
-            if (m_subscibers[i].incoming_packet_func != NULL) {
-                (*m_subscibers[i].incoming_packet_func)(client, msg, msgSize);
+        if (m_subscibers[i].wantedIp == client.getIpView() || m_subscibers[i].wantedIp.empty()) {
+            if (m_subscibers[i].incoming_packet_ts_func != nullptr) {
+                m_subscibers[i].incoming_packet_ts_func(client, msg, msgSize, rx);
+            } else if (m_subscibers[i].incoming_packet_func != nullptr) {
+                m_subscibers[i].incoming_packet_func(client, msg, msgSize);
+            }
+        }
+    }
+    TRACE_POINT(trace_point_t::DISPATCH_END, dispatch_end, client.getConnectionId(), msgSize);
+}
+
+///
+/// Read the TX timestamps queued on the socket error queue, record the
+/// time from every covered send call to its software stamp and pass the
+/// stamps to observers
+///
+void TcpServer::readTxTimestamps(Client & client) {
+    tx_timestamps_t *state = client.getTxTimestamps();
+    for (;;) {
+        char control[512];
+        struct msghdr hdr = {};
+        hdr.msg_control = control;
+        hdr.msg_controllen = sizeof(control);
+        if (recvmsg(client.getFileDescriptor(), &hdr, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            break;
+        }
+        struct scm_timestamping stamps;
+        struct sock_extended_err error;
+        bool haveStamps = false;
+        bool haveError = false;
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr); cmsg != nullptr;
+             cmsg = CMSG_NXTHDR(&hdr, cmsg)) {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPING) {
+                memcpy(&stamps, CMSG_DATA(cmsg), sizeof(stamps));
+                haveStamps = true;
+            } else if ((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) ||
+                       (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR)) {
+                memcpy(&error, CMSG_DATA(cmsg), sizeof(error));
+                haveError = error.ee_origin == SO_EE_ORIGIN_TIMESTAMPING;
+            }
+        }
+        if (!haveStamps || !haveError) {
+            continue;
+        }
+        packet_timestamps_t tx;
+        tx.softwareNs = timespec_ns(stamps.ts[0]);
+        tx.hardwareNs = timespec_ns(stamps.ts[2]);
+        if (tx.softwareNs != 0 && state != nullptr) {
+            std::lock_guard<std::mutex> lock(state->mtx);
+            // a stamp covers every send up to its offset
+            while (!state->pending.empty() &&
+                   int32_t(state->pending.front().first - error.ee_data) <= 0) {
+                uint64_t sentNs = state->pending.front().second;
+                m_txDelay.record(tx.softwareNs > sentNs ? tx.softwareNs - sentNs : 0);
+                state->pending.pop_front();
+            }
+        }
+        for (uint i=0; i<m_subscibers.size(); i++) {
+            if (m_subscibers[i].wantedIp == client.getIpView() || m_subscibers[i].wantedIp.empty()) {
+                if (m_subscibers[i].tx_timestamp_func != nullptr) {
+                    m_subscibers[i].tx_timestamp_func(client, error.ee_data, tx);
+                }
             }
         }
     }
@@ -293,13 +1396,14 @@ void TcpServer::publishClientMsg(const Client & client, const char * msg, size_t
 /// Publish client disconnection to observer.
 /// Observers get only notify about clients
 /// with IP address identical to the specific
-/// observer requested IP
+/// observer requested IP, or about every client
+/// if observer requested no IP
 ///
 void TcpServer::publishClientDisconnected(const Client & client) {
     for (uint i=0; i<m_subscibers.size(); i++) {
-        if (m_subscibers[i].wantedIp == client.getIp()) {
-            if (m_subscibers[i].disconnected_func != NULL) {
-                (*m_subscibers[i].disconnected_func)(client);
+        if (m_subscibers[i].wantedIp == client.getIpView() || m_subscibers[i].wantedIp.empty()) {
+            if (m_subscibers[i].disconnected_func != nullptr) {
+                m_subscibers[i].disconnected_func(client);
             }
         }
     }
@@ -311,19 +1415,37 @@ void TcpServer::publishClientDisconnected(const Client & client) {
 ///
 pipe_ret_t TcpServer::start(int port) {
     m_sockfd = 0;
-    m_clients.reserve(10);
     m_subscibers.reserve(10);
     pipe_ret_t ret;
 
-    m_sockfd = socket(AF_INET,SOCK_STREAM,0);
+    // non-blocking so that acceptClients can drain the queue until EAGAIN
+    m_sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
     if (m_sockfd == -1) { //socket failed
-        ret.success = false;
-        ret.msg = strerror(errno);
-        return ret;
+        return pipe_ret_t::systemError(errno);
     }
     /// set socket for reuse (otherwise might have to wait 4 minutes every time socket is closed)
     int option = 1;
     setsockopt(m_sockfd, SOL_SOCKET, SO_REUSEADDR, &option, sizeof(option));
+    listen_config_t listenConfig;
+    socket_buffer_config_t socketBuffers;
+    {
+        std::lock_guard<std::mutex> lock(m_limitsMtx);
+        listenConfig = m_listenConfig;
+        socketBuffers = m_socketBuffers;
+    }
+    if (!set_socket_buffers(m_sockfd, socketBuffers)) {
+        return pipe_ret_t::systemError(errno);
+    }
+    if (listenConfig.deferAcceptSec > 0 &&
+        setsockopt(m_sockfd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &listenConfig.deferAcceptSec,
+                   sizeof(listenConfig.deferAcceptSec)) == -1) {
+        return pipe_ret_t::systemError(errno);
+    }
+    if (listenConfig.fastOpenQueue > 0 &&
+        setsockopt(m_sockfd, IPPROTO_TCP, TCP_FASTOPEN, &listenConfig.fastOpenQueue,
+                   sizeof(listenConfig.fastOpenQueue)) == -1) {
+        return pipe_ret_t::systemError(errno);
+    }
 
     memset(&m_serverAddress, 0, sizeof(m_serverAddress));
     m_serverAddress.sin_family = AF_INET;
@@ -332,21 +1454,171 @@ pipe_ret_t TcpServer::start(int port) {
 
     int bindSuccess = bind(m_sockfd, (struct sockaddr *)&m_serverAddress, sizeof(m_serverAddress));
     if (bindSuccess == -1) { // bind failed
-        ret.success = false;
-        ret.msg = strerror(errno);
-        return ret;
+        return pipe_ret_t::systemError(errno);
     }
-    const int clientsQueueSize = 5;
-    int listenSuccess = listen(m_sockfd, clientsQueueSize);
+    int listenSuccess = listen(m_sockfd, listenConfig.backlog);
     if (listenSuccess == -1) { // listen failed
-        ret.success = false;
-        ret.msg = strerror(errno);
-        return ret;
+        return pipe_ret_t::systemError(errno);
+    }
+    prepareWakeup();
+    {
+        std::lock_guard<std::mutex> lock(m_limitsMtx);
+        enableListenerTimestamping();
     }
     ret.success = true;
     return ret;
 }
 
+///
+/// Set backlog, TCP_DEFER_ACCEPT and TCP Fast Open of the listening socket.
+/// Applies to the next start call
+///
+void TcpServer::setListenConfig(const listen_config_t &config) {
+    std::lock_guard<std::mutex> lock(m_limitsMtx);
+    m_listenConfig = config;
+}
+
+///
+/// Set SO_RCVBUF and SO_SNDBUF of the listening socket, which accepted
+/// sockets inherit. Applies to the next start call
+///
+void TcpServer::setSocketBuffers(const socket_buffer_config_t &config) {
+    std::lock_guard<std::mutex> lock(m_limitsMtx);
+    m_socketBuffers = config;
+}
+
+///
+/// Wait until a connection is pending on the listener; timeout in seconds,
+/// 0 waits forever
+///
+pipe_ret_t TcpServer::waitForConnection(uint timeout) {
+    pipe_ret_t ret;
+    if (m_sockfd == -1) { // poll would ignore the descriptor and never return
+        return pipe_ret_t::systemError(EBADF);
+    }
+    struct pollfd pfds[2] = {{m_sockfd, POLLIN, 0}, {m_wakeupFd, POLLIN, 0}};
+    int pollRet = poll(pfds, 2, (timeout > 0) ? int(timeout * 1000) : -1);
+    if (pollRet == -1) { // poll failed
+        return pipe_ret_t::systemError(errno);
+    } else if (pollRet == 0) { // timeout
+        return pipe_ret_t::error(error_category_t::TIMEOUT);
+    } else if (pfds[1].revents & POLLIN) { // woken by drain or finish
+        return m_draining ? pipe_ret_t::error(error_category_t::DRAINING)
+                          : pipe_ret_t::systemError(EBADF);
+    } else if (!(pfds[0].revents & POLLIN)) { // no new client
+        return pipe_ret_t::error(error_category_t::NOT_READY);
+    }
+    ret.success = true;
+    return ret;
+}
+
+///
+/// Create the wakeup eventfd, or clear it when the server is started again
+///
+void TcpServer::prepareWakeup() {
+    if (m_wakeupFd == -1) {
+        m_wakeupFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    } else {
+        eventfd_t value;
+        eventfd_read(m_wakeupFd, &value);
+    }
+}
+
+///
+/// Wake every thread blocked in waitForConnection. The eventfd stays
+/// readable, so later calls return at once too. Closing the listener alone
+/// doesn't wake a poll that is already waiting on it
+///
+void TcpServer::wakeAcceptors() {
+    if (m_wakeupFd != -1) {
+        eventfd_write(m_wakeupFd, 1);
+    }
+}
+
+///
+/// Accept one pending connection and start its receive thread.
+/// Status NOT_READY means the queue is empty
+///
+Client TcpServer::acceptPending() {
+    struct sockaddr_in clientAddress;
+    socklen_t sosize  = sizeof(clientAddress);
+    Client newClient;
+
+    // client sockets stay blocking, each has a receive thread of its own
+    int file_descriptor = accept4(m_sockfd, (struct sockaddr*)&clientAddress, &sosize, SOCK_CLOEXEC);
+    if (file_descriptor == -1) { // accept failed
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            newClient.setStatus(pipe_ret_t::error(error_category_t::NOT_READY));
+        } else {
+            newClient.setStatus(pipe_ret_t::systemError(errno));
+        }
+        return newClient;
+    }
+
+    std::string ip = inet_ntoa(clientAddress.sin_addr);
+    if (!admitClient(ip)) {
+        close(file_descriptor);
+        m_rejectedConnections++;
+        newClient.setStatus(pipe_ret_t::error(error_category_t::CONNECTION_LIMIT));
+        return newClient;
+    }
+
+    newClient.setFileDescriptor(file_descriptor);
+    newClient.setConnected();
+    newClient.setIp(ip);
+    newClient.setConnectionId(m_nextConnectionId++);
+    Client *client = new Client(newClient);
+    {
+        std::lock_guard<std::mutex> lock(m_limitsMtx);
+        if (!enable_timestamping(file_descriptor, m_timestamping)) {
+            logger::instance().log("Failed to enable timestamping: " +
+                                   pipe_ret_t::systemError(errno).message());
+        } else if (m_timestamping.tx) {
+            client->setTxTimestamps(std::make_shared<tx_timestamps_t>());
+        }
+        if (m_priorityConfig.enabled) {
+            int lowat = m_priorityConfig.notSentLowat;
+            if (lowat > 0 && setsockopt(file_descriptor, IPPROTO_TCP, TCP_NOTSENT_LOWAT,
+                                        &lowat, sizeof(lowat)) == -1) {
+                logger::instance().log("Failed to set TCP_NOTSENT_LOWAT: " +
+                                       pipe_ret_t::systemError(errno).message());
+            }
+            // stopped by the receive task before the client is retired
+            client->setPrioritySender(std::make_shared<priority_sender>(
+                m_priorityConfig, [this, client](const char *data, size_t size) {
+                    pipe_ret_t ret = writeToSocket(*client, data, size);
+                    while (ret.category == error_category_t::PARTIAL_SEND) {
+                        data += ret.code;
+                        size -= ret.code;
+                        ret = writeToSocket(*client, data, size);
+                    }
+                    return ret;
+                }));
+        }
+    }
+    // senders on other threads see the client from here on, so everything
+    // they use must be set up above
+    addClient(client);
+    TRACE_POINT(trace_point_t::ACCEPT, accept, newClient.getConnectionId(), file_descriptor);
+    int cpu = -1;
+    {
+        std::lock_guard<std::mutex> lock(m_limitsMtx);
+        if (m_ioConfig.busyPoll) {
+            enable_busy_poll(file_descriptor, m_ioConfig);
+        }
+        if (!m_ioConfig.cpus.empty()) {
+            cpu = m_ioConfig.cpus[m_nextCpu++ % m_ioConfig.cpus.size()];
+        }
+    }
+    m_receiveThreads++;
+    client->setThreadHandler([this, client] {
+        receiveTask(client);
+        m_receiveThreads--; // last access to the server from this thread
+    }, cpu);
+
+    return newClient;
+}
+
 ///
 /// Accept and handle new client socket. To handle multiple clients, user must
 /// call this function in a loop to enable the acceptance of more than one.
@@ -356,53 +1628,64 @@ pipe_ret_t TcpServer::start(int port) {
 /// Return accepted client
 ///
 Client TcpServer::acceptClient(uint timeout) {
-    socklen_t sosize  = sizeof(m_clientAddress);
     Client newClient;
 
-    if (timeout > 0) {
-        struct timeval tv;
-        tv.tv_sec = 2;
-        tv.tv_usec = 0;
-        FD_ZERO(&m_fds);
-        FD_SET(m_sockfd, &m_fds);
-        int selectRet = select(m_sockfd + 1, &m_fds, NULL, NULL, &tv);
-        if (selectRet == -1) { // select failed
-            newClient.setErrorMessage(strerror(errno));
-            return newClient;
-        } else if (selectRet == 0) { // timeout
-            newClient.setErrorMessage("Timeout waiting for client");
-            return newClient;
-        } else if (!FD_ISSET(m_sockfd, &m_fds)) { // no new client
-            newClient.setErrorMessage("File descriptor is not set");
-            return newClient;
-        }
+    if (m_draining) {
+        newClient.setStatus(pipe_ret_t::error(error_category_t::DRAINING));
+        return newClient;
     }
 
-    int file_descriptor = accept(m_sockfd, (struct sockaddr*)&m_clientAddress, &sosize);
-    if (file_descriptor == -1) { // accept failed
-        newClient.setErrorMessage(strerror(errno));
+    pipe_ret_t ready = waitForConnection(timeout);
+    if (!ready.success) {
+        newClient.setStatus(ready);
         return newClient;
     }
+    return acceptPending();
+}
 
-    newClient.setFileDescriptor(file_descriptor);
-    newClient.setConnected();
-    newClient.setIp(inet_ntoa(m_clientAddress.sin_addr));
-    m_clients.push_back(newClient);
-    m_clients.back().setThreadHandler(std::bind(&TcpServer::receiveTask, this));
-
-    return newClient;
+///
+/// Like acceptClient, but once a connection is pending accept every queued
+/// connection, appending them to accepted. Connections refused by admission
+/// limits are skipped.
+/// Return true once the queue is drained, the error otherwise
+///
+pipe_ret_t TcpServer::acceptClients(uint timeout, std::vector<Client> &accepted) {
+    pipe_ret_t ret;
+    if (m_draining) {
+        return pipe_ret_t::error(error_category_t::DRAINING);
+    }
+    ret = waitForConnection(timeout);
+    if (!ret.success) {
+        return ret;
+    }
+    for (;;) {
+        Client client = acceptPending();
+        if (client.isConnected()) {
+            accepted.push_back(client);
+        } else if (client.getStatus().category == error_category_t::NOT_READY) {
+            break;
+        } else if (client.getStatus().category != error_category_t::CONNECTION_LIMIT) {
+            return client.getStatus();
+        }
+    }
+    ret.success = true;
+    return ret;
 }
 
 ///
 /// Send message to all connected clients.
 /// Return true if message was sent successfully to all clients
 ///
-pipe_ret_t TcpServer::sendToAllClients(const char * msg, size_t size) {
+pipe_ret_t TcpServer::sendToAllClients(const char * msg, size_t size, send_priority_t priority) {
     pipe_ret_t ret;
-    for (uint i=0; i<m_clients.size(); i++) {
-        ret = sendToClient(m_clients[i], msg, size);
-        if (!ret.success) {
-            return ret;
+    epoch_domain::guard guard(m_epoch);
+    const client_list_t *clients = m_clients.load();
+    if (clients != nullptr) {
+        for (Client *client : *clients) {
+            ret = sendToSocket(*client, msg, size, priority);
+            if (!ret.success) {
+                return ret;
+            }
         }
     }
     ret.success = true;
@@ -413,48 +1696,378 @@ pipe_ret_t TcpServer::sendToAllClients(const char * msg, size_t size) {
 /// Send message to specific client (determined by client IP address).
 /// Return true if message was sent successfully
 ///
-pipe_ret_t TcpServer::sendToClient(const Client & client, const char * msg, size_t size){
+pipe_ret_t TcpServer::sendToClient(const Client & client, const char * msg, size_t size,
+                                   send_priority_t priority) {
+    epoch_domain::guard guard(m_epoch);
+    Client *registered = findClient(client);
+    if (registered == nullptr) {
+        return pipe_ret_t::error(error_category_t::PEER_CLOSED);
+    }
+    return sendToSocket(*registered, msg, size, priority);
+}
+
+///
+/// Queue the message if the client has priority sending, write it otherwise
+///
+pipe_ret_t TcpServer::sendToSocket(const Client & client, const char * msg, size_t size,
+                                   send_priority_t priority) {
+    priority_sender *sender = client.getPrioritySender();
+    if (sender != nullptr) {
+        return sender->send(priority, msg, size);
+    }
+    return writeToSocket(client, msg, size);
+}
+
+pipe_ret_t TcpServer::writeToSocket(const Client & client, const char * msg, size_t size) {
     pipe_ret_t ret;
-    int numBytesSent = send(client.getFileDescriptor(), (char *)msg, size, 0);
+    int numBytesSent;
+    tx_timestamps_t *state = client.getTxTimestamps();
+    if (state != nullptr) {
+        // the lock keeps byte offsets in the order the kernel assigns them
+        std::lock_guard<std::mutex> lock(state->mtx);
+        uint64_t sentNs = realtime_ns();
+        numBytesSent = send(client.getFileDescriptor(), (char *)msg, size, MSG_NOSIGNAL);
+        if (numBytesSent > 0) {
+            state->sentBytes += numBytesSent;
+            state->pending.emplace_back(state->sentBytes - 1, sentNs);
+        }
+    } else {
+        numBytesSent = send(client.getFileDescriptor(), (char *)msg, size, MSG_NOSIGNAL);
+    }
     if (numBytesSent < 0) { // send failed
-        ret.success = false;
-        ret.msg = strerror(errno);
-        return ret;
+        return pipe_ret_t::systemError(errno);
     }
+    TRACE_POINT(trace_point_t::SEND, send, client.getConnectionId(), numBytesSent);
     if ((uint)numBytesSent < size) { // not all bytes were sent
-        ret.success = false;
-        char msg[100];
-        sprintf(msg, "Only %d bytes out of %lu was sent to client", numBytesSent, size);
-        ret.msg = msg;
-        return ret;
+        return pipe_ret_t::error(error_category_t::PARTIAL_SEND, numBytesSent, size);
     }
     ret.success = true;
     return ret;
 }
 
 ///
-/// Close server and clients resources.
-/// Return true is success, false otherwise
+/// Stop accepting and close connections once they are idle: nothing was
+/// received for idleMs, and both the priority queue and the kernel send
+/// queue are flushed. Connections still busy at the deadline are closed
+/// anyway.
+/// Threads blocked in acceptClient return DRAINING.
+/// Return true if every connection closed gracefully before the deadline
 ///
-pipe_ret_t TcpServer::finish() {
+pipe_ret_t TcpServer::drain(uint deadlineMs, uint idleMs) {
     pipe_ret_t ret;
-    for (uint i=0; i<m_clients.size(); i++) {
-        m_clients[i].setDisconnected();
-        if (close(m_clients[i].getFileDescriptor()) == -1) { // close failed
-            ret.success = false;
-            ret.msg = strerror(errno);
-            return ret;
+    m_draining = true;
+    if (m_sockfd != -1) {
+        close(m_sockfd);
+        m_sockfd = -1;
+    }
+    wakeAcceptors();
+
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(deadlineMs);
+    auto idle = std::chrono::milliseconds(idleMs);
+    while (m_connectionCount > 0 && std::chrono::steady_clock::now() < deadline) {
+        auto now = std::chrono::steady_clock::now();
+        {
+            epoch_domain::guard guard(m_epoch);
+            const client_list_t *clients = m_clients.load();
+            for (size_t i = 0; clients != nullptr && i < clients->size(); i++) {
+                Client *client = (*clients)[i];
+                if (!client->isConnected() || now - client->getLastActivity() < idle) {
+                    continue;
+                }
+                // the writer keeps flushing queued messages meanwhile
+                priority_sender *sender = client->getPrioritySender();
+                if (sender != nullptr && !sender->idle()) {
+                    continue;
+                }
+                int unsent = 0;
+                int fd = client->getFileDescriptor();
+                if (ioctl(fd, SIOCOUTQ, &unsent) == 0 && unsent == 0) {
+                    // receive thread sees end of stream and cleans up
+                    shutdown(fd, SHUT_RDWR);
+                }
+            }
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+
+    size_t forced = m_connectionCount;
+    {
+        epoch_domain::guard guard(m_epoch);
+        const client_list_t *clients = m_clients.load();
+        for (size_t i = 0; clients != nullptr && i < clients->size(); i++) {
+            if ((*clients)[i]->isConnected()) {
+                shutdown((*clients)[i]->getFileDescriptor(), SHUT_RDWR);
+            }
         }
     }
-    if (close(m_sockfd) == -1) { // close failed
-        ret.success = false;
-        ret.msg = strerror(errno);
+    if (forced > 0) {
+        return pipe_ret_t::error(error_category_t::DEADLINE_EXCEEDED, forced);
+    }
+    ret.success = true;
+    return ret;
+}
+
+///
+/// Pass the listening socket to a process waiting in startFromHandoff on
+/// socketPath. Both processes share the listener afterwards, so call drain()
+/// to let the new process take over all new connections.
+///
+pipe_ret_t TcpServer::handOffListener(const std::string &socketPath, uint timeoutMs) {
+    pipe_ret_t ret;
+    struct sockaddr_un address;
+    if (!make_unix_address(socketPath, address)) {
+        return pipe_ret_t::systemError(errno);
+    }
+
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+    socket_handle unixSocket;
+    for (;;) { // the new process may not be listening yet
+        unixSocket.reset(socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0));
+        if (!unixSocket) {
+            return pipe_ret_t::systemError(errno);
+        }
+        if (connect(unixSocket.get(), (struct sockaddr *)&address, sizeof(address)) == 0) {
+            break;
+        }
+        if (std::chrono::steady_clock::now() >= deadline) {
+            return pipe_ret_t::systemError(errno);
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+
+    if (!send_fd(unixSocket.get(), m_sockfd)) {
+        return pipe_ret_t::systemError(errno);
+    }
+    ret.success = true;
+    return ret;
+}
+
+///
+/// Wait for a listening socket passed by handOffListener and use it instead
+/// of binding a port, so connections are never refused during a restart.
+///
+pipe_ret_t TcpServer::startFromHandoff(const std::string &socketPath, uint timeoutMs) {
+    m_subscibers.reserve(10);
+    pipe_ret_t ret;
+    struct sockaddr_un address;
+    if (!make_unix_address(socketPath, address)) {
+        return pipe_ret_t::systemError(errno);
+    }
+
+    socket_handle unixSocket(socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0));
+    if (!unixSocket) {
+        return pipe_ret_t::systemError(errno);
+    }
+    unlink(socketPath.c_str());
+    if (bind(unixSocket.get(), (struct sockaddr *)&address, sizeof(address)) == -1 ||
+        listen(unixSocket.get(), 1) == -1) {
+        return pipe_ret_t::systemError(errno);
+    }
+
+    struct pollfd pfd = {unixSocket.get(), POLLIN, 0};
+    int pollRet = poll(&pfd, 1, timeoutMs);
+    if (pollRet <= 0) {
+        ret = (pollRet == 0) ? pipe_ret_t::error(error_category_t::TIMEOUT)
+                             : pipe_ret_t::systemError(errno);
+        unlink(socketPath.c_str());
         return ret;
     }
-    m_clients.clear();
+    socket_handle peer(accept4(unixSocket.get(), NULL, NULL, SOCK_CLOEXEC));
+    int listener = peer ? recv_fd(peer.get()) : -1;
+    unlink(socketPath.c_str());
+    if (listener == -1) {
+        return pipe_ret_t::systemError(errno);
+    }
+
+    int flags = fcntl(listener, F_GETFL);
+    if (flags == -1 || fcntl(listener, F_SETFL, flags | O_NONBLOCK) == -1) {
+        ret = pipe_ret_t::systemError(errno);
+        close(listener);
+        return ret;
+    }
+    m_sockfd = listener;
+    m_draining = false;
+    prepareWakeup();
+    {
+        std::lock_guard<std::mutex> lock(m_limitsMtx);
+        enableListenerTimestamping();
+    }
+    ret.success = true;
+    return ret;
+}
+
+///
+/// Start recording every message delivered to observers into a capture file.
+/// See samples/replay_tcpip.cc for feeding a capture back into a server
+///
+pipe_ret_t TcpServer::startCapture(const std::string &path, size_t slots) {
+    pipe_ret_t ret;
+    if (m_capture.isActive()) {
+        return pipe_ret_t::error(error_category_t::ALREADY_RUNNING);
+    }
+    if (!m_capture.start(path, slots)) { // fopen failed
+        return pipe_ret_t::systemError(errno);
+    }
+    ret.success = true;
+    return ret;
+}
+
+///
+/// Stop recording and write everything captured so far to the file
+///
+void TcpServer::stopCapture() {
+    m_capture.stop();
+}
+
+///
+/// Subscribe client to topics matching filter (see topic_router.h).
+/// Return false if the filter is invalid.
+/// Return false as well if client isn't connected: subscriptions are keyed
+/// by socket, and one left behind would be inherited by the next connection
+/// reusing it.
+///
+bool TcpServer::subscribeTopic(const Client &client, const std::string &filter) {
+    // the receive task drops the client's subscriptions again once no guard
+    // can see it, which also removes one added here after its first cleanup
+    epoch_domain::guard guard(m_epoch);
+    if (findClient(client) == nullptr) {
+        return false;
+    }
+    return m_topics.subscribe(client.getFileDescriptor(), filter);
+}
+
+bool TcpServer::unsubscribeTopic(const Client &client, const std::string &filter) {
+    epoch_domain::guard guard(m_epoch);
+    if (findClient(client) == nullptr) {
+        return false;
+    }
+    return m_topics.unsubscribe(client.getFileDescriptor(), filter);
+}
+
+///
+/// Send message to every client subscribed to the topic. Subscribers are
+/// resolved once and the same buffer is sent to each of them; a failed
+/// send doesn't stop delivery to the others.
+/// Return true if message was sent successfully to all subscribers
+///
+pipe_ret_t TcpServer::publishToTopic(std::string_view topic, const char * msg, size_t size) {
+    thread_local std::vector<int> subscribers;
+    pipe_ret_t ret;
     ret.success = true;
+    // a subscriber is unsubscribed before its Client is retired, so the
+    // guard keeps every matched socket open until the sends are done
+    epoch_domain::guard guard(m_epoch);
+    m_topics.match(topic, subscribers);
+    for (int sockfd : subscribers) {
+        Client *client = findClient(sockfd);
+        if (client == nullptr) { // disconnected meanwhile
+            continue;
+        }
+        // framed, timestamped and traced like any other send
+        pipe_ret_t sent = sendToSocket(*client, msg, size, send_priority_t::NORMAL);
+        if (!sent.success && ret.success) {
+            ret = sent;
+        }
+    }
     return ret;
 }
 
+///
+/// With topic commands enabled the server splits client data into lines and
+/// handles these itself instead of passing them to observers:
+///   SUB <filter>, UNSUB <filter>, PUB <topic> <payload>
+/// Subscribers of a PUB receive "<topic> <payload>\n". Other lines are passed
+/// to observers one line at a time. A SUB with an invalid filter, a PUB to an
+/// invalid topic and a line longer than TOPIC_COMMAND_MAX_LINE are answered
+/// with "ERR <reason>\n"; the long line is dropped whole.
+///
+void TcpServer::enableTopicCommands(bool enable) {
+    m_topicCommands = enable;
+}
+
+///
+/// Return false if line is not a topic command
+///
+bool TcpServer::handleTopicCommand(const Client &client, std::string_view line) {
+    size_t space = line.find(' ');
+    if (space == line.npos) {
+        return false;
+    }
+    std::string_view command = line.substr(0, space);
+    std::string_view argument = line.substr(space + 1);
+    if (command == "SUB") {
+        if (!subscribeTopic(client, std::string(argument))) {
+            replyTopicError(client, "invalid filter");
+        }
+    } else if (command == "UNSUB") {
+        unsubscribeTopic(client, std::string(argument));
+    } else if (command == "PUB") {
+        std::string_view topic = argument.substr(0, argument.find(' '));
+        if (!topic_router::isValidTopic(topic)) {
+            replyTopicError(client, "invalid topic");
+            return true;
+        }
+        std::string message(argument);
+        message.push_back('\n');
+        publishToTopic(topic, message.data(), message.size());
+    } else {
+        return false;
+    }
+    return true;
+}
+
+void TcpServer::replyTopicError(const Client &client, std::string_view reason) {
+    std::string reply = "ERR ";
+    reply.append(reason);
+    reply.push_back('\n');
+    sendToClient(client, reply.data(), reply.size());
+}
+
+///
+/// Close server and clients resources. Client connections are shut down,
+/// then their receive threads are waited for and their sockets closed.
+/// Return true is success, false otherwise (error of closing the listener)
+///
+pipe_ret_t TcpServer::finish() {
+    pipe_ret_t ret;
+    ret.success = true;
+    {
+        epoch_domain::guard guard(m_epoch);
+        const client_list_t *clients = m_clients.load();
+        for (size_t i = 0; clients != nullptr && i < clients->size(); i++) {
+            (*clients)[i]->setDisconnected();
+            shutdown((*clients)[i]->getFileDescriptor(), SHUT_RDWR);
+        }
+    }
+    if (m_sockfd != -1 && close(m_sockfd) == -1) { // close failed
+        ret = pipe_ret_t::systemError(errno);
+    }
+    m_sockfd = -1;
+    wakeAcceptors();
+    waitForReceiveThreads();
+    m_epoch.synchronize();
+    return ret;
+}
+
+///
+/// Wait until receive threads retired their clients. Called from an
+/// observer callback it can't wait for the calling thread, which finishes
+/// once the callback returns
+///
+void TcpServer::waitForReceiveThreads() {
+    size_t own = (t_receiveServer == this) ? 1 : 0;
+    while (m_receiveThreads > own) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+}
+
+TcpServer::~TcpServer() {
+    finish();
+    if (m_wakeupFd != -1) {
+        close(m_wakeupFd);
+    }
+    delete m_clients.load();
+}
+
 TCP_UDP_SRV_CLI::TCP_UDP_SRV_CLI() { m_running = true; }
 TCP_UDP_SRV_CLI::~TCP_UDP_SRV_CLI() { m_running = false; }
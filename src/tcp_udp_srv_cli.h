@@ -34,105 +34,431 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include <iostream> /// delete from here
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <cstring>
+#include <deque>
 #include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <thread>
 #include <vector>
 
 #include "common.h"
+#include "epoch.h"
+#include "latency_histogram.h"
+#include "message_arena.h"
+#include "priority_scheduler.h"
+#include "receive_buffer.h"
+#include "token_bucket.h"
+#include "topic_router.h"
+#include "trace.h"
+#include "traffic_capture.h"
 
 #define MAX_PACKET_SIZE 4096
+/// How long TcpClient::finish waits for a peer to take queued data
+#define FINISH_FLUSH_TIMEOUT_MS 1000
+/// Longest line a client may send with topic commands enabled
+#define TOPIC_COMMAND_MAX_LINE (64 * 1024)
 
+/// Placement of I/O threads for latency critical deployments.
+/// Threads are pinned round robin to `cpus`; if it is empty and numaNode is
+/// set, the CPUs of that node are used. A pinned thread pins itself before
+/// touching its receive buffer, so the kernel's first-touch policy places
+/// the buffer on the thread's NUMA node.
+/// With busyPoll the receive loop spins on non-blocking recv calls instead of
+/// sleeping in the kernel, and SO_BUSY_POLL makes the kernel poll the device
+/// queue for busyPollUsec. This trades a fully busy core per connection for
+/// lower and more stable tail latency.
+struct io_thread_config_t {
+  std::vector<int> cpus;
+  int numaNode = -1;
+  bool busyPoll = false;
+  int busyPollUsec = 50;
+};
+
+/// Return the CPUs of given NUMA node, empty if the node is unknown.
+std::vector<int> numa_node_cpus(int node);
+/// Parse a sysfs cpulist such as "0-3,8-11\n". Malformed ranges and CPUs
+/// beyond CPU_SETSIZE are skipped.
+std::vector<int> parse_cpulist(std::string_view text);
+/// Pin calling thread to given CPU. Return false on failure, also for a
+/// CPU number that is negative or beyond CPU_SETSIZE.
+bool pin_current_thread(int cpu);
+/// Join a thread and delete it. Called from the thread itself, from an
+/// observer callback, it can only be detached; it exits once the callback
+/// returns.
+void join_or_detach(std::thread *&thread);
+
+enum class error_category_t : uint8_t {
+  NONE,
+  SYSTEM,            /// code is errno
+  RESOLVER,          /// code is h_errno
+  PARTIAL_SEND,      /// code is bytes sent, size is bytes requested
+  PEER_CLOSED,
+  TIMEOUT,
+  NOT_READY,
+  CONNECTION_LIMIT,
+  DRAINING,
+  ALREADY_RUNNING,
+  INVALID_ADDRESS,
+  DEADLINE_EXCEEDED,  /// code is number of connections closed at deadline
+  MALFORMED_FRAME
+};
+
+/// Result of an operation. Holds only codes, so returning it never
+/// allocates; message() formats the text when somebody wants to read it.
 struct pipe_ret_t {
   bool success;
-  std::string msg;
-  pipe_ret_t() {
-    success = false;
-    msg = "";
+  error_category_t category;
+  int code;
+  size_t size;
+
+  pipe_ret_t()
+      : success(false), category(error_category_t::NONE), code(0), size(0) {}
+
+  static pipe_ret_t ok() {
+    pipe_ret_t ret;
+    ret.success = true;
+    return ret;
   }
+
+  static pipe_ret_t error(error_category_t category, int code = 0,
+			  size_t size = 0) {
+    pipe_ret_t ret;
+    ret.category = category;
+    ret.code = code;
+    ret.size = size;
+    return ret;
+  }
+
+  static pipe_ret_t systemError(int err) {
+    return error(error_category_t::SYSTEM, err);
+  }
+
+  std::string message() const;
+};
+
+/// Listening socket options applied by TcpServer::start.
+/// deferAcceptSec > 0 sets TCP_DEFER_ACCEPT: a connection is accepted only
+/// once the client sent data (or after that many seconds), so handshakes of
+/// idle clients never occupy a receive thread. fastOpenQueue > 0 enables
+/// TCP Fast Open with that many pending requests; clients must enable it
+/// too (TcpClient::setFastOpen) and net.ipv4.tcp_fastopen must allow it
+/// (1 enables clients, 2 servers, 3 both).
+struct listen_config_t {
+  int backlog = SOMAXCONN;
+  int deferAcceptSec = 0;
+  int fastOpenQueue = 0;
+};
+
+#define SOCKET_BUFFER_AUTO 0
+
+/// SO_RCVBUF and SO_SNDBUF in bytes. SOCKET_BUFFER_AUTO leaves the size to
+/// the kernel, which grows the buffers of busy connections within
+/// net.ipv4.tcp_rmem and tcp_wmem; a fixed size turns that autotuning off.
+/// The kernel doubles the value for its bookkeeping and caps it at
+/// net.core.rmem_max and wmem_max.
+struct socket_buffer_config_t {
+  int receiveBytes = SOCKET_BUFFER_AUTO;
+  int sendBytes = SOCKET_BUFFER_AUTO;
+};
+
+/// Opt-in batching of TcpClient::sendMsg. Messages are appended to a
+/// buffer that is sent with a single send once it holds maxBytes bytes or
+/// maxMessages messages, once the oldest message waited lingerUsec
+/// microseconds, or on TcpClient::flush. sendMsg then returns as soon as
+/// the message is buffered and results of the flushes it triggers are
+/// reported to flushed_func of the observers.
+struct send_batching_config_t {
+  bool enabled = false;
+  size_t maxBytes = 16 * 1024;
+  size_t maxMessages = 64;
+  uint32_t lingerUsec = 200;
+};
+
+/// Opt-in SO_TIMESTAMPING of server connections. rx stamps every received
+/// packet when the kernel (and with hardware, the NIC) got it; tx reads
+/// the time every reply was handed to the device from the socket error
+/// queue. Hardware stamps need a NIC with hardware timestamping enabled
+/// on it (e.g. with hwstamp_ctl); loopback provides software stamps only.
+/// The kernel starts stamping shortly after the first socket asks for it,
+/// packets arriving right after start() may have no RX stamps.
+struct timestamping_config_t {
+  bool rx = false;
+  bool tx = false;
+  bool hardware = false;
+};
+
+/// Kernel timestamps of a packet in CLOCK_REALTIME nanoseconds (hardware
+/// ones in the NIC clock), 0 when not available.
+struct packet_timestamps_t {
+  uint64_t softwareNs = 0;
+  uint64_t hardwareNs = 0;
+};
+
+/// Send times of a connection waiting for their TX timestamps, keyed by
+/// the stream offset of the last byte of every send.
+struct tx_timestamps_t {
+  std::mutex mtx;
+  uint32_t sentBytes = 0;
+  std::deque<std::pair<uint32_t, uint64_t>> pending;
 };
 
+/// Writes the sends of a connection with priority scheduling in a thread
+/// of its own. Frames queued meanwhile are coalesced into writes of about
+/// chunkSize bytes.
+class priority_sender {
+ public:
+  typedef std::function<pipe_ret_t(const char *data, size_t size)>
+      write_func_t;
+
+  priority_sender(const priority_config_t &config, write_func_t write);
+  ~priority_sender();
+  /// Queue a message and return. Fails with NOT_READY if its class holds
+  /// maxQueuedBytes already, or with the error of an earlier write; after
+  /// a failed write everything queued is dropped.
+  pipe_ret_t send(send_priority_t priority, const char *msg, size_t size);
+  /// Block until everything queued so far is written.
+  pipe_ret_t flush();
+  /// Same, but give up with TIMEOUT after timeout.
+  pipe_ret_t flush(std::chrono::milliseconds timeout);
+  /// Whether nothing is queued or being written.
+  bool idle();
+  /// Stop the writer, messages still queued are dropped. A write blocked
+  /// on a full socket returns only once the socket is shut down.
+  void stop();
+
+ private:
+  priority_config_t m_config;
+  write_func_t m_write;
+  std::mutex m_mtx;
+  std::condition_variable m_queuedCv;
+  std::condition_variable m_writtenCv;
+  priority_scheduler m_scheduler;
+  pipe_ret_t m_error = pipe_ret_t::ok();
+  bool m_writing = false;
+  bool m_stop = false;
+  std::string m_buffer;
+  std::thread m_writer;
+
+  void writeTask();
+};
+
+/// TcpServer keeps its own heap copy of every accepted client and hands it
+/// to observers; copies returned by acceptClient identify that connection
+/// in sendToClient and deleteClient.
 class Client {
  private:
   int m_sockfd;
-  std::string m_ip;
-  std::string m_errorMsg;
-  bool m_isConnected;
-  std::thread *m_threadHandler;
+  uint32_t m_connectionId;
+  std::atomic<bool> m_isConnected;
+  char m_ip[INET6_ADDRSTRLEN];  /// inline, a client costs no allocation
+  pipe_ret_t m_status;
+  std::chrono::steady_clock::time_point m_lastActivity;
+  std::shared_ptr<tx_timestamps_t> m_txTimestamps;
+  std::shared_ptr<priority_sender> m_prioritySender;
+  message_arena *m_arena = nullptr;
 
  public:
   Client();
-  ~Client();
+  Client(const Client &other);
+  Client &operator=(const Client &other);
   bool operator==(const Client &);
 
   void setFileDescriptor(int);
   int getFileDescriptor() const;
 
+  /// Longer addresses are truncated to INET6_ADDRSTRLEN - 1 characters.
   void setIp(const std::string &);
   std::string getIp() const;
+  /// The address without a copy, valid as long as the client.
+  std::string_view getIpView() const;
+
+  void setConnectionId(uint32_t id);
+  uint32_t getConnectionId() const;
 
-  void setErrorMessage(const std::string &);
+  void setStatus(const pipe_ret_t &);
+  const pipe_ret_t &getStatus() const;
   std::string getInfoMessage() const;
 
   void setConnected();
   void setDisconnected();
   bool isConnected();
 
-  void setThreadHandler(std::function<void(void)> func);
+  void touch();
+  std::chrono::steady_clock::time_point getLastActivity() const;
+
+  /// Set by TcpServer when TX timestamping is on, shared by copies.
+  void setTxTimestamps(std::shared_ptr<tx_timestamps_t> state);
+  tx_timestamps_t *getTxTimestamps() const;
+
+  /// Set by TcpServer when priority sending is on, shared by copies.
+  void setPrioritySender(std::shared_ptr<priority_sender> sender);
+  priority_sender *getPrioritySender() const;
+
+  /// Set by TcpServer around dispatching a message, not carried by copies.
+  void setArena(message_arena *arena);
+  /// Memory for temporaries of an observer handling a message of this
+  /// client; all of it is released when the dispatch ends. Use it only on
+  /// the dispatching thread. Outside a dispatch this is the default
+  /// resource.
+  std::pmr::memory_resource *getArena() const;
+
+  /// Run func in a detached thread, pinned to cpu if it is not negative.
+  void setThreadHandler(std::function<void(void)> func, int cpu = -1);
 };
 
+/// Observer callbacks are std::function so that members and lambdas can
+/// observe, plain functions are assigned as before.
 typedef void(incoming_packet_func)(const char *msg, size_t size);
-typedef incoming_packet_func *incoming_packet_func_t;
+typedef std::function<incoming_packet_func> incoming_packet_func_t;
 typedef void(disconnected_func)(const pipe_ret_t &ret);
-typedef disconnected_func *disconnected_func_t;
+typedef std::function<disconnected_func> disconnected_func_t;
+/// Result of a batched send of `messages` messages, `bytes` in total.
+typedef void(flushed_func)(const pipe_ret_t &ret, size_t bytes,
+			   size_t messages);
+typedef std::function<flushed_func> flushed_func_t;
 
 struct client_observer_t {
   std::string wantedIp;
   incoming_packet_func_t incoming_packet_func;
   disconnected_func_t disconnected_func;
+  flushed_func_t flushed_func;
 
   client_observer_t() {
     wantedIp = "";
-    incoming_packet_func = NULL;
-    disconnected_func = NULL;
+    incoming_packet_func = nullptr;
+    disconnected_func = nullptr;
+    flushed_func = nullptr;
   }
 };
 
 typedef void(incoming_packet_func_srv)(const Client &client, const char *msg,
 				       size_t size);
-typedef incoming_packet_func_srv *incoming_packet_func_srv_t;
+typedef std::function<incoming_packet_func_srv> incoming_packet_func_srv_t;
 typedef void(disconnected_func_srv)(const Client &client);
-typedef disconnected_func_srv *disconnected_func_srv_t;
+typedef std::function<disconnected_func_srv> disconnected_func_srv_t;
+typedef void(incoming_packet_ts_func_srv)(const Client &client,
+					  const char *msg, size_t size,
+					  const packet_timestamps_t &rx);
+typedef std::function<incoming_packet_ts_func_srv>
+    incoming_packet_ts_func_srv_t;
+/// bytesSent is the stream offset of the last byte covered by tx.
+typedef void(tx_timestamp_func_srv)(const Client &client, uint32_t bytesSent,
+				    const packet_timestamps_t &tx);
+typedef std::function<tx_timestamp_func_srv> tx_timestamp_func_srv_t;
 
+/// incoming_packet_ts_func, if set, is called instead of
+/// incoming_packet_func and also gets the RX timestamps of the message.
 struct server_observer_t {
   std::string wantedIp;
   incoming_packet_func_srv_t incoming_packet_func;
   disconnected_func_srv_t disconnected_func;
+  incoming_packet_ts_func_srv_t incoming_packet_ts_func;
+  tx_timestamp_func_srv_t tx_timestamp_func;
 
   server_observer_t() {
     wantedIp = "";
-    incoming_packet_func = NULL;
-    disconnected_func = NULL;
+    incoming_packet_func = nullptr;
+    disconnected_func = nullptr;
+    incoming_packet_ts_func = nullptr;
+    tx_timestamp_func = nullptr;
   }
 };
 
+/// Token bucket limits applied to received data. A message is one chunk
+/// returned by recv. Zero rate means unlimited, zero burst means one second
+/// worth of rate.
+struct rate_limit_t {
+  double bytesPerSec = 0;
+  double bytesBurst = 0;
+  double messagesPerSec = 0;
+  double messagesBurst = 0;
+};
+
+/// Connection caps are checked in acceptClient before a connection is
+/// registered, rate limits are applied by the receive thread of every
+/// connection. Zero means unlimited.
+struct admission_limits_t {
+  size_t maxConnections = 0;
+  size_t maxConnectionsPerIp = 0;
+  rate_limit_t perConnection;
+  rate_limit_t perIp;
+};
+
+struct rate_limit_stats_t {
+  uint64_t rejectedConnections = 0;
+  uint64_t throttledReads = 0;
+  uint64_t throttledUsec = 0;
+};
+
 class TcpClient {
  private:
-  int m_sockfd = 0;
-  bool stop = false;
+  int m_sockfd = -1;
+  std::atomic<bool> stop{false};
   struct sockaddr_in m_server;
   std::vector<client_observer_t> m_subscibers;
   std::thread *m_receiveTask = nullptr;
+  io_thread_config_t m_ioConfig;
+  bool m_fastOpen = false;
+  receive_config_t m_receiveConfig;
+  socket_buffer_config_t m_socketBuffers;
+
+  /// Batched messages. m_sendMtx keeps taking and sending a batch atomic,
+  /// so batches go out in order; m_batchMtx guards only the buffer, so
+  /// sendMsg can append while a batch is being sent.
+  send_batching_config_t m_batchingConfig;
+  send_batching_config_t m_batching;  /// of the current connection
+  std::timed_mutex m_sendMtx;
+  std::mutex m_batchMtx;
+  std::condition_variable m_batchCv;
+  std::string m_batch;
+  std::string m_sending;  /// batch being sent, swapped to reuse capacity
+  size_t m_batchMessages = 0;
+  std::chrono::steady_clock::time_point m_batchStart;
+  bool m_stopFlush = false;  /// set by finish, sendMsg stops batching
+  std::chrono::steady_clock::time_point m_flushDeadline =
+      std::chrono::steady_clock::time_point::max();  /// set by finish
+  std::thread *m_flushTask = nullptr;
+
+  priority_config_t m_priorityConfig;
+  std::unique_ptr<priority_sender> m_prioritySender;
 
   void publishServerMsg(const char *msg, size_t msgSize);
   void publishServerDisconnected(const pipe_ret_t &ret);
+  void publishFlushed(const pipe_ret_t &ret, size_t bytes, size_t messages);
   void ReceiveTask();
+  void FlushTask();
   void terminateReceiveThread();
+  void terminateFlushThread();
+  pipe_ret_t flushBatch(size_t &bytes, size_t &messages);
 
  public:
   ~TcpClient();
+  void setIoThreadConfig(const io_thread_config_t &config);
+  /// Send the first message in the SYN (TCP_FASTOPEN_CONNECT) once the
+  /// server handed out a Fast Open cookie. Applies to the next connectTo.
+  void setFastOpen(bool enable);
+  /// Applies to the next connectTo.
+  void setReceiveConfig(const receive_config_t &config);
+  /// Applies to the next connectTo.
+  void setSocketBuffers(const socket_buffer_config_t &config);
+  /// Applies to the next connectTo.
+  void setSendBatching(const send_batching_config_t &config);
+  /// Frame and schedule sends by priority (see priority_scheduler.h),
+  /// send batching is bypassed then. The server must frame its data as
+  /// well; observers get its messages decoded. Applies to the next
+  /// connectTo.
+  void setPrioritySending(const priority_config_t &config);
   pipe_ret_t connectTo(const std::string &address, int port);
-  pipe_ret_t sendMsg(const char *msg, size_t size);
+  /// priority takes effect only with priority sending enabled.
+  pipe_ret_t sendMsg(const char *msg, size_t size,
+		     send_priority_t priority = send_priority_t::NORMAL);
+  /// Send the buffered messages now and return the result.
+  pipe_ret_t flush();
 
   void subscribe(const client_observer_t &observer);
   void unsubscribeAll();
@@ -143,26 +469,122 @@ class TcpClient {
 
 class TcpServer {
  private:
-  int m_sockfd;
+  int m_sockfd = -1;
+  int m_wakeupFd = -1;  /// eventfd waking threads waiting for connections
+  std::atomic<bool> m_draining{false};
   struct sockaddr_in m_serverAddress;
-  struct sockaddr_in m_clientAddress;
-  fd_set m_fds;
-  std::vector<Client> m_clients;
+  listen_config_t m_listenConfig;
+  socket_buffer_config_t m_socketBuffers;
   std::vector<server_observer_t> m_subscibers;
   std::thread *threadHandle;
 
-  void publishClientMsg(const Client &client, const char *msg, size_t msgSize);
+  /// Connected clients sorted by socket. Readers load the list inside a
+  /// guard of m_epoch without locking; writers serialize on m_clientsMtx,
+  /// publish a modified copy and retire the old list. A removed Client is
+  /// retired too and its socket is closed only when it is reclaimed, so a
+  /// reader never sends on a descriptor reused by a newer connection.
+  typedef std::vector<Client *> client_list_t;
+  epoch_domain m_epoch;
+  std::atomic<client_list_t *> m_clients{nullptr};
+  std::mutex m_clientsMtx;
+  std::atomic<size_t> m_receiveThreads{0};
+
+  struct ip_state_t {
+    size_t connections = 0;
+    token_bucket bytes;
+    token_bucket messages;
+
+    explicit ip_state_t(const rate_limit_t &limit)
+	: bytes(limit.bytesPerSec, limit.bytesBurst),
+	  messages(limit.messagesPerSec, limit.messagesBurst) {}
+  };
+  admission_limits_t m_limits;
+  std::mutex m_limitsMtx;
+  std::map<std::string, std::shared_ptr<ip_state_t>> m_ipStates;
+  io_thread_config_t m_ioConfig;
+  timestamping_config_t m_timestamping;
+  priority_config_t m_priorityConfig;
+  receive_config_t m_receiveConfig;
+  latency_histogram m_rxDelay;
+  latency_histogram m_txDelay;
+  size_t m_nextCpu = 0;
+  std::atomic<size_t> m_connectionCount{0};
+  std::atomic<uint64_t> m_rejectedConnections{0};
+  std::atomic<uint64_t> m_throttledReads{0};
+  std::atomic<uint64_t> m_throttledUsec{0};
+  std::atomic<uint32_t> m_nextConnectionId{0};
+  traffic_capture m_capture;
+  topic_router m_topics;
+  std::atomic<bool> m_topicCommands{false};
+
+  bool admitClient(const std::string &ip);
+  void releaseClient(const std::string &ip);
+  size_t waitForReadBudget(Client &client, token_bucket &bytes,
+			   token_bucket &messages, ip_state_t &ipState,
+			   size_t readSize);
+  void publishClientMsg(const Client &client, const char *msg, size_t msgSize,
+			const packet_timestamps_t &rx);
+  void readTxTimestamps(Client &client);
+  void enableListenerTimestamping();
+  pipe_ret_t waitForConnection(uint timeout);
+  void prepareWakeup();
+  void wakeAcceptors();
+  Client acceptPending();
   void publishClientDisconnected(const Client &client);
-  void receiveTask(/*void * context*/);
+  void receiveTask(Client *client);
+  void addClient(Client *client);
+  bool removeClient(Client *client);
+  Client *findClient(const Client &client) const;
+  Client *findClient(int sockfd) const;
+  pipe_ret_t sendToSocket(const Client &client, const char *msg, size_t size,
+			  send_priority_t priority);
+  pipe_ret_t writeToSocket(const Client &client, const char *msg, size_t size);
+  void waitForReceiveThreads();
+  bool handleTopicCommand(const Client &client, std::string_view line);
+  void replyTopicError(const Client &client, std::string_view reason);
 
  public:
+  ~TcpServer();
+  void setListenConfig(const listen_config_t &config);
+  /// Set on the listening socket, accepted connections inherit the sizes.
+  /// Applies to the next start call.
+  void setSocketBuffers(const socket_buffer_config_t &config);
   pipe_ret_t start(int port);
+  void setAdmissionLimits(const admission_limits_t &limits);
+  void setIoThreadConfig(const io_thread_config_t &config);
+  rate_limit_stats_t getRateLimitStats() const;
+  void setTimestamping(const timestamping_config_t &config);
+  /// Frame and schedule sends to connections accepted from now on by
+  /// priority (see priority_scheduler.h). Their sends return once the
+  /// message is queued. Their clients must frame their data as well;
+  /// observers, capture and topic commands get it decoded.
+  void setPrioritySending(const priority_config_t &config);
+  /// Applies to connections accepted from now on.
+  void setReceiveConfig(const receive_config_t &config);
+  /// Time received packets waited in socket buffers before recv returned
+  /// and time from a send call to its TX timestamp, in nanoseconds.
+  const latency_histogram &getRxDelayHistogram() const;
+  const latency_histogram &getTxDelayHistogram() const;
   Client acceptClient(uint timeout);
+  pipe_ret_t acceptClients(uint timeout, std::vector<Client> &accepted);
   bool deleteClient(Client &client);
   void subscribe(const server_observer_t &observer);
   void unsubscribeAll();
-  pipe_ret_t sendToAllClients(const char *msg, size_t size);
-  pipe_ret_t sendToClient(const Client &client, const char *msg, size_t size);
+  /// priority takes effect on connections with priority sending only.
+  pipe_ret_t sendToAllClients(
+      const char *msg, size_t size,
+      send_priority_t priority = send_priority_t::NORMAL);
+  pipe_ret_t sendToClient(const Client &client, const char *msg, size_t size,
+			  send_priority_t priority = send_priority_t::NORMAL);
+  bool subscribeTopic(const Client &client, const std::string &filter);
+  bool unsubscribeTopic(const Client &client, const std::string &filter);
+  pipe_ret_t publishToTopic(std::string_view topic, const char *msg, size_t size);
+  void enableTopicCommands(bool enable);
+  pipe_ret_t drain(uint deadlineMs, uint idleMs = 100);
+  pipe_ret_t handOffListener(const std::string &socketPath, uint timeoutMs);
+  pipe_ret_t startFromHandoff(const std::string &socketPath, uint timeoutMs);
+  pipe_ret_t startCapture(const std::string &path, size_t slots = 4096);
+  void stopCapture();
   pipe_ret_t finish();
   void printClients();
 };
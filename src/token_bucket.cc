@@ -0,0 +1,52 @@
+/// MIT License
+/// Copyright (c) 2020
+///
+/// Description:
+/// This file contains implementation of the token bucket.
+
+#include "token_bucket.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+token_bucket::token_bucket(double rate, double burst)
+    : m_rate{rate},
+      m_burst{burst > 0 ? burst : rate},
+      m_tokens{burst > 0 ? burst : rate} {}
+
+void token_bucket::refill(clock::time_point now) {
+  std::chrono::duration<double> elapsed = now - m_last;
+  m_last = now;
+  m_tokens = std::min(m_burst, m_tokens + elapsed.count() * m_rate);
+}
+
+uint64_t token_bucket::available() {
+  if (unlimited()) {
+    return std::numeric_limits<uint64_t>::max();
+  }
+  std::lock_guard<std::mutex> lock(m_mtx);
+  refill(clock::now());
+  return m_tokens > 0 ? static_cast<uint64_t>(m_tokens) : 0;
+}
+
+void token_bucket::consume(double tokens) {
+  if (unlimited()) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(m_mtx);
+  refill(clock::now());
+  m_tokens -= tokens;
+}
+
+uint64_t token_bucket::waitTimeUsec(double tokens) {
+  if (unlimited()) {
+    return 0;
+  }
+  std::lock_guard<std::mutex> lock(m_mtx);
+  refill(clock::now());
+  if (m_tokens >= tokens) {
+    return 0;
+  }
+  return static_cast<uint64_t>(std::ceil((tokens - m_tokens) / m_rate * 1e6));
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+/// MIT License
+/// Copyright (c) 2020
+///
+/// Description:
+/// This file contains a thread safe token bucket used to rate limit
+/// connections.
+
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+
+/// Refills `rate` tokens per second up to `burst` tokens. A bucket with
+/// rate <= 0 is unlimited. Consuming more tokens than available is allowed
+/// and leaves the bucket in debt, which keeps callers that share one bucket
+/// from having to reserve tokens before they know how many they need.
+class token_bucket {
+ public:
+  token_bucket() = default;
+  token_bucket(double rate, double burst);
+
+  bool unlimited() const noexcept { return m_rate <= 0; }
+  double burst() const noexcept { return m_burst; }
+
+  /// Whole tokens available right now.
+  uint64_t available();
+  void consume(double tokens);
+  /// Microseconds until `tokens` tokens are available, 0 if they already are.
+  uint64_t waitTimeUsec(double tokens);
+
+ private:
+  using clock = std::chrono::steady_clock;
+
+  void refill(clock::time_point now);
+
+  std::mutex m_mtx;
+  double m_rate = 0;
+  double m_burst = 0;
+  double m_tokens = 0;
+  clock::time_point m_last = clock::now();
+};
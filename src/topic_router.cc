@@ -0,0 +1,164 @@
+/// MIT License
+/// Copyright (c) 2020
+///
+/// Description:
+/// This file contains implementation of the topic subscription trie. Every
+/// trie level is one topic level; '+' and '#' are stored as ordinary
+/// children and tried next to the exact level while matching, so a publish
+/// costs one walk over the topic levels whatever the number of
+/// subscriptions.
+
+#include "topic_router.h"
+
+#include <algorithm>
+#include <mutex>
+
+#include "common.h"
+
+namespace {
+/// Unlike split_view, keeps empty levels: "a//b" has three levels.
+std::vector<std::string_view> topic_levels(std::string_view topic) {
+  std::vector<std::string_view> levels;
+  const char *pos = topic.data();
+  const char *last = pos + topic.size();
+  for (;;) {
+    const char *next = find_delimiter(pos, last, '/');
+    levels.emplace_back(pos, next - pos);
+    if (next == last) {
+      break;
+    }
+    pos = next + 1;
+  }
+  return levels;
+}
+}  // namespace
+
+bool topic_router::isValidFilter(std::string_view filter) {
+  if (filter.empty()) {
+    return false;
+  }
+  auto levels = topic_levels(filter);
+  for (size_t i = 0; i < levels.size(); i++) {
+    std::string_view level = levels[i];
+    if (level == "#") {
+      if (i + 1 != levels.size()) {
+	return false;
+      }
+    } else if (level != "+" && level.find_first_of("+#") != level.npos) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool topic_router::isValidTopic(std::string_view topic) {
+  return !topic.empty() && topic.find_first_of("+#") == topic.npos;
+}
+
+bool topic_router::subscribe(int subscriber, const std::string &filter) {
+  if (!isValidFilter(filter)) {
+    return false;
+  }
+  std::unique_lock<std::shared_mutex> lock(m_mtx);
+  node_t *node = &m_root;
+  for (std::string_view level : topic_levels(filter)) {
+    auto it = node->children.find(level);
+    if (it == node->children.end()) {
+      it = node->children
+	       .emplace(std::string(level), std::make_unique<node_t>())
+	       .first;
+    }
+    node = it->second.get();
+  }
+  node->subscribers.insert(subscriber);
+  m_filters[subscriber].insert(filter);
+  return true;
+}
+
+bool topic_router::erase(node_t &node,
+			 const std::vector<std::string_view> &levels,
+			 size_t depth, int subscriber) {
+  if (depth == levels.size()) {
+    node.subscribers.erase(subscriber);
+  } else {
+    auto it = node.children.find(levels[depth]);
+    if (it != node.children.end() &&
+	erase(*it->second, levels, depth + 1, subscriber)) {
+      node.children.erase(it);
+    }
+  }
+  return node.subscribers.empty() && node.children.empty();
+}
+
+bool topic_router::unsubscribe(int subscriber, const std::string &filter) {
+  std::unique_lock<std::shared_mutex> lock(m_mtx);
+  auto it = m_filters.find(subscriber);
+  if (it == m_filters.end() || it->second.erase(filter) == 0) {
+    return false;
+  }
+  if (it->second.empty()) {
+    m_filters.erase(it);
+  }
+  erase(m_root, topic_levels(filter), 0, subscriber);
+  return true;
+}
+
+void topic_router::unsubscribeAll(int subscriber) {
+  std::unique_lock<std::shared_mutex> lock(m_mtx);
+  auto it = m_filters.find(subscriber);
+  if (it == m_filters.end()) {
+    return;
+  }
+  for (const std::string &filter : it->second) {
+    erase(m_root, topic_levels(filter), 0, subscriber);
+  }
+  m_filters.erase(it);
+}
+
+void topic_router::collect(const node_t &node,
+			   const std::vector<std::string_view> &levels,
+			   size_t depth, std::vector<int> &subscribers) const {
+  auto multiLevel = node.children.find(std::string_view("#"));
+  if (multiLevel != node.children.end()) {
+    const auto &matched = multiLevel->second->subscribers;
+    subscribers.insert(subscribers.end(), matched.begin(), matched.end());
+  }
+  if (depth == levels.size()) {
+    subscribers.insert(subscribers.end(), node.subscribers.begin(),
+		       node.subscribers.end());
+    return;
+  }
+  auto exact = node.children.find(levels[depth]);
+  if (exact != node.children.end()) {
+    collect(*exact->second, levels, depth + 1, subscribers);
+  }
+  auto singleLevel = node.children.find(std::string_view("+"));
+  if (singleLevel != node.children.end()) {
+    collect(*singleLevel->second, levels, depth + 1, subscribers);
+  }
+}
+
+void topic_router::match(std::string_view topic,
+			 std::vector<int> &subscribers) const {
+  subscribers.clear();
+  if (!isValidTopic(topic)) {
+    return;
+  }
+  auto levels = topic_levels(topic);
+  {
+    std::shared_lock<std::shared_mutex> lock(m_mtx);
+    collect(m_root, levels, 0, subscribers);
+  }
+  std::sort(subscribers.begin(), subscribers.end());
+  subscribers.erase(std::unique(subscribers.begin(), subscribers.end()),
+		    subscribers.end());
+}
+
+size_t topic_router::subscriptionCount() const {
+  std::shared_lock<std::shared_mutex> lock(m_mtx);
+  size_t count = 0;
+  for (const auto &filters : m_filters) {
+    count += filters.second.size();
+  }
+  return count;
+}
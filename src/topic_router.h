@@ -0,0 +1,53 @@
+#pragma once
+
+/// MIT License
+/// Copyright (c) 2020
+///
+/// Description:
+/// This file contains a subscription index for hierarchical topics.
+///
+/// Topics are levels separated by '/', e.g. "prices/eu/btc". Filters may use
+/// '+' to match exactly one level and '#' as the last level to match any
+/// number of remaining levels (including none), so "prices/+/btc" and
+/// "prices/#" both match the topic above.
+
+#include <map>
+#include <memory>
+#include <set>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+class topic_router {
+ public:
+  static bool isValidFilter(std::string_view filter);
+  static bool isValidTopic(std::string_view topic);
+
+  /// Return false if the filter is invalid.
+  bool subscribe(int subscriber, const std::string &filter);
+  /// Return false if the subscriber had no such subscription.
+  bool unsubscribe(int subscriber, const std::string &filter);
+  void unsubscribeAll(int subscriber);
+
+  /// Fill subscribers with every subscriber having a filter that matches
+  /// topic, each one listed once.
+  void match(std::string_view topic, std::vector<int> &subscribers) const;
+
+  size_t subscriptionCount() const;
+
+ private:
+  struct node_t {
+    std::map<std::string, std::unique_ptr<node_t>, std::less<>> children;
+    std::set<int> subscribers;
+  };
+
+  void collect(const node_t &node, const std::vector<std::string_view> &levels,
+	       size_t depth, std::vector<int> &subscribers) const;
+  bool erase(node_t &node, const std::vector<std::string_view> &levels,
+	     size_t depth, int subscriber);
+
+  mutable std::shared_mutex m_mtx;
+  node_t m_root;
+  std::map<int, std::set<std::string>> m_filters;
+};
@@ -0,0 +1,158 @@
+/// MIT License
+/// Copyright (c) 2020
+///
+/// Description:
+/// This file contains implementation of the trace ring. Writers claim a
+/// position with one atomic increment and publish the slot like a seqlock,
+/// so recording never blocks and a reader copying the ring skips slots that
+/// are being overwritten.
+
+#include "trace.h"
+
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <thread>
+
+namespace {
+uint64_t monotonic_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+uint32_t current_thread_id() {
+  thread_local uint32_t tid = syscall(SYS_gettid);
+  return tid;
+}
+
+const char *point_name(trace_point_t point) {
+  switch (point) {
+    case trace_point_t::ACCEPT:
+      return "accept";
+    case trace_point_t::READ:
+      return "read";
+    case trace_point_t::FRAME:
+      return "frame";
+    case trace_point_t::DISPATCH_BEGIN:
+    case trace_point_t::DISPATCH_END:
+      return "dispatch";
+    case trace_point_t::SEND:
+      return "send";
+  }
+  return "unknown";
+}
+}  // namespace
+
+std::atomic<bool> tracer::s_enabled{false};
+
+tracer &tracer::instance() {
+  static tracer instance;
+  return instance;
+}
+
+void tracer::start(size_t capacity) {
+  stop();
+  size_t size = 2;
+  while (size < capacity) {
+    size <<= 1;
+  }
+  m_slots.reset(new slot_t[size]);
+  m_mask = size - 1;
+  m_next = 0;
+  s_enabled = true;
+}
+
+void tracer::stop() {
+  s_enabled = false;
+  // let writers that saw the tracer enabled finish their slot
+  while (m_inFlight.load() > 0) {
+    std::this_thread::yield();
+  }
+}
+
+void tracer::record(trace_point_t point, uint32_t connectionId,
+		    uint64_t value) {
+  m_inFlight++;
+  if (s_enabled) {
+    uint64_t pos = m_next.fetch_add(1, std::memory_order_relaxed);
+    slot_t &slot = m_slots[pos & m_mask];
+    slot.sequence.store(2 * pos + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.timestampNs.store(monotonic_ns(), std::memory_order_relaxed);
+    slot.ids.store(uint64_t(connectionId) << 32 | current_thread_id(),
+		   std::memory_order_relaxed);
+    slot.value.store(value, std::memory_order_relaxed);
+    slot.point.store(uint8_t(point), std::memory_order_relaxed);
+    slot.sequence.store(2 * pos + 2, std::memory_order_release);
+  }
+  m_inFlight--;
+}
+
+std::vector<trace_event_t> tracer::events() const {
+  std::vector<trace_event_t> events;
+  if (!m_slots) {
+    return events;
+  }
+  uint64_t next = m_next.load();
+  uint64_t first = (next > m_mask + 1) ? next - (m_mask + 1) : 0;
+  events.reserve(next - first);
+  for (uint64_t pos = first; pos < next; pos++) {
+    const slot_t &slot = m_slots[pos & m_mask];
+    uint64_t sequence = slot.sequence.load(std::memory_order_acquire);
+    if (sequence != 2 * pos + 2) {  // being written or already overwritten
+      continue;
+    }
+    trace_event_t event;
+    event.timestampNs = slot.timestampNs.load(std::memory_order_relaxed);
+    uint64_t ids = slot.ids.load(std::memory_order_relaxed);
+    event.connectionId = ids >> 32;
+    event.threadId = uint32_t(ids);
+    event.value = slot.value.load(std::memory_order_relaxed);
+    event.point = trace_point_t(slot.point.load(std::memory_order_relaxed));
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (slot.sequence.load(std::memory_order_relaxed) == sequence) {
+      events.push_back(event);
+    }
+  }
+  return events;
+}
+
+/*
+ * Dispatches are duration events (ph B/E) on the receive thread, the other
+ * points are thread scoped instant events. Timestamps are microseconds
+ */
+bool tracer::dumpChromeTrace(const std::string &path) const {
+  FILE *file = fopen(path.c_str(), "w");
+  if (file == nullptr) {
+    return false;
+  }
+  const int pid = getpid();
+  fprintf(file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+  bool first = true;
+  for (const trace_event_t &event : events()) {
+    const char *phase = "i";
+    const char *valueName = "bytes";
+    if (event.point == trace_point_t::DISPATCH_BEGIN) {
+      phase = "B";
+    } else if (event.point == trace_point_t::DISPATCH_END) {
+      phase = "E";
+    } else if (event.point == trace_point_t::ACCEPT) {
+      valueName = "socket";
+    }
+    fprintf(file,
+	    "%s\n{\"name\":\"%s\",\"cat\":\"net\",\"ph\":\"%s\",%s"
+	    "\"ts\":%llu.%03llu,\"pid\":%d,\"tid\":%u,"
+	    "\"args\":{\"connection\":%u,\"%s\":%llu}}",
+	    first ? "" : ",", point_name(event.point), phase,
+	    phase[0] == 'i' ? "\"s\":\"t\"," : "",
+	    (unsigned long long)(event.timestampNs / 1000),
+	    (unsigned long long)(event.timestampNs % 1000), pid, event.threadId,
+	    event.connectionId, valueName, (unsigned long long)event.value);
+    first = false;
+  }
+  fprintf(file, "\n]}\n");
+  return fclose(file) == 0;
+}
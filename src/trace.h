@@ -0,0 +1,103 @@
+#pragma once
+
+/// MIT License
+/// Copyright (c) 2020
+///
+/// Description:
+/// This file contains hot path tracing of the server.
+///
+/// Every trace point is a USDT probe of provider easy_srv_cli when
+/// <sys/sdt.h> is available at build time (a nop instruction until perf or
+/// bpftrace attaches) and an event in the in-process trace ring while the
+/// tracer is started. Probe arguments are the connection id and a value:
+///   accept          connection, socket
+///   read            connection, bytes received
+///   frame           connection, bytes of a complete line (topic commands)
+///   dispatch_begin  connection, bytes passed to observers
+///   dispatch_end    connection, bytes passed to observers
+///   send            connection, bytes sent by sendToClient/sendToAllClients
+/// e.g. bpftrace -e 'usdt:./server_tcpip:easy_srv_cli:read { @[arg0] = sum(arg1); }'
+///
+/// The ring keeps the newest events and dumps them as Chrome trace JSON
+/// that chrome://tracing and ui.perfetto.dev open.
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define TRACE_USDT(probe, connection, value) \
+  DTRACE_PROBE2(easy_srv_cli, probe, connection, value)
+#endif
+#endif
+#ifndef TRACE_USDT
+#define TRACE_USDT(probe, connection, value) ((void)0)
+#endif
+
+/// Fire USDT probe `probe` and record `point` if the tracer is started.
+#define TRACE_POINT(point, probe, connection, value)                  \
+  do {                                                                \
+    TRACE_USDT(probe, connection, value);                             \
+    if (tracer::enabled()) {                                          \
+      tracer::instance().record(point, connection, value);            \
+    }                                                                 \
+  } while (0)
+
+enum class trace_point_t : uint8_t {
+  ACCEPT,
+  READ,
+  FRAME,
+  DISPATCH_BEGIN,
+  DISPATCH_END,
+  SEND
+};
+
+struct trace_event_t {
+  uint64_t timestampNs;  /// CLOCK_MONOTONIC
+  uint32_t connectionId;
+  uint32_t threadId;
+  uint64_t value;
+  trace_point_t point;
+};
+
+class tracer {
+ public:
+  static tracer &instance();
+  static bool enabled() noexcept {
+    return s_enabled.load(std::memory_order_relaxed);
+  }
+
+  /// Clear the ring and start recording, keeping the newest `capacity`
+  /// events (rounded up to a power of two).
+  void start(size_t capacity = 1 << 16);
+  void stop();
+  void record(trace_point_t point, uint32_t connectionId, uint64_t value);
+
+  /// Events currently in the ring, oldest first. Events being overwritten
+  /// while copying are skipped.
+  std::vector<trace_event_t> events() const;
+  /// Return false if the file can't be written.
+  bool dumpChromeTrace(const std::string &path) const;
+
+ private:
+  struct slot_t {
+    /// 2 * position + 1 while written, 2 * position + 2 when complete
+    std::atomic<uint64_t> sequence{0};
+    std::atomic<uint64_t> timestampNs{0};
+    std::atomic<uint64_t> ids{0};  /// connection id << 32 | thread id
+    std::atomic<uint64_t> value{0};
+    std::atomic<uint8_t> point{0};
+  };
+
+  tracer() = default;
+
+  static std::atomic<bool> s_enabled;
+  std::unique_ptr<slot_t[]> m_slots;
+  size_t m_mask = 0;
+  std::atomic<uint64_t> m_next{0};
+  std::atomic<int> m_inFlight{0};
+};
@@ -0,0 +1,197 @@
+/// MIT License
+/// Copyright (c) 2020
+///
+/// Description:
+/// This file contains implementation of traffic capture. The ring is the
+/// bounded MPMC queue of D. Vyukov used with a single consumer: every slot
+/// carries a sequence number telling producers and the consumer whose turn
+/// it is.
+
+#include "traffic_capture.h"
+
+#include <time.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+namespace {
+uint64_t clock_ns(clockid_t clock) {
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+}  // namespace
+
+traffic_capture::~traffic_capture() { stop(); }
+
+bool traffic_capture::start(const std::string &path, size_t slots) {
+  if (m_active || m_writer != nullptr) {
+    return false;
+  }
+  m_file = fopen(path.c_str(), "wb");
+  if (m_file == nullptr) {
+    return false;
+  }
+  setvbuf(m_file, nullptr, _IOFBF, 1 << 20);
+
+  size_t capacity = 2;
+  while (capacity < slots) {
+    capacity <<= 1;
+  }
+  m_slots.reset(new slot_t[capacity]);
+  for (size_t i = 0; i < capacity; i++) {
+    m_slots[i].sequence.store(i, std::memory_order_relaxed);
+  }
+  m_mask = capacity - 1;
+  m_enqueuePos = 0;
+  m_dequeuePos = 0;
+  m_recorded = 0;
+  m_dropped = 0;
+
+  capture_file_header_t header = {};
+  memcpy(header.magic, CAPTURE_MAGIC, sizeof(header.magic));
+  header.startTimeNs = clock_ns(CLOCK_REALTIME);
+  fwrite(&header, sizeof(header), 1, m_file);
+  m_startNs = clock_ns(CLOCK_MONOTONIC);
+
+  m_stopWriter = false;
+  m_writer = new std::thread(&traffic_capture::writerTask, this);
+  m_active = true;
+  return true;
+}
+
+void traffic_capture::stop() {
+  if (m_writer == nullptr) {
+    return;
+  }
+  m_active = false;
+  // let producers that saw the capture active finish their copy
+  while (m_inFlight.load() > 0) {
+    std::this_thread::yield();
+  }
+  m_stopWriter = true;
+  m_writer->join();
+  delete m_writer;
+  m_writer = nullptr;
+  fclose(m_file);
+  m_file = nullptr;
+  m_slots.reset();
+}
+
+void traffic_capture::record(uint32_t connectionId, uint32_t ip,
+			     const char *msg, size_t size) {
+  m_inFlight++;
+  if (m_active) {
+    capture_record_header_t header = {};
+    header.timestampNs = clock_ns(CLOCK_MONOTONIC) - m_startNs;
+    header.connectionId = connectionId;
+    header.ip = ip;
+    if (enqueue(header, msg, size)) {
+      m_recorded++;
+    } else {
+      m_dropped++;
+    }
+  }
+  m_inFlight--;
+}
+
+/// Claim the slots of all records of a message at once, so that a full ring
+/// drops a whole message instead of a chunk in its middle. The consumer
+/// frees slots in order, so if the last claimed slot is free all are.
+bool traffic_capture::enqueue(const capture_record_header_t &header,
+			      const char *payload, size_t size) {
+  size_t count = std::max<size_t>(
+      1, (size + CAPTURE_SLOT_PAYLOAD - 1) / CAPTURE_SLOT_PAYLOAD);
+  if (count > m_mask + 1) {
+    return false;
+  }
+  size_t pos = m_enqueuePos.load(std::memory_order_relaxed);
+  for (;;) {
+    size_t last = pos + count - 1;
+    size_t sequence = m_slots[last & m_mask].sequence.load(std::memory_order_acquire);
+    intptr_t diff = intptr_t(sequence) - intptr_t(last);
+    if (diff == 0) {
+      if (m_enqueuePos.compare_exchange_weak(pos, pos + count,
+					     std::memory_order_relaxed)) {
+	break;
+      }
+    } else if (diff < 0) {  // ring is full
+      return false;
+    } else {
+      pos = m_enqueuePos.load(std::memory_order_relaxed);
+    }
+  }
+  for (size_t i = 0; i < count; i++) {
+    slot_t *slot = &m_slots[(pos + i) & m_mask];
+    slot->header = header;
+    slot->header.size = std::min<size_t>(size, CAPTURE_SLOT_PAYLOAD);
+    memcpy(slot->payload, payload, slot->header.size);
+    payload += slot->header.size;
+    size -= slot->header.size;
+    slot->sequence.store(pos + i + 1, std::memory_order_release);
+  }
+  return true;
+}
+
+bool traffic_capture::dequeueAndWrite() {
+  slot_t *slot = &m_slots[m_dequeuePos & m_mask];
+  if (slot->sequence.load(std::memory_order_acquire) != m_dequeuePos + 1) {
+    return false;
+  }
+  fwrite(&slot->header, sizeof(slot->header), 1, m_file);
+  fwrite(slot->payload, 1, slot->header.size, m_file);
+  slot->sequence.store(m_dequeuePos + m_mask + 1, std::memory_order_release);
+  m_dequeuePos++;
+  return true;
+}
+
+void traffic_capture::writerTask() {
+  for (;;) {
+    bool stopping = m_stopWriter;
+    bool wrote = false;
+    while (dequeueAndWrite()) {
+      wrote = true;
+    }
+    if (stopping) {
+      break;
+    }
+    if (!wrote) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  }
+  fflush(m_file);
+}
+
+capture_reader::~capture_reader() {
+  if (m_file != nullptr) {
+    fclose(m_file);
+  }
+}
+
+bool capture_reader::open(const std::string &path) {
+  if (m_file != nullptr) {  // done with the previous file
+    fclose(m_file);
+    m_header = {};
+  }
+  m_file = fopen(path.c_str(), "rb");
+  if (m_file == nullptr) {
+    return false;
+  }
+  if (fread(&m_header, sizeof(m_header), 1, m_file) != 1 ||
+      memcmp(m_header.magic, CAPTURE_MAGIC, sizeof(m_header.magic)) != 0) {
+    fclose(m_file);
+    m_file = nullptr;
+    return false;
+  }
+  return true;
+}
+
+bool capture_reader::next(capture_record_header_t &header,
+			  std::string &payload) {
+  if (m_file == nullptr || fread(&header, sizeof(header), 1, m_file) != 1) {
+    return false;
+  }
+  payload.resize(header.size);
+  return fread(&payload[0], 1, header.size, m_file) == header.size;
+}
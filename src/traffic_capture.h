@@ -0,0 +1,110 @@
+#pragma once
+
+/// MIT License
+/// Copyright (c) 2020
+///
+/// Description:
+/// This file contains capture of received traffic into a compact binary
+/// file and a reader for such files.
+///
+/// File layout: capture_file_header_t followed by records, each record is a
+/// capture_record_header_t followed by `size` payload bytes. Integers are
+/// stored in host byte order.
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <thread>
+
+#define CAPTURE_MAGIC "EZCAP001"
+#define CAPTURE_SLOT_PAYLOAD 4096
+
+struct capture_file_header_t {
+  char magic[8];
+  /// CLOCK_REALTIME of the capture start
+  uint64_t startTimeNs;
+};
+
+struct capture_record_header_t {
+  /// Time since the capture start
+  uint64_t timestampNs;
+  uint32_t connectionId;
+  /// IPv4 address of the peer in network byte order
+  uint32_t ip;
+  uint32_t size;
+  uint32_t reserved;
+};
+
+/// Appends received messages to a capture file. record() only copies the
+/// message into a bounded lock-free ring and never blocks; a background
+/// thread writes the ring to disk. Messages that don't fit into the ring
+/// are dropped and counted, messages larger than CAPTURE_SLOT_PAYLOAD are
+/// split into several records and recorded or dropped as a whole.
+class traffic_capture {
+ public:
+  traffic_capture() = default;
+  ~traffic_capture();
+
+  traffic_capture(traffic_capture const &) = delete;
+  traffic_capture &operator=(traffic_capture const &) = delete;
+
+  /// `slots` is rounded up to a power of two. Return false if the file can't
+  /// be created or a capture is already running.
+  bool start(const std::string &path, size_t slots = 4096);
+  /// Write everything recorded so far and close the file.
+  void stop();
+  bool isActive() const noexcept { return m_active; }
+
+  void record(uint32_t connectionId, uint32_t ip, const char *msg, size_t size);
+
+  /// Messages, not records: a split message counts once.
+  uint64_t recordedCount() const noexcept { return m_recorded; }
+  uint64_t droppedCount() const noexcept { return m_dropped; }
+
+ private:
+  struct slot_t {
+    std::atomic<size_t> sequence;
+    capture_record_header_t header;
+    char payload[CAPTURE_SLOT_PAYLOAD];
+  };
+
+  bool enqueue(const capture_record_header_t &header, const char *payload,
+	       size_t size);
+  bool dequeueAndWrite();
+  void writerTask();
+
+  std::unique_ptr<slot_t[]> m_slots;
+  size_t m_mask = 0;
+  alignas(64) std::atomic<size_t> m_enqueuePos{0};
+  alignas(64) size_t m_dequeuePos = 0;
+  alignas(64) std::atomic<bool> m_active{false};
+  std::atomic<int> m_inFlight{0};
+  std::atomic<bool> m_stopWriter{false};
+  std::atomic<uint64_t> m_recorded{0};
+  std::atomic<uint64_t> m_dropped{0};
+  uint64_t m_startNs = 0;
+  FILE *m_file = nullptr;
+  std::thread *m_writer = nullptr;
+};
+
+/// Sequential reader of capture files.
+class capture_reader {
+ public:
+  capture_reader() = default;
+  ~capture_reader();
+
+  capture_reader(capture_reader const &) = delete;
+  capture_reader &operator=(capture_reader const &) = delete;
+
+  /// Closes the file opened before, if any.
+  bool open(const std::string &path);
+  const capture_file_header_t &fileHeader() const noexcept { return m_header; }
+  /// Return false at the end of file or on a truncated record.
+  bool next(capture_record_header_t &header, std::string &payload);
+
+ private:
+  FILE *m_file = nullptr;
+  capture_file_header_t m_header = {};
+};
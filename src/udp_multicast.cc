@@ -0,0 +1,577 @@
+/// MIT License
+/// Copyright (c) 2020
+///
+/// Description:
+/// This file contains implementation of UDP multicast sender and receiver
+/// and of the sequenced feed.
+
+#include "udp_multicast.h"
+
+#include <endian.h>
+
+#include <charconv>
+
+namespace {
+bool parse_ipv4(const std::string &address, struct in_addr &addr) {
+  if (address.empty()) {
+    addr.s_addr = htonl(INADDR_ANY);
+    return true;
+  }
+  return inet_aton(address.c_str(), &addr) != 0;
+}
+
+bool parse_sequence(std::string_view text, uint64_t &sequence) {
+  const char *end = text.data() + text.size();
+  auto result = std::from_chars(text.data(), end, sequence);
+  return result.ec == std::errc() && result.ptr == end;
+}
+
+/// Parse a "<from> <to>" retransmit request
+bool parse_range(std::string_view line, uint64_t &from, uint64_t &to) {
+  auto bounds = split_view(line, ' ');
+  return bounds.size() == 2 && parse_sequence(bounds[0], from) &&
+	 parse_sequence(bounds[1], to) && from <= to;
+}
+}  // namespace
+
+UdpMulticastSender::~UdpMulticastSender() { finish(); }
+
+pipe_ret_t UdpMulticastSender::open(const std::string &group, int port,
+				    const std::string &interfaceIp, int ttl,
+				    bool loopback) {
+  pipe_ret_t ret;
+  memset(&m_group, 0, sizeof(m_group));
+  m_group.sin_family = AF_INET;
+  m_group.sin_port = htons(port);
+  struct in_addr interfaceAddr;
+  if (!inet_aton(group.c_str(), &m_group.sin_addr) ||
+      !parse_ipv4(interfaceIp, interfaceAddr)) {
+    return pipe_ret_t::error(error_category_t::INVALID_ADDRESS);
+  }
+
+  m_sockfd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if (m_sockfd == -1) {  // socket failed
+    return pipe_ret_t::systemError(errno);
+  }
+  unsigned char ttlValue = ttl;
+  unsigned char loopValue = loopback ? 1 : 0;
+  if (setsockopt(m_sockfd, IPPROTO_IP, IP_MULTICAST_IF, &interfaceAddr,
+		 sizeof(interfaceAddr)) == -1 ||
+      setsockopt(m_sockfd, IPPROTO_IP, IP_MULTICAST_TTL, &ttlValue,
+		 sizeof(ttlValue)) == -1 ||
+      setsockopt(m_sockfd, IPPROTO_IP, IP_MULTICAST_LOOP, &loopValue,
+		 sizeof(loopValue)) == -1) {
+    ret = pipe_ret_t::systemError(errno);
+    finish();
+    return ret;
+  }
+  return pipe_ret_t::ok();
+}
+
+pipe_ret_t UdpMulticastSender::sendMsg(const char *msg, size_t size) {
+  ssize_t numBytesSent = sendto(m_sockfd, msg, size, 0,
+				(struct sockaddr *)&m_group, sizeof(m_group));
+  if (numBytesSent < 0) {  // send failed
+    return pipe_ret_t::systemError(errno);
+  }
+  return pipe_ret_t::ok();
+}
+
+pipe_ret_t UdpMulticastSender::finish() {
+  if (m_sockfd == -1) {
+    return pipe_ret_t::ok();
+  }
+  int closeRet = close(m_sockfd);
+  m_sockfd = -1;
+  return closeRet == -1 ? pipe_ret_t::systemError(errno) : pipe_ret_t::ok();
+}
+
+UdpMulticastReceiver::~UdpMulticastReceiver() { finish(); }
+
+pipe_ret_t UdpMulticastReceiver::start(int port) {
+  m_sockfd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if (m_sockfd == -1) {  // socket failed
+    return pipe_ret_t::systemError(errno);
+  }
+  /// several receivers on one host may listen to the same group and port
+  int option = 1;
+  setsockopt(m_sockfd, SOL_SOCKET, SO_REUSEADDR, &option, sizeof(option));
+  /// wake up regularly to notice finish()
+  struct timeval tv = {0, 100000};
+  setsockopt(m_sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+  struct sockaddr_in address;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_ANY);
+  address.sin_port = htons(port);
+  if (bind(m_sockfd, (struct sockaddr *)&address, sizeof(address)) == -1) {
+    pipe_ret_t ret = pipe_ret_t::systemError(errno);
+    finish();
+    return ret;
+  }
+  m_stop = false;
+  m_receiveTask = new std::thread(&UdpMulticastReceiver::receiveTask, this);
+  return pipe_ret_t::ok();
+}
+
+pipe_ret_t UdpMulticastReceiver::changeMembership(
+    int option, const std::string &group, const std::string &interfaceIp) {
+  struct ip_mreq request;
+  if (!inet_aton(group.c_str(), &request.imr_multiaddr) ||
+      !parse_ipv4(interfaceIp, request.imr_interface)) {
+    return pipe_ret_t::error(error_category_t::INVALID_ADDRESS);
+  }
+  if (setsockopt(m_sockfd, IPPROTO_IP, option, &request, sizeof(request)) ==
+      -1) {
+    return pipe_ret_t::systemError(errno);
+  }
+  return pipe_ret_t::ok();
+}
+
+pipe_ret_t UdpMulticastReceiver::joinGroup(const std::string &group,
+					   const std::string &interfaceIp) {
+  return changeMembership(IP_ADD_MEMBERSHIP, group, interfaceIp);
+}
+
+pipe_ret_t UdpMulticastReceiver::leaveGroup(const std::string &group,
+					    const std::string &interfaceIp) {
+  return changeMembership(IP_DROP_MEMBERSHIP, group, interfaceIp);
+}
+
+void UdpMulticastReceiver::subscribe(const client_observer_t &observer) {
+  m_subscibers.push_back(observer);
+}
+
+void UdpMulticastReceiver::unsubscribeAll() { m_subscibers.clear(); }
+
+/*
+ * Receive datagrams in batches and publish them one by one
+ */
+void UdpMulticastReceiver::receiveTask() {
+  std::vector<char> buffer(MULTICAST_BATCH_SIZE * MULTICAST_MAX_DATAGRAM);
+  struct iovec iovs[MULTICAST_BATCH_SIZE];
+  struct mmsghdr msgs[MULTICAST_BATCH_SIZE];
+  while (!m_stop) {
+    for (int i = 0; i < MULTICAST_BATCH_SIZE; i++) {
+      iovs[i].iov_base = &buffer[i * MULTICAST_MAX_DATAGRAM];
+      iovs[i].iov_len = MULTICAST_MAX_DATAGRAM;
+      memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+      msgs[i].msg_hdr.msg_iov = &iovs[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    int received =
+	recvmmsg(m_sockfd, msgs, MULTICAST_BATCH_SIZE, MSG_WAITFORONE, nullptr);
+    if (received < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+	continue;
+      }
+      break;
+    }
+    for (int i = 0; i < received; i++) {
+      if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {  // larger than a slot
+	continue;
+      }
+      for (uint j = 0; j < m_subscibers.size(); j++) {
+	if (m_subscibers[j].incoming_packet_func != nullptr) {
+	  m_subscibers[j].incoming_packet_func(
+	      static_cast<const char *>(iovs[i].iov_base), msgs[i].msg_len);
+	}
+      }
+    }
+  }
+}
+
+pipe_ret_t UdpMulticastReceiver::finish() {
+  m_stop = true;
+  if (m_receiveTask != nullptr) {
+    m_receiveTask->join();
+    delete m_receiveTask;
+    m_receiveTask = nullptr;
+  }
+  if (m_sockfd == -1) {
+    return pipe_ret_t::ok();
+  }
+  int closeRet = close(m_sockfd);
+  m_sockfd = -1;
+  return closeRet == -1 ? pipe_ret_t::systemError(errno) : pipe_ret_t::ok();
+}
+
+SequencedFeedPublisher::SequencedFeedPublisher(size_t historySize)
+    : m_historySize{historySize} {}
+
+SequencedFeedPublisher::~SequencedFeedPublisher() { finish(); }
+
+pipe_ret_t SequencedFeedPublisher::open(const std::string &group, int port,
+					const std::string &interfaceIp, int ttl,
+					bool loopback) {
+  return m_sender.open(group, port, interfaceIp, ttl, loopback);
+}
+
+pipe_ret_t SequencedFeedPublisher::startRetransmitServer(int port) {
+  pipe_ret_t ret = m_retransmitServer.start(port);
+  if (!ret.success) {
+    return ret;
+  }
+  server_observer_t observer;
+  observer.incoming_packet_func = [this](const Client &client, const char *msg,
+					 size_t size) {
+    onRetransmitRequest(client, msg, size);
+  };
+  observer.disconnected_func = [this](const Client &client) {
+    std::lock_guard<std::mutex> lock(m_mtx);
+    m_requestFramers.erase(client.getFileDescriptor());
+  };
+  m_retransmitServer.subscribe(observer);
+  m_stop = false;
+  m_acceptTask = new std::thread([this] {
+    while (!m_stop) {
+      m_retransmitServer.acceptClient(1);
+    }
+  });
+  return ret;
+}
+
+void SequencedFeedPublisher::setSnapshotProvider(
+    std::function<std::string(uint64_t &sequence)> provider) {
+  std::lock_guard<std::mutex> lock(m_mtx);
+  m_snapshotProvider = provider;
+}
+
+pipe_ret_t SequencedFeedPublisher::publish(const char *msg, size_t size) {
+  std::lock_guard<std::mutex> lock(m_mtx);
+  feed_header_t header;
+  header.sequence = htobe64(++m_sequence);
+  m_datagram.assign(reinterpret_cast<const char *>(&header), sizeof(header));
+  m_datagram.append(msg, size);
+  m_history.emplace_back(msg, size);
+  if (m_history.size() > m_historySize) {
+    m_history.pop_front();
+  }
+  return m_sender.sendMsg(m_datagram.data(), m_datagram.size());
+}
+
+uint64_t SequencedFeedPublisher::lastSequence() {
+  std::lock_guard<std::mutex> lock(m_mtx);
+  return m_sequence;
+}
+
+/*
+ * Requests are "<from> <to>\n" lines, possibly split over several reads.
+ * Malformed lines and lines too long for a request are skipped
+ */
+void SequencedFeedPublisher::onRetransmitRequest(const Client &client,
+						 const char *msg, size_t size) {
+  std::vector<std::pair<uint64_t, uint64_t>> ranges;
+  {
+    std::lock_guard<std::mutex> lock(m_mtx);
+    auto it = m_requestFramers.find(client.getFileDescriptor());
+    if (it == m_requestFramers.end()) {
+      it = m_requestFramers
+	       .emplace(client.getFileDescriptor(),
+			delimiter_framer<char>('\n', RETRANSMIT_MAX_REQUEST))
+	       .first;
+    }
+    it->second.feed(msg, size, [&ranges](std::string_view line) {
+      uint64_t from, to;
+      if (parse_range(line, from, to)) {
+	ranges.emplace_back(from, to);
+      }
+    });
+  }
+  for (auto &range : ranges) {
+    retransmit(client, range.first, range.second);
+  }
+}
+
+void SequencedFeedPublisher::retransmit(const Client &client, uint64_t from,
+					uint64_t to) {
+  std::string reply;
+  auto appendFrame = [&reply](uint64_t sequence, uint8_t type,
+			      const std::string &payload) {
+    retransmit_header_t header = {};
+    header.sequence = htobe64(sequence);
+    header.size = htobe32(payload.size());
+    header.type = type;
+    reply.append(reinterpret_cast<const char *>(&header), sizeof(header));
+    reply.append(payload);
+  };
+  {
+    std::lock_guard<std::mutex> lock(m_mtx);
+    uint64_t first = m_sequence - m_history.size() + 1;
+    if (from < first && m_snapshotProvider) {
+      uint64_t snapshotSequence = 0;
+      std::string snapshot = m_snapshotProvider(snapshotSequence);
+      appendFrame(snapshotSequence, RETRANSMIT_SNAPSHOT, snapshot);
+      from = snapshotSequence + 1;
+    }
+    if (from < first && from <= to) {  // neither retained nor in the snapshot
+      appendFrame(std::min(to, first - 1), RETRANSMIT_LOST, std::string());
+    }
+    from = std::max(from, first);
+    to = std::min(to, m_sequence);
+    for (uint64_t sequence = from; sequence <= to; sequence++) {
+      appendFrame(sequence, RETRANSMIT_MESSAGE, m_history[sequence - first]);
+    }
+  }
+  if (!reply.empty()) {
+    m_retransmitServer.sendToClient(client, reply.data(), reply.size());
+  }
+}
+
+pipe_ret_t SequencedFeedPublisher::finish() {
+  m_stop = true;
+  if (m_acceptTask != nullptr) {
+    m_acceptTask->join();
+    delete m_acceptTask;
+    m_acceptTask = nullptr;
+    m_retransmitServer.finish();
+  }
+  return m_sender.finish();
+}
+
+void feed_sequencer::push(uint64_t sequence, const char *msg, size_t size) {
+  if (m_next == 0) {  // first message sets the starting point
+    m_next = sequence;
+    m_highestSeen = sequence - 1;
+  }
+  if (sequence < m_next) {  // duplicate
+    return;
+  }
+  if (sequence > m_highestSeen + 1 && m_onGap) {
+    m_onGap(std::max(m_next, m_highestSeen + 1), sequence - 1);
+  }
+  m_highestSeen = std::max(m_highestSeen, sequence);
+  if (sequence == m_next) {
+    if (m_onMessage) {
+      m_onMessage(sequence, msg, size);
+    }
+    m_next++;
+    deliverPending();
+  } else if (m_pending.size() < m_maxPending) {
+    m_pending.emplace(sequence, std::string(msg, size));
+  } else if (m_pending.count(sequence) == 0 && m_onGap) {
+    // no room to hold it back, have it sent again once the gap is filled
+    m_onGap(sequence, sequence);
+  }
+}
+
+void feed_sequencer::skipTo(uint64_t sequence) {
+  if (sequence < m_next) {
+    return;
+  }
+  m_next = sequence + 1;
+  m_highestSeen = std::max(m_highestSeen, sequence);
+  m_pending.erase(m_pending.begin(), m_pending.upper_bound(sequence));
+  deliverPending();
+}
+
+void feed_sequencer::missingRanges(
+    std::vector<std::pair<uint64_t, uint64_t>> &ranges) const {
+  ranges.clear();
+  if (!hasGap()) {
+    return;
+  }
+  uint64_t from = m_next;
+  for (auto &held : m_pending) {  // all of them are past m_next
+    if (held.first > from) {
+      ranges.emplace_back(from, held.first - 1);
+    }
+    from = held.first + 1;
+  }
+  if (from <= m_highestSeen) {
+    ranges.emplace_back(from, m_highestSeen);
+  }
+}
+
+void feed_sequencer::deliverPending() {
+  auto it = m_pending.begin();
+  while (it != m_pending.end() && it->first == m_next) {
+    if (m_onMessage) {
+      m_onMessage(it->first, it->second.data(), it->second.size());
+    }
+    m_next++;
+    it = m_pending.erase(it);
+  }
+}
+
+SequencedFeedReceiver::SequencedFeedReceiver() {
+  m_sequencer.setGapHandler([this](uint64_t from, uint64_t to) {
+    if (m_onGap) {
+      m_onGap(from, to);
+    }
+    requestRetransmit(from, to);
+  });
+}
+
+pipe_ret_t SequencedFeedReceiver::start(const std::string &group, int port,
+					const std::string &interfaceIp) {
+  client_observer_t observer;
+  observer.incoming_packet_func = [this](const char *msg, size_t size) {
+    onDatagram(msg, size);
+  };
+  m_receiver.subscribe(observer);
+  pipe_ret_t ret = m_receiver.start(port);
+  if (!ret.success) {
+    return ret;
+  }
+  return m_receiver.joinGroup(group, interfaceIp);
+}
+
+pipe_ret_t SequencedFeedReceiver::connectRetransmit(const std::string &address,
+						    int port) {
+  client_observer_t observer;
+  observer.incoming_packet_func = [this](const char *msg, size_t size) {
+    onRetransmitData(msg, size);
+  };
+  m_retransmitClient.subscribe(observer);
+  pipe_ret_t ret = m_retransmitClient.connectTo(address, port);
+  {
+    std::lock_guard<std::mutex> lock(m_mtx);
+    m_retransmitConnected = ret.success;
+    if (ret.success) {  // gaps found before were not requested
+      requestMissing();
+    }
+  }
+  sendRequests();
+  return ret;
+}
+
+void SequencedFeedReceiver::setMessageHandler(
+    feed_sequencer::message_func_t handler) {
+  std::lock_guard<std::mutex> lock(m_mtx);
+  m_sequencer.setMessageHandler(handler);
+}
+
+void SequencedFeedReceiver::setGapHandler(feed_sequencer::gap_func_t handler) {
+  std::lock_guard<std::mutex> lock(m_mtx);
+  m_onGap = handler;
+}
+
+void SequencedFeedReceiver::setLossHandler(
+    feed_sequencer::gap_func_t handler) {
+  std::lock_guard<std::mutex> lock(m_mtx);
+  m_onLoss = handler;
+}
+
+void SequencedFeedReceiver::setRetryInterval(
+    std::chrono::milliseconds interval) {
+  std::lock_guard<std::mutex> lock(m_mtx);
+  m_retryInterval = interval;
+}
+
+void SequencedFeedReceiver::setSnapshotHandler(
+    std::function<void(uint64_t sequence, const char *msg, size_t size)>
+	handler) {
+  std::lock_guard<std::mutex> lock(m_mtx);
+  m_onSnapshot = handler;
+}
+
+void SequencedFeedReceiver::onDatagram(const char *msg, size_t size) {
+  feed_header_t header;
+  if (size < sizeof(header)) {
+    return;
+  }
+  memcpy(&header, msg, sizeof(header));
+  {
+    std::lock_guard<std::mutex> lock(m_mtx);
+    m_sequencer.push(be64toh(header.sequence), msg + sizeof(header),
+		     size - sizeof(header));
+    retryIfStalled();
+  }
+  sendRequests();
+}
+
+void SequencedFeedReceiver::onRetransmitData(const char *msg, size_t size) {
+  std::unique_lock<std::mutex> lock(m_mtx);
+  m_retransmitBuffer.append(msg, size);
+  size_t pos = 0;
+  retransmit_header_t header;
+  while (m_retransmitBuffer.size() - pos >= sizeof(header)) {
+    memcpy(&header, m_retransmitBuffer.data() + pos, sizeof(header));
+    size_t payloadSize = be32toh(header.size);
+    if (m_retransmitBuffer.size() - pos - sizeof(header) < payloadSize) {
+      break;
+    }
+    const char *payload = m_retransmitBuffer.data() + pos + sizeof(header);
+    uint64_t sequence = be64toh(header.sequence);
+    if (header.type == RETRANSMIT_SNAPSHOT) {
+      if (m_onSnapshot) {
+	m_onSnapshot(sequence, payload, payloadSize);
+      }
+      m_sequencer.skipTo(sequence);
+    } else if (header.type == RETRANSMIT_LOST) {
+      if (sequence >= m_sequencer.nextExpected()) {
+	if (m_onLoss) {
+	  m_onLoss(m_sequencer.nextExpected(), sequence);
+	}
+	m_sequencer.skipTo(sequence);
+      }
+    } else {
+      m_sequencer.push(sequence, payload, payloadSize);
+    }
+    pos += sizeof(header) + payloadSize;
+  }
+  m_retransmitBuffer.erase(0, pos);
+  retryIfStalled();
+  lock.unlock();
+  sendRequests();
+}
+
+/*
+ * Called by the sequencer with m_mtx held. The request is only queued:
+ * sending may block, and the retransmit reply is handled under m_mtx too
+ */
+void SequencedFeedReceiver::requestRetransmit(uint64_t from, uint64_t to) {
+  if (!m_retransmitConnected) {
+    return;
+  }
+  m_requests += std::to_string(from) + " " + std::to_string(to) + "\n";
+  m_lastRequest = std::chrono::steady_clock::now();
+}
+
+/*
+ * Request every range still missing, with m_mtx held
+ */
+void SequencedFeedReceiver::requestMissing() {
+  std::vector<std::pair<uint64_t, uint64_t>> ranges;
+  m_sequencer.missingRanges(ranges);
+  for (auto &range : ranges) {
+    requestRetransmit(range.first, range.second);
+  }
+}
+
+/*
+ * Called with m_mtx held. A lost request or reply would otherwise stall
+ * delivery for good, the sequencer reports each gap only once
+ */
+void SequencedFeedReceiver::retryIfStalled() {
+  if (!m_retransmitConnected || !m_sequencer.hasGap() ||
+      std::chrono::steady_clock::now() - m_lastRequest < m_retryInterval) {
+    return;
+  }
+  requestMissing();
+}
+
+/*
+ * Send the requests queued so far, must be called without m_mtx held
+ */
+void SequencedFeedReceiver::sendRequests() {
+  std::string requests;
+  {
+    std::lock_guard<std::mutex> lock(m_mtx);
+    requests.swap(m_requests);
+  }
+  if (!requests.empty()) {
+    m_retransmitClient.sendMsg(requests.data(), requests.size());
+  }
+}
+
+pipe_ret_t SequencedFeedReceiver::finish() {
+  pipe_ret_t ret = m_receiver.finish();
+  if (m_retransmitConnected) {
+    m_retransmitConnected = false;
+    m_retransmitClient.finish();
+  }
+  return ret;
+}
@@ -0,0 +1,211 @@
+#pragma once
+
+/// MIT License
+/// Copyright (c) 2020
+///
+/// Description:
+/// This file contains UDP multicast sender and receiver, and a sequenced
+/// feed on top of them: every datagram carries a sequence number, receivers
+/// detect gaps and recover missed messages over a TCP retransmit channel
+/// served by TcpServer.
+
+#include <chrono>
+#include <deque>
+#include <map>
+
+#include "tcp_udp_srv_cli.h"
+
+#define MULTICAST_BATCH_SIZE 32
+#define MULTICAST_MAX_DATAGRAM 9000
+/// Longest retransmit request line, two 20 digit sequence numbers
+#define RETRANSMIT_MAX_REQUEST 64
+/// How often ranges of a gap that stays open are requested again
+#define RETRANSMIT_RETRY_MS 1000
+
+class UdpMulticastSender {
+ private:
+  int m_sockfd = -1;
+  struct sockaddr_in m_group;
+
+ public:
+  ~UdpMulticastSender();
+  /// interfaceIp selects the outgoing interface (empty for the default
+  /// route), ttl limits how many routers datagrams cross and loopback
+  /// delivers them to receivers on this host as well.
+  pipe_ret_t open(const std::string &group, int port,
+		  const std::string &interfaceIp = "", int ttl = 1,
+		  bool loopback = true);
+  pipe_ret_t sendMsg(const char *msg, size_t size);
+  pipe_ret_t finish();
+};
+
+class UdpMulticastReceiver {
+ private:
+  int m_sockfd = -1;
+  std::atomic<bool> m_stop{false};
+  std::vector<client_observer_t> m_subscibers;
+  std::thread *m_receiveTask = nullptr;
+
+  void receiveTask();
+  pipe_ret_t changeMembership(int option, const std::string &group,
+			      const std::string &interfaceIp);
+
+ public:
+  ~UdpMulticastReceiver();
+  /// Bind port and start receiving. Datagrams are read in batches of up to
+  /// MULTICAST_BATCH_SIZE with one recvmmsg call; each datagram is published
+  /// to observers separately.
+  pipe_ret_t start(int port);
+  pipe_ret_t joinGroup(const std::string &group,
+		       const std::string &interfaceIp = "");
+  pipe_ret_t leaveGroup(const std::string &group,
+			const std::string &interfaceIp = "");
+  void subscribe(const client_observer_t &observer);
+  void unsubscribeAll();
+  pipe_ret_t finish();
+};
+
+/// Header in front of every sequenced feed datagram, big endian.
+struct feed_header_t {
+  uint64_t sequence;
+};
+
+/// Header in front of every message sent over the retransmit channel,
+/// big endian.
+struct retransmit_header_t {
+  uint64_t sequence;
+  uint32_t size;
+  uint8_t type;
+  uint8_t reserved[3];
+};
+
+/// A RETRANSMIT_LOST frame has no payload, its sequence is the last one of
+/// a requested range the publisher can no longer send.
+enum retransmit_type_t : uint8_t {
+  RETRANSMIT_MESSAGE = 0,
+  RETRANSMIT_SNAPSHOT = 1,
+  RETRANSMIT_LOST = 2
+};
+
+/// Publishes messages with consecutive sequence numbers (starting at 1) and
+/// keeps the last `historySize` of them for retransmission. Receivers ask
+/// for a range by sending "<from> <to>\n" to the retransmit port. Ranges
+/// older than the history are answered with a snapshot from the snapshot
+/// provider, if there is one, followed by the retained messages. Whatever
+/// neither covers is answered with a RETRANSMIT_LOST frame.
+class SequencedFeedPublisher {
+ private:
+  UdpMulticastSender m_sender;
+  TcpServer m_retransmitServer;
+  std::thread *m_acceptTask = nullptr;
+  std::atomic<bool> m_stop{false};
+  std::mutex m_mtx;
+  uint64_t m_sequence = 0;
+  size_t m_historySize;
+  std::deque<std::string> m_history;
+  std::function<std::string(uint64_t &sequence)> m_snapshotProvider;
+  std::string m_datagram;
+  std::map<int, delimiter_framer<char>> m_requestFramers;
+
+  void onRetransmitRequest(const Client &client, const char *msg, size_t size);
+  void retransmit(const Client &client, uint64_t from, uint64_t to);
+
+ public:
+  explicit SequencedFeedPublisher(size_t historySize = 65536);
+  ~SequencedFeedPublisher();
+
+  pipe_ret_t open(const std::string &group, int port,
+		  const std::string &interfaceIp = "", int ttl = 1,
+		  bool loopback = true);
+  pipe_ret_t startRetransmitServer(int port);
+  /// provider returns the current state and sets sequence to the last
+  /// sequence number the state includes.
+  void setSnapshotProvider(
+      std::function<std::string(uint64_t &sequence)> provider);
+  pipe_ret_t publish(const char *msg, size_t size);
+  uint64_t lastSequence();
+  pipe_ret_t finish();
+};
+
+/// Orders a sequenced feed: delivers messages in sequence order, holds back
+/// messages that arrive after a gap until the gap is filled and reports each
+/// new gap once. A message that arrives while maxPending messages are held
+/// back is dropped and reported as a gap of its own. The first message
+/// received sets the starting point.
+class feed_sequencer {
+ public:
+  typedef std::function<void(uint64_t sequence, const char *msg, size_t size)>
+      message_func_t;
+  typedef std::function<void(uint64_t from, uint64_t to)> gap_func_t;
+
+  explicit feed_sequencer(size_t maxPending = 65536)
+      : m_maxPending{maxPending} {}
+
+  void setMessageHandler(message_func_t handler) { m_onMessage = handler; }
+  void setGapHandler(gap_func_t handler) { m_onGap = handler; }
+
+  void push(uint64_t sequence, const char *msg, size_t size);
+  /// State up to and including sequence was applied from a snapshot.
+  void skipTo(uint64_t sequence);
+  uint64_t nextExpected() const noexcept { return m_next; }
+  size_t pendingCount() const noexcept { return m_pending.size(); }
+  /// Whether sequences below the highest one seen are still missing.
+  bool hasGap() const noexcept { return m_next != 0 && m_next <= m_highestSeen; }
+  /// Fill ranges with the missing sequences, in order.
+  void missingRanges(std::vector<std::pair<uint64_t, uint64_t>> &ranges) const;
+
+ private:
+  void deliverPending();
+
+  size_t m_maxPending;
+  uint64_t m_next = 0;
+  uint64_t m_highestSeen = 0;
+  std::map<uint64_t, std::string> m_pending;
+  message_func_t m_onMessage;
+  gap_func_t m_onGap;
+};
+
+/// Receives a sequenced feed, requests missed ranges over the retransmit
+/// channel and delivers messages in order to the message handler. Ranges
+/// still missing are requested again when the retransmit channel connects
+/// and, while the gap stays open, with the next datagram or reply after
+/// every retry interval. Ranges the publisher no longer has are reported to
+/// the loss handler and skipped.
+class SequencedFeedReceiver {
+ private:
+  UdpMulticastReceiver m_receiver;
+  TcpClient m_retransmitClient;
+  bool m_retransmitConnected = false;
+  std::mutex m_mtx;
+  feed_sequencer m_sequencer;
+  feed_sequencer::gap_func_t m_onGap;
+  feed_sequencer::gap_func_t m_onLoss;
+  std::chrono::milliseconds m_retryInterval{RETRANSMIT_RETRY_MS};
+  std::chrono::steady_clock::time_point m_lastRequest;
+  std::function<void(uint64_t sequence, const char *msg, size_t size)>
+      m_onSnapshot;
+  std::string m_retransmitBuffer;
+  std::string m_requests;
+
+  void onDatagram(const char *msg, size_t size);
+  void onRetransmitData(const char *msg, size_t size);
+  void requestRetransmit(uint64_t from, uint64_t to);
+  void requestMissing();
+  void retryIfStalled();
+  void sendRequests();
+
+ public:
+  SequencedFeedReceiver();
+
+  pipe_ret_t start(const std::string &group, int port,
+		   const std::string &interfaceIp = "");
+  pipe_ret_t connectRetransmit(const std::string &address, int port);
+  void setMessageHandler(feed_sequencer::message_func_t handler);
+  void setGapHandler(feed_sequencer::gap_func_t handler);
+  void setLossHandler(feed_sequencer::gap_func_t handler);
+  void setRetryInterval(std::chrono::milliseconds interval);
+  void setSnapshotHandler(
+      std::function<void(uint64_t sequence, const char *msg, size_t size)>
+	  handler);
+  pipe_ret_t finish();
+};
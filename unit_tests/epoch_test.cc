@@ -0,0 +1,92 @@
+#include "../src/epoch.h"
+#include "unit_tests_common.h"
+
+#include <memory>
+#include <thread>
+
+TEST(EpochDomain, ReclaimsImmediatelyWithoutReaders) {
+    epoch_domain domain;
+    bool reclaimed = false;
+    domain.retire([&reclaimed] { reclaimed = true; });
+
+    ASSERT_TRUE(reclaimed);
+    ASSERT_EQ(0u, domain.pendingCount());
+}
+
+TEST(EpochDomain, GuardDefersReclaim) {
+    epoch_domain domain;
+    bool reclaimed = false;
+    {
+        epoch_domain::guard guard(domain);
+        domain.retire([&reclaimed] { reclaimed = true; });
+        domain.collect();
+        ASSERT_FALSE(reclaimed);
+        ASSERT_EQ(1u, domain.pendingCount());
+    }
+    domain.collect();
+    ASSERT_TRUE(reclaimed);
+}
+
+TEST(EpochDomain, LaterGuardDoesNotBlockEarlierRetire) {
+    epoch_domain domain;
+    bool reclaimed = false;
+    {
+        epoch_domain::guard early(domain);
+        domain.retire([&reclaimed] { reclaimed = true; });
+    }
+    epoch_domain::guard late(domain);
+    domain.collect();
+    domain.collect();
+    ASSERT_TRUE(reclaimed);
+}
+
+TEST(EpochDomain, DestructorRunsPendingReclaims) {
+    bool reclaimed = false;
+    {
+        epoch_domain domain;
+        epoch_domain::guard *guard = new epoch_domain::guard(domain);
+        domain.retire([&reclaimed] { reclaimed = true; });
+        delete guard;
+        ASSERT_FALSE(reclaimed);
+    }
+    ASSERT_TRUE(reclaimed);
+}
+
+TEST(EpochDomain, ReadersNeverSeeReclaimedObjects) {
+    struct node_t {
+        std::atomic<bool> alive{true};
+    };
+    epoch_domain domain;
+    std::vector<std::unique_ptr<node_t>> nodes;
+    nodes.emplace_back(new node_t);
+    std::atomic<node_t *> shared{nodes.back().get()};
+    std::atomic<bool> stop{false};
+    std::atomic<bool> sawReclaimed{false};
+
+    std::vector<std::thread> readers;
+    for (int i = 0; i < 4; i++) {
+        readers.emplace_back([&] {
+            while (!stop) {
+                epoch_domain::guard guard(domain);
+                if (!shared.load()->alive) {
+                    sawReclaimed = true;
+                }
+            }
+        });
+    }
+    for (int i = 0; i < 10000; i++) {
+        nodes.emplace_back(new node_t);
+        node_t *old = shared.exchange(nodes.back().get());
+        domain.retire([old] {
+            old->alive = false; // marks instead of freeing to detect misuse
+        });
+    }
+    stop = true;
+    for (std::thread &reader : readers) {
+        reader.join();
+    }
+    domain.synchronize();
+
+    ASSERT_FALSE(sawReclaimed);
+    ASSERT_EQ(0u, domain.pendingCount());
+}
@@ -0,0 +1,42 @@
+#include "../src/latency_histogram.h"
+#include "unit_tests_common.h"
+
+TEST(LatencyHistogram, EmptyHistogramReportsZero) {
+    latency_histogram histogram;
+    ASSERT_EQ(0u, histogram.count());
+    ASSERT_EQ(0u, histogram.percentile(0.99));
+}
+
+TEST(LatencyHistogram, SmallValuesAreExact) {
+    latency_histogram histogram;
+    for (uint64_t value = 1; value <= 10; value++) {
+        histogram.record(value);
+    }
+    ASSERT_EQ(10u, histogram.count());
+    ASSERT_EQ(5u, histogram.percentile(0.5));
+    ASSERT_EQ(10u, histogram.percentile(1));
+    ASSERT_EQ(10u, histogram.max());
+}
+
+TEST(LatencyHistogram, PercentilesWithinBucketPrecision) {
+    latency_histogram histogram;
+    for (uint64_t value = 1; value <= 100000; value++) {
+        histogram.record(value * 1000);
+    }
+    uint64_t p50 = histogram.percentile(0.5);
+    uint64_t p99 = histogram.percentile(0.99);
+    ASSERT_GE(p50, 50000000u);
+    ASSERT_LE(p50, 50000000ull * 104 / 100);
+    ASSERT_GE(p99, 99000000u);
+    ASSERT_LE(p99, 99000000ull * 104 / 100);
+    ASSERT_EQ(100000000u, histogram.percentile(1));
+}
+
+TEST(LatencyHistogram, ResetClearsValues) {
+    latency_histogram histogram;
+    histogram.record(UINT64_MAX);
+    ASSERT_EQ(UINT64_MAX, histogram.percentile(0.5));
+    histogram.reset();
+    ASSERT_EQ(0u, histogram.count());
+    ASSERT_EQ(0u, histogram.max());
+}
@@ -0,0 +1,78 @@
+#include "../src/tcp_udp_srv_cli.h"
+#include "unit_tests_common.h"
+
+TEST(MessageArena, SmallTemporariesStayInline) {
+    message_arena arena;
+    for (int i = 0; i < 3; i++) {
+        arena_string text("a string too long for the small string buffer", arena.resource());
+        arena_buffer buffer(1000, 'x', arena.resource());
+        text.append(buffer.data(), 100);
+        ASSERT_EQ(145u, text.size());
+        ASSERT_EQ(0u, arena.upstreamBytes());
+        arena.reset();
+    }
+}
+
+TEST(MessageArena, ResetReturnsUpstreamMemory) {
+    message_arena arena;
+    arena_buffer buffer(64 * 1024, 'x', arena.resource());
+    ASSERT_GE(arena.upstreamBytes(), buffer.size());
+    arena_string text(10000, 'y', arena.resource());
+    ASSERT_EQ('y', text.back());
+    buffer = arena_buffer(arena.resource());
+    text = arena_string(arena.resource());
+    arena.reset();
+    ASSERT_EQ(0u, arena.upstreamBytes());
+}
+
+TEST(MessageArena, ClientIpIsInlineAndTruncated) {
+    Client client;
+    client.setIp("192.168.100.200");
+    ASSERT_EQ("192.168.100.200", client.getIp());
+    Client copy(client);
+    ASSERT_EQ(client.getIpView(), copy.getIpView());
+    ASSERT_TRUE(copy == client);
+    client.setIp(std::string(100, '1'));
+    ASSERT_EQ(size_t(INET6_ADDRSTRLEN - 1), client.getIpView().size());
+    ASSERT_EQ(std::pmr::get_default_resource(), client.getArena());
+}
+
+TEST(MessageArena, ServerLendsArenaDuringDispatch) {
+    const int port = 19315;
+    TcpServer server;
+    std::mutex repliesMtx;
+    std::atomic<int> fromArena{0};
+    server_observer_t observer;
+    observer.incoming_packet_func = [&](const Client &client, const char *msg, size_t size) {
+        if (client.getArena() != std::pmr::get_default_resource()) {
+            fromArena++;
+        }
+        arena_string reply("got ", client.getArena());
+        reply.append(msg, size);
+        server.sendToClient(client, reply.data(), reply.size());
+    };
+    server.subscribe(observer);
+    ASSERT_TRUE(server.start(port).success);
+
+    TcpClient client;
+    client_observer_t clientObserver;
+    std::string received;
+    clientObserver.incoming_packet_func = [&](const char *msg, size_t size) {
+        std::lock_guard<std::mutex> lock(repliesMtx);
+        received.append(msg, size);
+    };
+    client.subscribe(clientObserver);
+    ASSERT_TRUE(client.connectTo("127.0.0.1", port).success);
+    ASSERT_TRUE(server.acceptClient(1).isConnected());
+    ASSERT_TRUE(client.sendMsg("ping", 4).success);
+
+    auto receivedSoFar = [&] {
+        std::lock_guard<std::mutex> lock(repliesMtx);
+        return received;
+    };
+    wait_for([&] { return receivedSoFar().size() >= 8; });
+    ASSERT_EQ("got ping", receivedSoFar());
+    ASSERT_EQ(1, fromArena.load());
+    ASSERT_TRUE(client.finish().success);
+    ASSERT_TRUE(server.finish().success);
+}
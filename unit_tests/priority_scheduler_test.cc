@@ -0,0 +1,158 @@
+#include "../src/priority_scheduler.h"
+#include "../src/tcp_udp_srv_cli.h"
+#include "unit_tests_common.h"
+
+namespace {
+priority_config_t small_chunks() {
+    priority_config_t config;
+    config.chunkSize = 1000;
+    return config;
+}
+
+struct decoded_t {
+    send_priority_t priority;
+    std::string message;
+};
+
+std::vector<decoded_t> drain(priority_scheduler &scheduler) {
+    std::string wire;
+    while (scheduler.next(wire)) {
+    }
+    std::vector<decoded_t> decoded;
+    priority_frame_decoder decoder;
+    EXPECT_TRUE(decoder.feed(wire.data(), wire.size(),
+                             [&decoded](send_priority_t priority, const char *msg, size_t size) {
+                                 decoded.push_back({priority, std::string(msg, size)});
+                             }));
+    return decoded;
+}
+}  // namespace
+
+TEST(PriorityScheduler, ControlOvertakesBulkTransfer) {
+    priority_scheduler scheduler(small_chunks());
+    std::string bulk(100000, 'b');
+    scheduler.push(send_priority_t::BULK, bulk.data(), bulk.size());
+    std::string frame;
+    ASSERT_TRUE(scheduler.next(frame));
+    scheduler.push(send_priority_t::CONTROL, "ping", 4);
+
+    // the next frame after the bulk turn is the control message
+    frame.clear();
+    ASSERT_TRUE(scheduler.next(frame));
+    priority_frame_header_t header;
+    memcpy(&header, frame.data(), sizeof(header));
+    ASSERT_EQ(uint8_t(send_priority_t::CONTROL), header.priority);
+    ASSERT_EQ(std::string("ping"), frame.substr(sizeof(header)));
+}
+
+TEST(PriorityScheduler, WeightsShareBandwidth) {
+    priority_scheduler scheduler(small_chunks()); // normal 4, bulk 1
+    std::string data(100000, 'x');
+    scheduler.push(send_priority_t::NORMAL, data.data(), data.size());
+    scheduler.push(send_priority_t::BULK, data.data(), data.size());
+
+    size_t frames[SEND_PRIORITY_CLASSES] = {};
+    for (int i = 0; i < 50; i++) {
+        std::string frame;
+        ASSERT_TRUE(scheduler.next(frame));
+        frames[uint8_t(frame[0])]++;
+    }
+    ASSERT_EQ(40u, frames[size_t(send_priority_t::NORMAL)]);
+    ASSERT_EQ(10u, frames[size_t(send_priority_t::BULK)]);
+    ASSERT_EQ(60000u, scheduler.queuedBytes(send_priority_t::NORMAL));
+}
+
+TEST(PriorityScheduler, DecoderReassemblesInterleavedMessages) {
+    priority_scheduler scheduler(small_chunks());
+    std::string large(2500, 'l');
+    scheduler.push(send_priority_t::BULK, large.data(), large.size());
+    scheduler.push(send_priority_t::NORMAL, "first", 5);
+    scheduler.push(send_priority_t::NORMAL, "", 0);
+    scheduler.push(send_priority_t::CONTROL, "stop", 4);
+
+    std::vector<decoded_t> decoded = drain(scheduler);
+    ASSERT_EQ(4u, decoded.size());
+    ASSERT_EQ(send_priority_t::CONTROL, decoded[0].priority);
+    ASSERT_EQ("stop", decoded[0].message);
+    ASSERT_EQ("first", decoded[1].message);
+    ASSERT_EQ("", decoded[2].message);
+    ASSERT_EQ(send_priority_t::BULK, decoded[3].priority);
+    ASSERT_EQ(large, decoded[3].message);
+    ASSERT_TRUE(scheduler.empty());
+}
+
+TEST(PriorityScheduler, DecoderHandlesSplitInputAndRejectsGarbage) {
+    priority_scheduler scheduler(small_chunks());
+    std::string large(1500, 'l');
+    scheduler.push(send_priority_t::NORMAL, large.data(), large.size());
+    std::string wire;
+    while (scheduler.next(wire)) {
+    }
+
+    priority_frame_decoder decoder;
+    std::vector<std::string> messages;
+    auto collect = [&messages](send_priority_t, const char *msg, size_t size) {
+        messages.emplace_back(msg, size);
+    };
+    for (char byte : wire) {
+        ASSERT_TRUE(decoder.feed(&byte, 1, collect));
+    }
+    ASSERT_EQ(std::vector<std::string>({large}), messages);
+
+    std::string garbage(sizeof(priority_frame_header_t), '\x7f');
+    ASSERT_FALSE(decoder.feed(garbage.data(), garbage.size(), collect));
+}
+
+TEST(PriorityScheduler, ControlMessageOvertakesBulkOnConnection) {
+    const int port = 19314;
+    TcpServer server;
+    priority_config_t config;
+    config.enabled = true;
+    server.setPrioritySending(config);
+    ASSERT_TRUE(server.start(port).success);
+    std::mutex serverMtx;
+    std::vector<std::string> serverReceived;
+    server_observer_t serverObserver;
+    serverObserver.incoming_packet_func = [&](const Client &, const char *msg, size_t size) {
+        std::lock_guard<std::mutex> lock(serverMtx);
+        serverReceived.emplace_back(msg, size);
+    };
+    server.subscribe(serverObserver);
+
+    // both ends decode frames before observers see the data
+    TcpClient client;
+    client.setPrioritySending(config);
+    std::mutex clientMtx;
+    std::vector<std::string> clientReceived;
+    client_observer_t clientObserver;
+    clientObserver.incoming_packet_func = [&](const char *msg, size_t size) {
+        std::lock_guard<std::mutex> lock(clientMtx);
+        clientReceived.emplace_back(msg, size);
+    };
+    client.subscribe(clientObserver);
+    ASSERT_TRUE(client.connectTo("127.0.0.1", port).success);
+    Client accepted = server.acceptClient(1);
+    ASSERT_TRUE(accepted.isConnected());
+
+    std::string bulk(8 << 20, 'b');
+    ASSERT_TRUE(server.sendToClient(accepted, bulk.data(), bulk.size(), send_priority_t::BULK).success);
+    ASSERT_TRUE(server.sendToClient(accepted, "ping", 4, send_priority_t::CONTROL).success);
+    ASSERT_TRUE(client.sendMsg("pong", 4, send_priority_t::CONTROL).success);
+
+    auto clientCount = [&] {
+        std::lock_guard<std::mutex> lock(clientMtx);
+        return clientReceived.size();
+    };
+    wait_for([&] { return clientCount() >= 2; });
+    ASSERT_EQ(2u, clientCount());
+    ASSERT_EQ("ping", clientReceived[0]);
+    ASSERT_EQ(bulk, clientReceived[1]);
+    auto serverReceivedSoFar = [&] {
+        std::lock_guard<std::mutex> lock(serverMtx);
+        return serverReceived;
+    };
+    ASSERT_TRUE(wait_for([&] { return !serverReceivedSoFar().empty(); }));
+    ASSERT_THAT(serverReceivedSoFar(), ::testing::ElementsAre("pong"));
+    ASSERT_TRUE(client.finish().success);
+    ASSERT_TRUE(server.finish().success);
+}
@@ -0,0 +1,71 @@
+#include "../src/tcp_udp_srv_cli.h"
+#include "unit_tests_common.h"
+
+TEST(ReceiveBuffer, GrowsToQueuedBytesAndShrinksWhenQuiet) {
+    receive_buffer buffer(4096, 256 * 1024);
+    ASSERT_EQ(4096u, buffer.size());
+
+    buffer.update(4096, 0); // full read, nothing known about the rest
+    ASSERT_EQ(8192u, buffer.size());
+    buffer.update(8192, 100 * 1024); // full read with 100 KB queued
+    ASSERT_EQ(128u * 1024, buffer.size());
+    buffer.update(128 * 1024, 10 << 20); // capped
+    ASSERT_EQ(256u * 1024, buffer.size());
+
+    buffer.update(100 * 1024, 0); // more than a quarter keeps the size
+    for (int i = 0; i < receive_buffer::SHRINK_AFTER_READS - 1; i++) {
+        buffer.update(100, 0);
+    }
+    ASSERT_EQ(256u * 1024, buffer.size());
+    buffer.update(100, 0);
+    ASSERT_EQ(128u * 1024, buffer.size());
+    for (int i = 0; i < 20 * receive_buffer::SHRINK_AFTER_READS; i++) {
+        buffer.update(1, 0);
+    }
+    ASSERT_EQ(4096u, buffer.size());
+}
+
+TEST(ReceiveBuffer, FixedSizeNeverChanges) {
+    receive_buffer buffer(MAX_PACKET_SIZE, MAX_PACKET_SIZE);
+    buffer.update(MAX_PACKET_SIZE, 1 << 20);
+    ASSERT_EQ(size_t(MAX_PACKET_SIZE), buffer.size());
+    for (int i = 0; i < 2 * receive_buffer::SHRINK_AFTER_READS; i++) {
+        buffer.update(1, 0);
+    }
+    ASSERT_EQ(size_t(MAX_PACKET_SIZE), buffer.size());
+}
+
+TEST(ReceiveBuffer, AdaptiveServerReadsLargeMessageInFewCalls) {
+    const int port = 19316;
+    TcpServer server;
+    receive_config_t receive;
+    receive.adaptive = true;
+    server.setReceiveConfig(receive);
+    socket_buffer_config_t socketBuffers;
+    socketBuffers.receiveBytes = 1 << 20;
+    server.setSocketBuffers(socketBuffers);
+    std::atomic<size_t> receivedBytes{0};
+    std::atomic<size_t> calls{0};
+    server_observer_t observer;
+    observer.incoming_packet_func = [&](const Client &, const char *, size_t size) {
+        receivedBytes += size;
+        calls++;
+    };
+    server.subscribe(observer);
+    ASSERT_TRUE(server.start(port).success);
+
+    TcpClient client;
+    socketBuffers.sendBytes = 1 << 20;
+    client.setSocketBuffers(socketBuffers);
+    ASSERT_TRUE(client.connectTo("127.0.0.1", port).success);
+    ASSERT_TRUE(server.acceptClient(1).isConnected());
+    std::string message(1 << 20, 'x');
+    ASSERT_TRUE(client.sendMsg(message.data(), message.size()).success);
+
+    wait_for([&] { return receivedBytes >= message.size(); });
+    ASSERT_EQ(message.size(), receivedBytes);
+    // fixed 4 KB reads would take 256 calls
+    ASSERT_LT(calls.load(), 64u);
+    ASSERT_TRUE(client.finish().success);
+    ASSERT_TRUE(server.finish().success);
+}
@@ -0,0 +1,230 @@
+#include "../src/reliable_udp.h"
+#include "unit_tests_common.h"
+
+namespace {
+std::string test_message(uint16_t stream, int index) {
+    std::string message = std::to_string(stream) + ":" + std::to_string(index) + ":";
+    if (index % 10 == 0) { // spans several datagrams
+        message.append(3000, char('a' + index % 26));
+    }
+    return message;
+}
+}  // namespace
+
+TEST(RttEstimator, FollowsSamplesAndBacksOffPerTransmission) {
+    rtt_estimator rtt(50000, 1000, 400000);
+    ASSERT_EQ(50000u, rtt.rtoUsec());
+
+    rtt.sample(10000);
+    ASSERT_EQ(10000u, rtt.srttUsec());
+    ASSERT_EQ(30000u, rtt.rtoUsec()); // srtt + 4 * rttvar, rttvar = rtt / 2
+    for (int i = 0; i < 50; i++) {
+        rtt.sample(10000);
+    }
+    ASSERT_EQ(10000u, rtt.srttUsec());
+    ASSERT_LT(rtt.rtoUsec(), 11000u);
+
+    rtt.sample(100); // clamped to the minimum timeout
+    for (int i = 0; i < 100; i++) {
+        rtt.sample(100);
+    }
+    ASSERT_EQ(1000u, rtt.rtoUsec());
+
+    ASSERT_EQ(1000u, rtt.timeoutUsec(1));
+    ASSERT_EQ(4000u, rtt.timeoutUsec(3));
+    ASSERT_EQ(400000u, rtt.timeoutUsec(30));
+}
+
+TEST(ReliableUdp, DeliversWholeOrderedMessagesPerStreamUnderLoss) {
+    const int port = 19310;
+    const int count = 100;
+    loss_injection_t injection;
+    injection.lossRate = 0.2;
+    injection.delayUsec = 200;
+    injection.jitterUsec = 500; // also reorders datagrams
+    reliable_udp_config_t config;
+    config.minRtoUsec = 2000;
+
+    ReliableUdpServer server;
+    server.setConfig(config);
+    server.setLossInjection(injection);
+    std::mutex receivedMtx;
+    std::map<uint16_t, std::vector<std::string>> received;
+    for (uint16_t stream : {1, 2}) {
+        server_observer_t observer;
+        observer.incoming_packet_func = [&, stream](const Client &, const char *msg, size_t size) {
+            std::lock_guard<std::mutex> lock(receivedMtx);
+            received[stream].emplace_back(msg, size);
+        };
+        server.subscribe(stream, observer);
+    }
+    ASSERT_TRUE(server.start(port).success);
+
+    ReliableUdpClient client;
+    client.setConfig(config);
+    injection.seed = 2;
+    client.setLossInjection(injection);
+    ASSERT_TRUE(client.connectTo("127.0.0.1", port).success);
+    for (int i = 0; i < count; i++) {
+        for (uint16_t stream : {1, 2}) {
+            std::string message = test_message(stream, i);
+            ASSERT_TRUE(client.sendMsg(stream, message.data(), message.size()).success);
+        }
+    }
+
+    ASSERT_TRUE(wait_for([&] {
+        std::lock_guard<std::mutex> lock(receivedMtx);
+        return received[1].size() == count && received[2].size() == count;
+    }));
+    for (uint16_t stream : {1, 2}) {
+        for (int i = 0; i < count; i++) {
+            ASSERT_EQ(test_message(stream, i), received[stream][i]);
+        }
+    }
+    reliable_udp_stats_t stats = client.getStats();
+    ASSERT_GT(stats.datagramsDropped, 0u);
+    ASSERT_GT(stats.retransmissions, 0u);
+    ASSERT_EQ(uint64_t(2 * count), server.getStats().messagesDelivered);
+    ASSERT_TRUE(client.finish().success);
+    ASSERT_TRUE(server.finish().success);
+}
+
+TEST(ReliableUdp, ServerRepliesToClient) {
+    const int port = 19311;
+    ReliableUdpServer server;
+    server_observer_t serverObserver;
+    serverObserver.incoming_packet_func = [&server](const Client &client, const char *msg, size_t size) {
+        server.sendToClient(client, 7, msg, size);
+    };
+    server.subscribe(7, serverObserver);
+    ASSERT_TRUE(server.start(port).success);
+
+    ReliableUdpClient client;
+    std::mutex repliesMtx;
+    std::vector<std::string> replies;
+    client_observer_t clientObserver;
+    clientObserver.incoming_packet_func = [&](const char *msg, size_t size) {
+        std::lock_guard<std::mutex> lock(repliesMtx);
+        replies.emplace_back(msg, size);
+    };
+    client.subscribe(7, clientObserver);
+    ASSERT_TRUE(client.connectTo("127.0.0.1", port).success);
+    ASSERT_TRUE(client.sendMsg(7, "ping", 4).success);
+    ASSERT_TRUE(client.sendMsg(7, "", 0).success); // empty messages are messages too
+
+    ASSERT_TRUE(wait_for([&] {
+        std::lock_guard<std::mutex> lock(repliesMtx);
+        return replies.size() == 2;
+    }));
+    ASSERT_EQ("ping", replies[0]);
+    ASSERT_EQ("", replies[1]);
+}
+
+TEST(ReliableUdp, ReportsPeerThatStopsAcknowledging) {
+    ReliableUdpClient client;
+    reliable_udp_config_t config;
+    config.initialRtoUsec = 2000;
+    config.maxTransmissions = 3;
+    client.setConfig(config);
+    std::atomic<bool> disconnected{false};
+    client_observer_t observer;
+    observer.disconnected_func = [&disconnected](const pipe_ret_t &ret) {
+        disconnected = ret.category == error_category_t::TIMEOUT;
+    };
+    client.subscribe(1, observer);
+    ASSERT_TRUE(client.connectTo("127.0.0.1", 19312).success); // nobody listens
+
+    ASSERT_TRUE(client.sendMsg(1, "hello", 5).success);
+    ASSERT_TRUE(wait_for([&] { return disconnected.load(); }));
+    ASSERT_EQ(1u, client.getStats().peersLost);
+    ASSERT_EQ(error_category_t::PEER_CLOSED, client.sendMsg(1, "again", 5).category);
+}
+
+TEST(ReliableUdp, PacingSpreadsNewData) {
+    const int port = 19313;
+    ReliableUdpServer server;
+    std::atomic<size_t> receivedBytes{0};
+    server_observer_t observer;
+    observer.incoming_packet_func = [&receivedBytes](const Client &, const char *, size_t size) {
+        receivedBytes += size;
+    };
+    server.subscribe(1, observer);
+    ASSERT_TRUE(server.start(port).success);
+
+    ReliableUdpClient client;
+    reliable_udp_config_t config;
+    config.pacingRate = 200 * 1000; // bytes per second
+    config.pacingBurst = 2 * config.maxDatagram;
+    client.setConfig(config);
+    ASSERT_TRUE(client.connectTo("127.0.0.1", port).success);
+    std::string message(1000, 'x');
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < 40; i++) {
+        ASSERT_TRUE(client.sendMsg(1, message.data(), message.size()).success);
+    }
+    ASSERT_TRUE(wait_for([&] { return receivedBytes == 40 * message.size(); }));
+    // 40 KB at 200 KB/s, less the initial burst
+    ASSERT_GE(std::chrono::steady_clock::now() - start, std::chrono::milliseconds(150));
+}
+
+TEST(ReliableUdp, ServerForgetsIdlePeersAndCapsPeerCount) {
+    const int port = 19329;
+    ReliableUdpServer server;
+    reliable_udp_config_t config;
+    config.peerIdleMs = 100;
+    config.maxPeers = 1;
+    server.setConfig(config);
+    std::mutex receivedMtx;
+    std::vector<std::string> received;
+    std::atomic<int> disconnected{0};
+    server_observer_t observer;
+    observer.incoming_packet_func = [&](const Client &, const char *msg, size_t size) {
+        std::lock_guard<std::mutex> lock(receivedMtx);
+        received.emplace_back(msg, size);
+    };
+    observer.disconnected_func = [&disconnected](const Client &) { disconnected++; };
+    server.subscribe(1, observer);
+    ASSERT_TRUE(server.start(port).success);
+    auto receivedSoFar = [&] {
+        std::lock_guard<std::mutex> lock(receivedMtx);
+        return received;
+    };
+
+    ReliableUdpClient first;
+    ASSERT_TRUE(first.connectTo("127.0.0.1", port).success);
+    ASSERT_TRUE(first.sendMsg(1, "first", 5).success);
+    ASSERT_TRUE(wait_for([&] { return receivedSoFar().size() == 1; }));
+
+    // refused while the first peer is known, retransmitted until it is idle
+    ReliableUdpClient second;
+    ASSERT_TRUE(second.connectTo("127.0.0.1", port).success);
+    ASSERT_TRUE(second.sendMsg(1, "second", 6).success);
+    ASSERT_TRUE(wait_for([&] { return receivedSoFar().size() == 2; }));
+    ASSERT_THAT(receivedSoFar(), ::testing::ElementsAre("first", "second"));
+    ASSERT_EQ(1, disconnected.load());
+    reliable_udp_stats_t stats = server.getStats();
+    ASSERT_EQ(1u, stats.peersIdle);
+    ASSERT_GE(stats.peersRefused, 1u);
+    ASSERT_EQ(0u, stats.peersLost);
+}
+
+TEST(ReliableUdp, FinishFromObserver) {
+    const int port = 19330;
+    ReliableUdpServer server;
+    std::atomic<bool> finished{false};
+    server_observer_t observer;
+    observer.incoming_packet_func = [&](const Client &, const char *, size_t) {
+        server.finish();
+        finished = true;
+    };
+    server.subscribe(1, observer);
+    ASSERT_TRUE(server.start(port).success);
+
+    ReliableUdpClient client;
+    ASSERT_TRUE(client.connectTo("127.0.0.1", port).success);
+    ASSERT_TRUE(client.sendMsg(1, "bye", 3).success);
+    ASSERT_TRUE(wait_for([&] { return finished.load(); }));
+    ASSERT_EQ(0, server.getPort());
+    // the detached service thread exits on its own once the observer returns
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+}
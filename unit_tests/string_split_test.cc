@@ -7,3 +7,87 @@ TEST(StringSplitText, SplittingStringsIntoTokensByAGivenDelimiter) {
 
     ASSERT_THAT(expected, split("this is sample"s, ' '));
 }
+
+TEST(StringSplitText, SplitViewReturnsTokensOverOriginalBuffer) {
+    using namespace std::string_literals;
+    auto text = "  leading,and,,trailing  delimiters  "s;
+    auto tokens = split_view(text, ' ');
+
+    ASSERT_THAT(tokens, ::testing::ElementsAre("leading,and,,trailing",
+                                               "delimiters"));
+    ASSERT_GE(tokens[0].data(), text.data());
+    ASSERT_LT(tokens[0].data(), text.data() + text.size());
+}
+
+TEST(StringSplitText, SplitViewMatchesSplitOnLongInput) {
+    std::string text;
+    for (int i = 0; i < 1000; i++) {
+        text += std::string(i % 67, 'x') + std::to_string(i);
+        text += (i % 3 == 0) ? ";;" : ";";
+    }
+    auto expected = split(text, ';');
+    auto tokens = split_view(text, ';');
+
+    ASSERT_EQ(expected.size(), tokens.size());
+    for (size_t i = 0; i < tokens.size(); i++) {
+        ASSERT_EQ(expected[i], tokens[i]);
+    }
+}
+
+TEST(StringSplitText, DelimiterFramerJoinsFramesAcrossChunks) {
+    std::vector<std::string> frames;
+    delimiter_framer<char> framer('\n');
+    auto onFrame = [&frames](std::string_view frame) {
+        frames.emplace_back(frame);
+    };
+    std::string stream = "first\nsec";
+    ASSERT_TRUE(framer.feed(stream.data(), stream.size(), onFrame));
+    ASSERT_EQ(3u, framer.pending());
+    stream = "ond\n\nthird";
+    ASSERT_TRUE(framer.feed(stream.data(), stream.size(), onFrame));
+
+    ASSERT_THAT(frames, ::testing::ElementsAre("first", "second", ""));
+    ASSERT_EQ(5u, framer.pending());
+}
+
+TEST(StringSplitText, DelimiterFramerDropsOversizedFrame) {
+    delimiter_framer<char> framer('\n', 8);
+    std::string stream = "0123456789";
+    ASSERT_FALSE(framer.feed(stream.data(), stream.size(),
+                             [](std::string_view) {}));
+    ASSERT_EQ(0u, framer.pending());
+}
+
+TEST(StringSplitText, DelimiterFramerRejectsOversizedCompleteFrames) {
+    std::vector<std::string> frames;
+    delimiter_framer<char> framer('\n', 8);
+    auto onFrame = [&frames](std::string_view frame) {
+        frames.emplace_back(frame);
+    };
+    std::string stream = "short\n0123456789\nok\n";
+    ASSERT_FALSE(framer.feed(stream.data(), stream.size(), onFrame));
+    // a partial frame is checked with what completes it
+    stream = "01234";
+    ASSERT_TRUE(framer.feed(stream.data(), stream.size(), onFrame));
+    stream = "56789\nlast\n";
+    ASSERT_FALSE(framer.feed(stream.data(), stream.size(), onFrame));
+
+    ASSERT_THAT(frames, ::testing::ElementsAre("short", "ok", "last"));
+    ASSERT_EQ(0u, framer.pending());
+}
+
+TEST(StringSplitText, DelimiterFramerSkipsRestOfDroppedFrame) {
+    std::vector<std::string> frames;
+    delimiter_framer<char> framer('\n', 8);
+    auto onFrame = [&frames](std::string_view frame) {
+        frames.emplace_back(frame);
+    };
+    std::string stream = "0123456789";
+    ASSERT_FALSE(framer.feed(stream.data(), stream.size(), onFrame));
+    stream = "SUB x";
+    ASSERT_TRUE(framer.feed(stream.data(), stream.size(), onFrame));
+    stream = "\nnext\n";
+    ASSERT_TRUE(framer.feed(stream.data(), stream.size(), onFrame));
+
+    ASSERT_THAT(frames, ::testing::ElementsAre("next"));
+}
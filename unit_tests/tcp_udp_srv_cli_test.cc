@@ -1,3 +1,5 @@
+#include <poll.h>
+
 #include "../src/tcp_udp_srv_cli.h"
 #include "unit_tests_common.h"
 
@@ -18,3 +20,754 @@ TEST(TcpIPClient, CreationTcpIPClientObject) {
                << e.what();
     }
 }
+
+TEST(IoThreads, ParsesCpulist) {
+    ASSERT_THAT(parse_cpulist("0-3,8-9\n"), ::testing::ElementsAre(0, 1, 2, 3, 8, 9));
+    ASSERT_THAT(parse_cpulist("5"), ::testing::ElementsAre(5));
+    ASSERT_TRUE(parse_cpulist("").empty());
+    ASSERT_TRUE(parse_cpulist("\n").empty());
+    // bad ranges are skipped, the rest is kept
+    ASSERT_THAT(parse_cpulist("x,1,2-y,-3,4-,99999999999,6-7"), ::testing::ElementsAre(1, 6, 7));
+    ASSERT_THAT(parse_cpulist("3-1,2"), ::testing::ElementsAre(2));
+}
+
+TEST(IoThreads, PinRejectsInvalidCpu) {
+    std::thread thread([] {
+        ASSERT_FALSE(pin_current_thread(-1));
+        ASSERT_FALSE(pin_current_thread(CPU_SETSIZE));
+        ASSERT_FALSE(pin_current_thread(CPU_SETSIZE - 1)); // no such CPU here
+        ASSERT_TRUE(pin_current_thread(sched_getcpu()));
+    });
+    thread.join();
+}
+
+TEST(TcpIPServer, ListenerHandoffKeepsAcceptingConnections) {
+    const int port = 19301;
+    const std::string socketPath = "/tmp/easy_srv_cli_handoff_test.sock";
+    TcpServer oldServer;
+    TcpServer newServer;
+    ASSERT_TRUE(oldServer.start(port).success);
+
+    pipe_ret_t adopted;
+    std::thread newProcess([&] {
+        adopted = newServer.startFromHandoff(socketPath, 2000);
+    });
+    pipe_ret_t handedOff = oldServer.handOffListener(socketPath, 2000);
+    newProcess.join();
+    ASSERT_TRUE(handedOff.success) << handedOff.message();
+    ASSERT_TRUE(adopted.success) << adopted.message();
+
+    ASSERT_TRUE(oldServer.drain(1000).success);
+    ASSERT_FALSE(oldServer.acceptClient(1).isConnected());
+
+    // only the new server holds the listener now
+    struct sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socket_handle peer(socket(AF_INET, SOCK_STREAM, 0));
+    ASSERT_EQ(0, connect(peer.get(), (struct sockaddr *)&address, sizeof(address)));
+
+    ASSERT_TRUE(newServer.finish().success);
+    socket_handle refused(socket(AF_INET, SOCK_STREAM, 0));
+    ASSERT_EQ(-1, connect(refused.get(), (struct sockaddr *)&address, sizeof(address)));
+}
+
+TEST(TcpIPServer, ClientsComeAndGoDuringBroadcast) {
+    const int port = 19302;
+    const int rounds = 10;
+    const int clientsPerRound = 4;
+    TcpServer server;
+    ASSERT_TRUE(server.start(port).success);
+    std::atomic<int> disconnected{0};
+    server_observer_t observer;
+    observer.disconnected_func = [&disconnected](const Client &) { disconnected++; };
+    server.subscribe(observer);
+
+    std::atomic<bool> stop{false};
+    std::thread acceptor([&] {
+        while (!stop) {
+            server.acceptClient(1);
+        }
+    });
+    std::thread broadcaster([&] {
+        const char msg[] = "tick";
+        while (!stop) {
+            server.sendToAllClients(msg, sizeof(msg));
+            server.printClients();
+        }
+    });
+
+    struct sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    for (int round = 0; round < rounds; round++) {
+        std::vector<socket_handle> peers;
+        for (int i = 0; i < clientsPerRound; i++) {
+            peers.emplace_back(socket(AF_INET, SOCK_STREAM, 0));
+            ASSERT_EQ(0, connect(peers.back().get(), (struct sockaddr *)&address, sizeof(address)));
+        }
+    }
+    wait_for([&] { return disconnected >= rounds * clientsPerRound; });
+    stop = true;
+    acceptor.join();
+    broadcaster.join();
+
+    ASSERT_EQ(rounds * clientsPerRound, disconnected);
+    ASSERT_TRUE(server.finish().success);
+}
+
+TEST(TcpIPServer, FinishDisconnectsClients) {
+    const int port = 19303;
+    TcpServer server;
+    ASSERT_TRUE(server.start(port).success);
+    std::atomic<int> disconnected{0};
+    server_observer_t observer;
+    observer.disconnected_func = [&disconnected](const Client &) { disconnected++; };
+    server.subscribe(observer);
+
+    TcpClient client;
+    std::atomic<bool> serverClosed{false};
+    client_observer_t clientObserver;
+    clientObserver.disconnected_func = [&serverClosed](const pipe_ret_t &) { serverClosed = true; };
+    client.subscribe(clientObserver);
+    ASSERT_TRUE(client.connectTo("127.0.0.1", port).success);
+    Client accepted = server.acceptClient(1);
+    ASSERT_TRUE(accepted.isConnected());
+    ASSERT_TRUE(server.sendToClient(accepted, "x", 1).success);
+
+    ASSERT_TRUE(server.finish().success);
+    ASSERT_EQ(1, disconnected);
+    ASSERT_FALSE(server.sendToClient(accepted, "x", 1).success);
+    wait_for([&] { return serverClosed.load(); });
+    ASSERT_TRUE(serverClosed);
+    ASSERT_TRUE(client.finish().success);
+}
+
+TEST(TcpIPServer, SoftwareTimestampsOnLoopback) {
+    const int port = 19304;
+    TcpServer server;
+    timestamping_config_t timestamping;
+    timestamping.rx = true;
+    timestamping.tx = true;
+    server.setTimestamping(timestamping);
+    ASSERT_TRUE(server.start(port).success);
+    // the kernel enables RX timestamping from a work queue
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+    std::atomic<uint64_t> rxStamp{0};
+    std::atomic<uint64_t> txStamp{0};
+    server_observer_t observer;
+    observer.incoming_packet_ts_func = [&](const Client &client, const char *msg, size_t size,
+                                           const packet_timestamps_t &rx) {
+        rxStamp = rx.softwareNs;
+        server.sendToClient(client, msg, size);
+    };
+    observer.tx_timestamp_func = [&](const Client &, uint32_t bytesSent,
+                                     const packet_timestamps_t &tx) {
+        if (bytesSent == 4) { // last byte of the 5 byte reply
+            txStamp = tx.softwareNs;
+        }
+    };
+    server.subscribe(observer);
+
+    TcpClient client;
+    ASSERT_TRUE(client.connectTo("127.0.0.1", port).success);
+    ASSERT_TRUE(server.acceptClient(1).isConnected());
+    ASSERT_TRUE(client.sendMsg("hello", 5).success);
+    wait_for([&] { return txStamp != 0; });
+
+    ASSERT_NE(0u, rxStamp.load());
+    ASSERT_NE(0u, txStamp.load());
+    ASSERT_GE(txStamp.load(), rxStamp.load());
+    ASSERT_EQ(1u, server.getRxDelayHistogram().count());
+    ASSERT_EQ(1u, server.getTxDelayHistogram().count());
+    ASSERT_TRUE(server.finish().success);
+}
+
+TEST(TcpIPServer, TopicPublishesAreTimestamped) {
+    const int port = 19328;
+    TcpServer server;
+    timestamping_config_t timestamping;
+    timestamping.tx = true;
+    server.setTimestamping(timestamping);
+    std::mutex offsetsMtx;
+    std::vector<uint32_t> offsets;
+    server_observer_t observer;
+    observer.tx_timestamp_func = [&](const Client &, uint32_t bytesSent,
+                                     const packet_timestamps_t &) {
+        std::lock_guard<std::mutex> lock(offsetsMtx);
+        offsets.push_back(bytesSent);
+    };
+    server.subscribe(observer);
+    ASSERT_TRUE(server.start(port).success);
+
+    TcpClient client;
+    ASSERT_TRUE(client.connectTo("127.0.0.1", port).success);
+    Client accepted = server.acceptClient(1);
+    ASSERT_TRUE(accepted.isConnected());
+    ASSERT_TRUE(server.subscribeTopic(accepted, "prices/#"));
+    ASSERT_TRUE(server.publishToTopic("prices/btc", "abc", 3).success);
+    ASSERT_TRUE(server.sendToClient(accepted, "de", 2).success);
+
+    // the publish counts towards the byte offsets of later sends
+    auto offsetsSoFar = [&] {
+        std::lock_guard<std::mutex> lock(offsetsMtx);
+        return offsets;
+    };
+    ASSERT_TRUE(wait_for([&] { return offsetsSoFar().size() == 2; }));
+    ASSERT_THAT(offsetsSoFar(), ::testing::ElementsAre(2u, 4u));
+    ASSERT_EQ(2u, server.getTxDelayHistogram().count());
+    ASSERT_TRUE(client.finish().success);
+    ASSERT_TRUE(server.finish().success);
+}
+
+namespace {
+/// Connect to the loopback port, from source (an address of 127/8) if set.
+int connect_loopback(int port, const char *source = nullptr) {
+    struct sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (source != nullptr) {
+        struct sockaddr_in local = {};
+        local.sin_family = AF_INET;
+        inet_aton(source, &local.sin_addr);
+        if (bind(sockfd, (struct sockaddr *)&local, sizeof(local)) == -1) {
+            close(sockfd);
+            return -1;
+        }
+    }
+    if (connect(sockfd, (struct sockaddr *)&address, sizeof(address)) == -1) {
+        close(sockfd);
+        return -1;
+    }
+    return sockfd;
+}
+
+/// Read size bytes from sockfd, less if nothing arrives for five seconds.
+std::string recv_exactly(int sockfd, size_t size) {
+    std::string received;
+    char buffer[4096];
+    while (received.size() < size) {
+        struct pollfd pfd = {sockfd, POLLIN, 0};
+        if (poll(&pfd, 1, 5000) != 1) {
+            break;
+        }
+        ssize_t numBytes = recv(sockfd, buffer, std::min(sizeof(buffer), size - received.size()), 0);
+        if (numBytes <= 0) {
+            break;
+        }
+        received.append(buffer, numBytes);
+    }
+    return received;
+}
+}  // namespace
+
+TEST(TcpIPServer, TopicSubscribeRejectsDisconnectedClient) {
+    const int port = 19333;
+    TcpServer server;
+    ASSERT_TRUE(server.start(port).success);
+
+    TcpClient client;
+    ASSERT_TRUE(client.connectTo("127.0.0.1", port).success);
+    Client accepted = server.acceptClient(1);
+    ASSERT_TRUE(accepted.isConnected());
+    ASSERT_TRUE(server.subscribeTopic(accepted, "prices/#"));
+    ASSERT_TRUE(server.deleteClient(accepted));
+    // once the receive task retired it, its socket may be reused any time
+    ASSERT_TRUE(wait_for([&] { return !server.subscribeTopic(accepted, "prices/#"); }));
+    ASSERT_FALSE(server.unsubscribeTopic(accepted, "prices/#"));
+    ASSERT_TRUE(client.finish().success);
+    ASSERT_TRUE(server.finish().success);
+}
+
+TEST(TcpIPServer, AcceptClientsDrainsBacklog) {
+    const int port = 19305;
+    const size_t burst = 50;
+    TcpServer server;
+    listen_config_t listenConfig;
+    listenConfig.backlog = 64;
+    server.setListenConfig(listenConfig);
+    ASSERT_TRUE(server.start(port).success);
+
+    std::vector<socket_handle> peers;
+    for (size_t i = 0; i < burst; i++) {
+        peers.emplace_back(connect_loopback(port));
+        ASSERT_TRUE(peers.back());
+    }
+    std::vector<Client> accepted;
+    ASSERT_TRUE(server.acceptClients(1, accepted).success);
+
+    ASSERT_EQ(burst, accepted.size());
+    ASSERT_EQ(error_category_t::TIMEOUT, server.acceptClient(1).getStatus().category);
+    ASSERT_TRUE(server.finish().success);
+    ASSERT_EQ(EBADF, server.acceptClient(0).getStatus().code);
+}
+
+TEST(TcpIPServer, AdmissionCapsRefuseAndReleaseConnections) {
+    const int port = 19318;
+    TcpServer server;
+    admission_limits_t limits;
+    limits.maxConnections = 2;
+    limits.maxConnectionsPerIp = 1;
+    server.setAdmissionLimits(limits);
+    std::atomic<int> disconnected{0};
+    server_observer_t observer;
+    observer.disconnected_func = [&disconnected](const Client &) { disconnected++; };
+    server.subscribe(observer);
+    ASSERT_TRUE(server.start(port).success);
+
+    socket_handle first(connect_loopback(port));
+    ASSERT_TRUE(server.acceptClient(1).isConnected());
+    socket_handle sameIp(connect_loopback(port));
+    ASSERT_EQ(error_category_t::CONNECTION_LIMIT, server.acceptClient(1).getStatus().category);
+    // another address has a cap of its own, the global cap still applies
+    socket_handle otherIp(connect_loopback(port, "127.0.0.2"));
+    ASSERT_TRUE(server.acceptClient(1).isConnected());
+    socket_handle thirdIp(connect_loopback(port, "127.0.0.3"));
+    ASSERT_EQ(error_category_t::CONNECTION_LIMIT, server.acceptClient(1).getStatus().category);
+    ASSERT_EQ(2u, server.getRateLimitStats().rejectedConnections);
+
+    // the slots are released before observers learn about the disconnection
+    first.reset();
+    ASSERT_TRUE(wait_for([&] { return disconnected == 1; }));
+    socket_handle again(connect_loopback(port));
+    ASSERT_TRUE(server.acceptClient(1).isConnected());
+    ASSERT_EQ(2u, server.getRateLimitStats().rejectedConnections);
+    ASSERT_TRUE(server.finish().success);
+}
+
+TEST(TcpIPServer, RateLimitThrottlesReads) {
+    const int port = 19319;
+    TcpServer server;
+    admission_limits_t limits;
+    limits.perConnection.bytesPerSec = 20000;
+    limits.perConnection.bytesBurst = 1000;
+    server.setAdmissionLimits(limits);
+    std::atomic<size_t> received{0};
+    server_observer_t observer;
+    observer.incoming_packet_func = [&received](const Client &, const char *, size_t size) {
+        received += size;
+    };
+    server.subscribe(observer);
+    ASSERT_TRUE(server.start(port).success);
+
+    TcpClient client;
+    ASSERT_TRUE(client.connectTo("127.0.0.1", port).success);
+    ASSERT_TRUE(server.acceptClient(1).isConnected());
+    std::string message(5000, 'x');
+    auto start = std::chrono::steady_clock::now();
+    ASSERT_TRUE(client.sendMsg(message.data(), message.size()).success);
+
+    ASSERT_TRUE(wait_for([&] { return received == message.size(); }));
+    // 4000 bytes beyond the burst at 20000 bytes per second
+    ASSERT_GE(std::chrono::steady_clock::now() - start, std::chrono::milliseconds(150));
+    rate_limit_stats_t stats = server.getRateLimitStats();
+    ASSERT_GT(stats.throttledReads, 0u);
+    ASSERT_GE(stats.throttledUsec, 100000u);
+    ASSERT_EQ(0u, stats.rejectedConnections);
+    ASSERT_TRUE(client.finish().success);
+    ASSERT_TRUE(server.finish().success);
+}
+
+TEST(TcpIPServer, DrainClosesIdleConnections) {
+    const int port = 19320;
+    TcpServer server;
+    std::atomic<int> disconnected{0};
+    server_observer_t observer;
+    observer.disconnected_func = [&disconnected](const Client &) { disconnected++; };
+    server.subscribe(observer);
+    ASSERT_TRUE(server.start(port).success);
+
+    socket_handle first(connect_loopback(port));
+    socket_handle second(connect_loopback(port));
+    ASSERT_TRUE(server.acceptClient(1).isConnected());
+    ASSERT_TRUE(server.acceptClient(1).isConnected());
+    ASSERT_EQ(2, send(second.get(), "hi", 2, 0));
+
+    auto start = std::chrono::steady_clock::now();
+    ASSERT_TRUE(server.drain(5000, 50).success);
+    // well before the deadline, and not before the connections were idle
+    ASSERT_GE(std::chrono::steady_clock::now() - start, std::chrono::milliseconds(50));
+    ASSERT_LT(std::chrono::steady_clock::now() - start, std::chrono::milliseconds(4000));
+    ASSERT_TRUE(wait_for([&] { return disconnected == 2; }));
+    char byte;
+    ASSERT_EQ(0, recv(first.get(), &byte, 1, 0));
+    ASSERT_EQ(0, recv(second.get(), &byte, 1, 0));
+    ASSERT_EQ(error_category_t::DRAINING, server.acceptClient(0).getStatus().category);
+    ASSERT_TRUE(server.finish().success);
+}
+
+TEST(TcpIPServer, DrainForceClosesBusyConnectionsAtDeadline) {
+    const int port = 19321;
+    TcpServer server;
+    std::atomic<int> disconnected{0};
+    server_observer_t observer;
+    observer.disconnected_func = [&disconnected](const Client &) { disconnected++; };
+    server.subscribe(observer);
+    ASSERT_TRUE(server.start(port).success);
+
+    socket_handle busy(connect_loopback(port));
+    socket_handle idle(connect_loopback(port));
+    ASSERT_TRUE(server.acceptClient(1).isConnected());
+    ASSERT_TRUE(server.acceptClient(1).isConnected());
+    std::atomic<bool> stop{false};
+    std::thread sender([&] {
+        while (!stop && send(busy.get(), "x", 1, MSG_NOSIGNAL) == 1) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        }
+    });
+
+    auto start = std::chrono::steady_clock::now();
+    pipe_ret_t ret = server.drain(300, 100);
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    ASSERT_EQ(error_category_t::DEADLINE_EXCEEDED, ret.category);
+    ASSERT_EQ(1, ret.code);
+    ASSERT_GE(elapsed, std::chrono::milliseconds(300));
+    // the idle connection went gracefully, the busy one at the deadline
+    ASSERT_TRUE(wait_for([&] { return disconnected == 2; }));
+    stop = true;
+    sender.join();
+    ASSERT_TRUE(server.finish().success);
+}
+
+TEST(TcpIPServer, DrainFlushesPriorityQueues) {
+    const int port = 19336;
+    TcpServer server;
+    priority_config_t config;
+    config.enabled = true;
+    server.setPrioritySending(config);
+    ASSERT_TRUE(server.start(port).success);
+
+    socket_handle peer(connect_loopback(port));
+    Client accepted = server.acceptClient(1);
+    ASSERT_TRUE(accepted.isConnected());
+    const std::string message(64 * 1024, 'x');
+    const size_t messages = 64;
+    for (size_t i = 0; i < messages; i++) {
+        ASSERT_TRUE(server.sendToClient(accepted, message.data(), message.size()).success);
+    }
+    std::atomic<size_t> received{0};
+    std::thread reader([&] {
+        char buffer[64 * 1024];
+        ssize_t n;
+        while ((n = recv(peer.get(), buffer, sizeof(buffer), 0)) > 0) {
+            received += n;
+        }
+    });
+
+    // the kernel queue empties between writes, the connection is busy
+    // until the priority queue is written too
+    ASSERT_TRUE(server.drain(5000, 0).success);
+    reader.join();
+    ASSERT_GE(received.load(), messages * message.size());
+    ASSERT_TRUE(server.finish().success);
+}
+
+TEST(TcpIPServer, DeferAcceptWaitsForData) {
+    const int port = 19306;
+    TcpServer server;
+    listen_config_t listenConfig;
+    listenConfig.deferAcceptSec = 5;
+    server.setListenConfig(listenConfig);
+    ASSERT_TRUE(server.start(port).success);
+
+    socket_handle peer(connect_loopback(port));
+    ASSERT_TRUE(peer);
+    ASSERT_EQ(error_category_t::TIMEOUT, server.acceptClient(1).getStatus().category);
+    ASSERT_EQ(1, send(peer.get(), "x", 1, 0));
+    ASSERT_TRUE(server.acceptClient(1).isConnected());
+    ASSERT_TRUE(server.finish().success);
+}
+
+TEST(TcpIPServer, TopicCommandsOverSockets) {
+    const int port = 19322;
+    TcpServer server;
+    std::mutex linesMtx;
+    std::vector<std::string> lines;
+    server_observer_t observer;
+    observer.incoming_packet_func = [&](const Client &, const char *msg, size_t size) {
+        std::lock_guard<std::mutex> lock(linesMtx);
+        lines.emplace_back(msg, size);
+    };
+    server.subscribe(observer);
+    server.enableTopicCommands(true);
+    ASSERT_TRUE(server.start(port).success);
+    socket_handle subscriber(connect_loopback(port));
+    socket_handle publisher(connect_loopback(port));
+    ASSERT_TRUE(server.acceptClient(1).isConnected());
+    ASSERT_TRUE(server.acceptClient(1).isConnected());
+
+    // the reply to the bad filter also tells that the first SUB is done
+    std::string subscribe = "SUB prices/+\nSUB prices/#/btc\n";
+    ASSERT_EQ(ssize_t(subscribe.size()), send(subscriber.get(), subscribe.data(), subscribe.size(), 0));
+    std::string badFilter = "ERR invalid filter\n";
+    ASSERT_EQ(badFilter, recv_exactly(subscriber.get(), badFilter.size()));
+
+    std::string publish = "PUB prices/+ 41\nPUB prices/btc 42\n";
+    ASSERT_EQ(ssize_t(publish.size()), send(publisher.get(), publish.data(), publish.size(), 0));
+    std::string badTopic = "ERR invalid topic\n";
+    ASSERT_EQ(badTopic, recv_exactly(publisher.get(), badTopic.size()));
+    std::string published = "prices/btc 42\n";
+    ASSERT_EQ(published, recv_exactly(subscriber.get(), published.size()));
+
+    // no part of the long line may reach observers
+    std::string longLine(2 * TOPIC_COMMAND_MAX_LINE, 'x');
+    longLine += "\nPUB prices/btc 43\nhello\n";
+    ASSERT_EQ(ssize_t(longLine.size()), send(publisher.get(), longLine.data(), longLine.size(), 0));
+    std::string tooLong = "ERR line too long\n";
+    ASSERT_EQ(tooLong, recv_exactly(publisher.get(), tooLong.size()));
+    published = "prices/btc 43\n";
+    ASSERT_EQ(published, recv_exactly(subscriber.get(), published.size()));
+
+    auto linesSoFar = [&] {
+        std::lock_guard<std::mutex> lock(linesMtx);
+        return lines;
+    };
+    ASSERT_TRUE(wait_for([&] { return !linesSoFar().empty(); }));
+    ASSERT_THAT(linesSoFar(), ::testing::ElementsAre("hello"));
+    ASSERT_TRUE(server.finish().success);
+}
+
+TEST(TcpIPClient, FastOpenConnectDeliversFirstMessage) {
+    const int port = 19307;
+    TcpServer server;
+    listen_config_t listenConfig;
+    listenConfig.fastOpenQueue = 16;
+    server.setListenConfig(listenConfig);
+    ASSERT_TRUE(server.start(port).success);
+    std::atomic<int> received{0};
+    server_observer_t observer;
+    observer.incoming_packet_func = [&received](const Client &, const char *, size_t size) {
+        received += size;
+    };
+    server.subscribe(observer);
+
+    // falls back to a regular handshake unless net.ipv4.tcp_fastopen allows
+    // it, delivery must work either way
+    for (int round = 0; round < 2; round++) {
+        TcpClient client;
+        client.setFastOpen(true);
+        ASSERT_TRUE(client.connectTo("127.0.0.1", port).success);
+        ASSERT_TRUE(client.sendMsg("hello", 5).success);
+        ASSERT_TRUE(server.acceptClient(1).isConnected());
+        wait_for([&] { return received >= 5 * (round + 1); });
+        ASSERT_EQ(5 * (round + 1), received);
+        ASSERT_TRUE(client.finish().success);
+    }
+    ASSERT_TRUE(server.finish().success);
+}
+
+namespace {
+/// Server collecting what a batching client sends, and the flushes the
+/// client reports.
+struct batching_test_t {
+    TcpServer server;
+    TcpClient client;
+    std::mutex mtx;
+    std::string received;
+    std::vector<size_t> flushedMessages;
+
+    void start(int port, const send_batching_config_t &batching) {
+        ASSERT_TRUE(server.start(port).success);
+        server_observer_t serverObserver;
+        serverObserver.incoming_packet_func = [this](const Client &, const char *msg, size_t size) {
+            std::lock_guard<std::mutex> lock(mtx);
+            received.append(msg, size);
+        };
+        server.subscribe(serverObserver);
+        client.setSendBatching(batching);
+        client_observer_t clientObserver;
+        clientObserver.flushed_func = [this](const pipe_ret_t &ret, size_t bytes, size_t messages) {
+            ASSERT_TRUE(ret.success);
+            ASSERT_EQ(messages, bytes);
+            std::lock_guard<std::mutex> lock(mtx);
+            flushedMessages.push_back(messages);
+        };
+        client.subscribe(clientObserver);
+        ASSERT_TRUE(client.connectTo("127.0.0.1", port).success);
+        ASSERT_TRUE(server.acceptClient(1).isConnected());
+    }
+
+    std::string receivedSoFar() {
+        std::lock_guard<std::mutex> lock(mtx);
+        return received;
+    }
+
+    std::vector<size_t> flushedSoFar() {
+        std::lock_guard<std::mutex> lock(mtx);
+        return flushedMessages;
+    }
+};
+}  // namespace
+
+TEST(TcpIPClient, SendBatchingFlushesOnThreshold) {
+    send_batching_config_t batching;
+    batching.enabled = true;
+    batching.maxMessages = 4;
+    batching.lingerUsec = 3600ull * 1000 * 1000; // never reached in this test
+    batching_test_t test;
+    ASSERT_NO_FATAL_FAILURE(test.start(19308, batching));
+
+    // the fourth message fills the batch, sendMsg sends it right away
+    for (const char *msg : {"a", "b", "c", "d"}) {
+        ASSERT_TRUE(test.client.sendMsg(msg, 1).success);
+    }
+    ASSERT_EQ(std::vector<size_t>({4}), test.flushedSoFar());
+    ASSERT_TRUE(test.client.sendMsg("e", 1).success);
+    ASSERT_EQ(std::vector<size_t>({4}), test.flushedSoFar());
+    ASSERT_TRUE(test.client.flush().success);
+
+    wait_for([&] { return test.receivedSoFar().size() >= 5; });
+    ASSERT_EQ("abcde", test.receivedSoFar());
+    ASSERT_TRUE(test.client.finish().success);
+    ASSERT_TRUE(test.server.finish().success);
+}
+
+TEST(TcpIPClient, SendBatchingFlushesAfterLinger) {
+    send_batching_config_t batching;
+    batching.enabled = true;
+    batching.lingerUsec = 20 * 1000;
+    batching_test_t test;
+    ASSERT_NO_FATAL_FAILURE(test.start(19317, batching));
+
+    auto sent = std::chrono::steady_clock::now();
+    ASSERT_TRUE(test.client.sendMsg("a", 1).success);
+    ASSERT_TRUE(wait_for([&] { return !test.flushedSoFar().empty(); }));
+    ASSERT_GE(std::chrono::steady_clock::now() - sent, std::chrono::milliseconds(20));
+    ASSERT_EQ(std::vector<size_t>({1}), test.flushedSoFar());
+
+    wait_for([&] { return test.receivedSoFar().size() >= 1; });
+    ASSERT_EQ("a", test.receivedSoFar());
+    ASSERT_TRUE(test.client.finish().success);
+    ASSERT_TRUE(test.server.finish().success);
+}
+
+TEST(TcpIPClient, SendBatchingExplicitFlushAndFinish) {
+    const int port = 19309;
+    TcpServer server;
+    ASSERT_TRUE(server.start(port).success);
+    std::atomic<size_t> received{0};
+    server_observer_t serverObserver;
+    serverObserver.incoming_packet_func = [&received](const Client &, const char *, size_t size) {
+        received += size;
+    };
+    server.subscribe(serverObserver);
+
+    TcpClient client;
+    send_batching_config_t batching;
+    batching.enabled = true;
+    batching.lingerUsec = 10 * 1000 * 1000; // never reached in this test
+    client.setSendBatching(batching);
+    ASSERT_TRUE(client.connectTo("127.0.0.1", port).success);
+    ASSERT_TRUE(server.acceptClient(1).isConnected());
+
+    ASSERT_TRUE(client.sendMsg("hello", 5).success);
+    ASSERT_TRUE(client.flush().success);
+    wait_for([&] { return received >= 5; });
+    ASSERT_EQ(5u, received);
+
+    // finish sends what is still buffered before closing
+    ASSERT_TRUE(client.sendMsg("world", 5).success);
+    ASSERT_TRUE(client.finish().success);
+    wait_for([&] { return received >= 10; });
+    ASSERT_EQ(10u, received);
+    ASSERT_TRUE(server.finish().success);
+}
+
+TEST(TcpIPServer, PriorityFramesAreDecodedBeforeTopicCommands) {
+    const int port = 19331;
+    TcpServer server;
+    priority_config_t config;
+    config.enabled = true;
+    server.setPrioritySending(config);
+    server.enableTopicCommands(true);
+    std::mutex statusMtx;
+    std::vector<error_category_t> disconnects;
+    server_observer_t observer;
+    observer.disconnected_func = [&](const Client &client) {
+        std::lock_guard<std::mutex> lock(statusMtx);
+        disconnects.push_back(client.getStatus().category);
+    };
+    server.subscribe(observer);
+    ASSERT_TRUE(server.start(port).success);
+
+    TcpClient client;
+    client.setPrioritySending(config);
+    std::mutex receivedMtx;
+    std::vector<std::string> received;
+    client_observer_t clientObserver;
+    clientObserver.incoming_packet_func = [&](const char *msg, size_t size) {
+        std::lock_guard<std::mutex> lock(receivedMtx);
+        received.emplace_back(msg, size);
+    };
+    client.subscribe(clientObserver);
+    ASSERT_TRUE(client.connectTo("127.0.0.1", port).success);
+    ASSERT_TRUE(server.acceptClient(1).isConnected());
+    // one command split over two messages, the lines span the frames
+    ASSERT_TRUE(client.sendMsg("SUB prices/+\nPUB pri", 20).success);
+    ASSERT_TRUE(client.sendMsg("ces/btc 1\n", 10).success);
+    auto receivedSoFar = [&] {
+        std::lock_guard<std::mutex> lock(receivedMtx);
+        return received;
+    };
+    ASSERT_TRUE(wait_for([&] { return !receivedSoFar().empty(); }));
+    ASSERT_THAT(receivedSoFar(), ::testing::ElementsAre("prices/btc 1\n"));
+
+    // a peer that doesn't frame its data is disconnected
+    socket_handle raw(connect_loopback(port));
+    ASSERT_TRUE(server.acceptClient(1).isConnected());
+    std::string garbage(sizeof(priority_frame_header_t), '\x7f');
+    ASSERT_EQ(ssize_t(garbage.size()), send(raw.get(), garbage.data(), garbage.size(), 0));
+    auto disconnectsSoFar = [&] {
+        std::lock_guard<std::mutex> lock(statusMtx);
+        return disconnects;
+    };
+    ASSERT_TRUE(wait_for([&] { return !disconnectsSoFar().empty(); }));
+    ASSERT_THAT(disconnectsSoFar(), ::testing::ElementsAre(error_category_t::MALFORMED_FRAME));
+    ASSERT_TRUE(client.finish().success);
+    ASSERT_TRUE(server.finish().success);
+}
+
+TEST(TcpIPClient, FinishGivesUpOnPeerThatStopsReading) {
+    const int port = 19332;
+    // accepted by the kernel, never read
+    socket_handle listener(socket(AF_INET, SOCK_STREAM, 0));
+    struct sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    ASSERT_EQ(0, bind(listener.get(), (struct sockaddr *)&address, sizeof(address)));
+    ASSERT_EQ(0, listen(listener.get(), 4));
+    // more than the socket buffers of both ends hold
+    std::string large(12 << 20, 'x');
+
+    TcpClient prioritized;
+    priority_config_t config;
+    config.enabled = true;
+    prioritized.setPrioritySending(config);
+    ASSERT_TRUE(prioritized.connectTo("127.0.0.1", port).success);
+    ASSERT_TRUE(prioritized.sendMsg(large.data(), large.size(), send_priority_t::NORMAL).success);
+    ASSERT_TRUE(prioritized.sendMsg(large.data(), large.size(), send_priority_t::BULK).success);
+    auto start = std::chrono::steady_clock::now();
+    ASSERT_TRUE(prioritized.finish().success);
+    ASSERT_LT(std::chrono::steady_clock::now() - start,
+              std::chrono::milliseconds(2 * FINISH_FLUSH_TIMEOUT_MS));
+
+    TcpClient batched;
+    send_batching_config_t batching;
+    batching.enabled = true;
+    batching.maxBytes = 64 << 20;
+    batching.lingerUsec = 10 * 1000 * 1000; // never reached in this test
+    batched.setSendBatching(batching);
+    ASSERT_TRUE(batched.connectTo("127.0.0.1", port).success);
+    ASSERT_TRUE(batched.sendMsg(large.data(), large.size()).success);
+    ASSERT_TRUE(batched.sendMsg(large.data(), large.size()).success);
+    start = std::chrono::steady_clock::now();
+    ASSERT_TRUE(batched.finish().success);
+    ASSERT_LT(std::chrono::steady_clock::now() - start,
+              std::chrono::milliseconds(2 * FINISH_FLUSH_TIMEOUT_MS));
+}
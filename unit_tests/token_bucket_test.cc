@@ -0,0 +1,30 @@
+#include "../src/token_bucket.h"
+#include "unit_tests_common.h"
+
+TEST(TokenBucket, UnlimitedBucketNeverWaits) {
+    token_bucket bucket;
+    bucket.consume(1e9);
+
+    ASSERT_TRUE(bucket.unlimited());
+    ASSERT_EQ(0u, bucket.waitTimeUsec(1e9));
+}
+
+TEST(TokenBucket, StartsFullAndGoesIntoDebt) {
+    token_bucket bucket(1000, 100);
+    ASSERT_EQ(100u, bucket.available());
+
+    bucket.consume(150);
+    ASSERT_EQ(0u, bucket.available());
+    // 50 tokens of debt plus one token at 1000 tokens per second
+    uint64_t waitUsec = bucket.waitTimeUsec(1);
+    ASSERT_GT(waitUsec, 40000u);
+    ASSERT_LE(waitUsec, 51000u);
+}
+
+TEST(TokenBucket, RefillsUpToBurst) {
+    token_bucket bucket(100000, 10);
+    bucket.consume(10);
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+
+    ASSERT_EQ(10u, bucket.available());
+}
@@ -0,0 +1,53 @@
+#include "../src/topic_router.h"
+#include "unit_tests_common.h"
+
+using ::testing::ElementsAre;
+
+TEST(TopicRouter, ValidatesFiltersAndTopics) {
+    ASSERT_TRUE(topic_router::isValidFilter("prices/+/btc"));
+    ASSERT_TRUE(topic_router::isValidFilter("prices/#"));
+    ASSERT_TRUE(topic_router::isValidFilter("#"));
+    ASSERT_FALSE(topic_router::isValidFilter("prices/#/btc"));
+    ASSERT_FALSE(topic_router::isValidFilter("prices/b+"));
+    ASSERT_FALSE(topic_router::isValidFilter(""));
+    ASSERT_TRUE(topic_router::isValidTopic("prices/eu/btc"));
+    ASSERT_FALSE(topic_router::isValidTopic("prices/+"));
+}
+
+TEST(TopicRouter, MatchesExactAndWildcardFilters) {
+    topic_router router;
+    ASSERT_TRUE(router.subscribe(1, "prices/eu/btc"));
+    ASSERT_TRUE(router.subscribe(2, "prices/+/btc"));
+    ASSERT_TRUE(router.subscribe(3, "prices/#"));
+    ASSERT_TRUE(router.subscribe(4, "news/#"));
+    ASSERT_TRUE(router.subscribe(5, "+/eu/+"));
+
+    std::vector<int> subscribers;
+    router.match("prices/eu/btc", subscribers);
+    ASSERT_THAT(subscribers, ElementsAre(1, 2, 3, 5));
+    router.match("prices/us/btc", subscribers);
+    ASSERT_THAT(subscribers, ElementsAre(2, 3));
+    router.match("prices", subscribers);
+    ASSERT_THAT(subscribers, ElementsAre(3));
+    router.match("weather/eu", subscribers);
+    ASSERT_TRUE(subscribers.empty());
+}
+
+TEST(TopicRouter, SubscriberIsListedOnceAndCanUnsubscribe) {
+    topic_router router;
+    router.subscribe(1, "a/b");
+    router.subscribe(1, "a/+");
+    router.subscribe(1, "#");
+    router.subscribe(2, "a/b");
+
+    std::vector<int> subscribers;
+    router.match("a/b", subscribers);
+    ASSERT_THAT(subscribers, ElementsAre(1, 2));
+
+    ASSERT_TRUE(router.unsubscribe(2, "a/b"));
+    ASSERT_FALSE(router.unsubscribe(2, "a/b"));
+    router.unsubscribeAll(1);
+    router.match("a/b", subscribers);
+    ASSERT_TRUE(subscribers.empty());
+    ASSERT_EQ(0u, router.subscriptionCount());
+}
@@ -0,0 +1,57 @@
+#include "../src/trace.h"
+#include "unit_tests_common.h"
+
+#include <fstream>
+#include <sstream>
+
+TEST(Tracer, RecordsOnlyWhileStarted) {
+    tracer &trace = tracer::instance();
+    trace.start(16);
+    TRACE_POINT(trace_point_t::READ, read, 7, 100);
+    trace.stop();
+    TRACE_POINT(trace_point_t::READ, read, 7, 200);
+
+    std::vector<trace_event_t> events = trace.events();
+    ASSERT_EQ(1u, events.size());
+    ASSERT_EQ(trace_point_t::READ, events[0].point);
+    ASSERT_EQ(7u, events[0].connectionId);
+    ASSERT_EQ(100u, events[0].value);
+}
+
+TEST(Tracer, RingKeepsNewestEvents) {
+    tracer &trace = tracer::instance();
+    trace.start(4);
+    for (uint64_t i = 0; i < 10; i++) {
+        trace.record(trace_point_t::SEND, 1, i);
+    }
+    trace.stop();
+
+    std::vector<trace_event_t> events = trace.events();
+    ASSERT_EQ(4u, events.size());
+    for (uint64_t i = 0; i < 4; i++) {
+        ASSERT_EQ(6 + i, events[i].value);
+    }
+}
+
+TEST(Tracer, DumpsChromeTraceJson) {
+    const std::string path = "/tmp/easy_srv_cli_trace_test.json";
+    tracer &trace = tracer::instance();
+    trace.start(16);
+    trace.record(trace_point_t::ACCEPT, 3, 12);
+    trace.record(trace_point_t::DISPATCH_BEGIN, 3, 5);
+    trace.record(trace_point_t::DISPATCH_END, 3, 5);
+    trace.stop();
+    ASSERT_TRUE(trace.dumpChromeTrace(path));
+
+    std::ifstream file(path);
+    std::stringstream content;
+    content << file.rdbuf();
+    std::string json = content.str();
+    ASSERT_EQ(0u, json.find("{\"displayTimeUnit\":\"ns\",\"traceEvents\":["));
+    ASSERT_NE(std::string::npos, json.find("\"name\":\"accept\",\"cat\":\"net\",\"ph\":\"i\""));
+    ASSERT_NE(std::string::npos, json.find("\"args\":{\"connection\":3,\"socket\":12}"));
+    ASSERT_NE(std::string::npos, json.find("\"name\":\"dispatch\",\"cat\":\"net\",\"ph\":\"B\""));
+    ASSERT_NE(std::string::npos, json.find("\"name\":\"dispatch\",\"cat\":\"net\",\"ph\":\"E\""));
+    ASSERT_EQ(json.size() - 4, json.rfind("\n]}\n"));
+    remove(path.c_str());
+}
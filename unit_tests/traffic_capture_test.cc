@@ -0,0 +1,109 @@
+#include "../src/traffic_capture.h"
+#include "unit_tests_common.h"
+
+TEST(TrafficCapture, RecordsFromManyThreadsAreReadBack) {
+    const std::string path = "/tmp/easy_srv_cli_capture_test.bin";
+    const int threads = 4;
+    const int messagesPerThread = 1000;
+    traffic_capture capture;
+    ASSERT_TRUE(capture.start(path, 256));
+
+    std::vector<std::thread> producers;
+    for (int t = 0; t < threads; t++) {
+        producers.emplace_back([&capture, t] {
+            for (int i = 0; i < messagesPerThread; i++) {
+                std::string msg = std::to_string(t) + ":" + std::to_string(i);
+                capture.record(t, 0x0100007f, msg.data(), msg.size());
+            }
+        });
+    }
+    for (auto &producer : producers) {
+        producer.join();
+    }
+    capture.stop();
+    ASSERT_EQ(uint64_t(threads * messagesPerThread),
+              capture.recordedCount() + capture.droppedCount());
+
+    capture_reader reader;
+    ASSERT_TRUE(reader.open(path));
+    capture_record_header_t header;
+    std::string payload;
+    std::vector<int> lastIndex(threads, -1);
+    uint64_t records = 0;
+    while (reader.next(header, payload)) {
+        auto fields = split(payload, ':');
+        ASSERT_EQ(2u, fields.size());
+        ASSERT_EQ(std::to_string(header.connectionId), fields[0]);
+        int index = std::stoi(fields[1]);
+        // records of one producer keep their order
+        ASSERT_GT(index, lastIndex[header.connectionId]);
+        lastIndex[header.connectionId] = index;
+        records++;
+    }
+    ASSERT_EQ(capture.recordedCount(), records);
+}
+
+TEST(TrafficCapture, LargeMessagesAreSplitIntoSlots) {
+    const std::string path = "/tmp/easy_srv_cli_capture_split_test.bin";
+    traffic_capture capture;
+    ASSERT_TRUE(capture.start(path));
+    std::string msg(CAPTURE_SLOT_PAYLOAD * 2 + 10, 'x');
+    capture.record(7, 0, msg.data(), msg.size());
+    capture.stop();
+
+    capture_reader reader;
+    ASSERT_TRUE(reader.open(path));
+    capture_record_header_t header;
+    std::string payload;
+    std::vector<uint32_t> sizes;
+    while (reader.next(header, payload)) {
+        sizes.push_back(header.size);
+    }
+    ASSERT_THAT(sizes, ::testing::ElementsAre(CAPTURE_SLOT_PAYLOAD,
+                                              CAPTURE_SLOT_PAYLOAD, 10));
+}
+
+TEST(TrafficCapture, SplitMessagesAreDroppedWhole) {
+    const std::string path = "/tmp/easy_srv_cli_capture_drop_test.bin";
+    traffic_capture capture;
+    ASSERT_TRUE(capture.start(path, 2));
+    // needs three of the two slots, no chunk of it may be written
+    std::string tooLarge(CAPTURE_SLOT_PAYLOAD * 2 + 1, 'x');
+    capture.record(1, 0, tooLarge.data(), tooLarge.size());
+    std::string fits(CAPTURE_SLOT_PAYLOAD + 5, 'y');
+    capture.record(2, 0, fits.data(), fits.size());
+    capture.stop();
+    ASSERT_EQ(1u, capture.droppedCount());
+    ASSERT_EQ(1u, capture.recordedCount());
+
+    capture_reader reader;
+    ASSERT_TRUE(reader.open(path));
+    capture_record_header_t header;
+    std::string payload;
+    std::string readBack;
+    while (reader.next(header, payload)) {
+        ASSERT_EQ(2u, header.connectionId);
+        readBack += payload;
+    }
+    ASSERT_EQ(fits, readBack);
+}
+
+TEST(TrafficCapture, ReaderReopensFromTheStart) {
+    const std::string path = "/tmp/easy_srv_cli_capture_reopen_test.bin";
+    traffic_capture capture;
+    ASSERT_TRUE(capture.start(path));
+    capture.record(3, 0, "abc", 3);
+    capture.stop();
+
+    capture_reader reader;
+    capture_record_header_t header;
+    std::string payload;
+    ASSERT_TRUE(reader.open(path));
+    ASSERT_TRUE(reader.next(header, payload));
+    ASSERT_FALSE(reader.next(header, payload));
+    ASSERT_TRUE(reader.open(path));
+    ASSERT_TRUE(reader.next(header, payload));
+    ASSERT_EQ("abc", payload);
+    ASSERT_FALSE(reader.open(path + ".missing"));
+    ASSERT_FALSE(reader.next(header, payload));
+}
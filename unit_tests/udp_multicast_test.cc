@@ -0,0 +1,256 @@
+#include "../src/udp_multicast.h"
+#include "unit_tests_common.h"
+
+namespace {
+struct sequencer_recorder {
+    std::vector<uint64_t> delivered;
+    std::vector<std::pair<uint64_t, uint64_t>> gaps;
+
+    void attach(feed_sequencer &sequencer) {
+        sequencer.setMessageHandler([this](uint64_t sequence, const char *, size_t) {
+            delivered.push_back(sequence);
+        });
+        sequencer.setGapHandler([this](uint64_t from, uint64_t to) {
+            gaps.emplace_back(from, to);
+        });
+    }
+};
+}  // namespace
+
+TEST(FeedSequencer, DeliversInOrderAndReportsGapsOnce) {
+    feed_sequencer sequencer;
+    sequencer_recorder recorder;
+    recorder.attach(sequencer);
+
+    for (uint64_t sequence : {10, 11, 14, 15, 11, 13, 12, 16}) {
+        sequencer.push(sequence, "", 0);
+    }
+
+    ASSERT_THAT(recorder.delivered, ::testing::ElementsAre(10, 11, 12, 13, 14, 15, 16));
+    ASSERT_EQ(1u, recorder.gaps.size());
+    ASSERT_EQ(std::make_pair(uint64_t(12), uint64_t(13)), recorder.gaps[0]);
+    ASSERT_EQ(0u, sequencer.pendingCount());
+}
+
+TEST(FeedSequencer, SnapshotSkipsMissedMessages) {
+    feed_sequencer sequencer;
+    sequencer_recorder recorder;
+    recorder.attach(sequencer);
+
+    sequencer.push(1, "", 0);
+    sequencer.push(5, "", 0);
+    sequencer.push(6, "", 0);
+    sequencer.skipTo(4);
+
+    ASSERT_THAT(recorder.delivered, ::testing::ElementsAre(1, 5, 6));
+    ASSERT_EQ(7u, sequencer.nextExpected());
+}
+
+TEST(FeedSequencer, ReportsMessagesDroppedWhilePendingIsFull) {
+    feed_sequencer sequencer(2);
+    sequencer_recorder recorder;
+    recorder.attach(sequencer);
+
+    for (uint64_t sequence : {1, 3, 4, 5, 6}) {
+        sequencer.push(sequence, "", 0);
+    }
+    ASSERT_EQ(2u, sequencer.pendingCount());
+    ASSERT_THAT(recorder.gaps, ::testing::ElementsAre(std::make_pair(uint64_t(2), uint64_t(2)),
+                                                      std::make_pair(uint64_t(5), uint64_t(5)),
+                                                      std::make_pair(uint64_t(6), uint64_t(6))));
+    // the retransmissions fill the gaps in order
+    for (uint64_t sequence : {2, 5, 6}) {
+        sequencer.push(sequence, "", 0);
+    }
+    ASSERT_THAT(recorder.delivered, ::testing::ElementsAre(1, 2, 3, 4, 5, 6));
+}
+
+TEST(FeedSequencer, ListsMissingRanges) {
+    feed_sequencer sequencer;
+    std::vector<std::pair<uint64_t, uint64_t>> ranges;
+    sequencer.missingRanges(ranges);
+    ASSERT_TRUE(ranges.empty());
+
+    for (uint64_t sequence : {1, 3, 6, 7, 10}) {
+        sequencer.push(sequence, "", 0);
+    }
+    ASSERT_TRUE(sequencer.hasGap());
+    sequencer.missingRanges(ranges);
+    ASSERT_THAT(ranges, ::testing::ElementsAre(std::make_pair(uint64_t(2), uint64_t(2)),
+                                               std::make_pair(uint64_t(4), uint64_t(5)),
+                                               std::make_pair(uint64_t(8), uint64_t(9))));
+    sequencer.skipTo(9);
+    ASSERT_FALSE(sequencer.hasGap());
+    sequencer.missingRanges(ranges);
+    ASSERT_TRUE(ranges.empty());
+}
+
+TEST(UdpMulticast, LoopbackSendAndReceive) {
+    const int port = 19323;
+    const std::string group = "239.255.0.1";
+    UdpMulticastReceiver receiver;
+    std::mutex receivedMtx;
+    std::vector<std::string> received;
+    client_observer_t observer;
+    observer.incoming_packet_func = [&](const char *msg, size_t size) {
+        std::lock_guard<std::mutex> lock(receivedMtx);
+        received.emplace_back(msg, size);
+    };
+    receiver.subscribe(observer);
+    ASSERT_TRUE(receiver.start(port).success);
+    ASSERT_TRUE(receiver.joinGroup(group, "127.0.0.1").success);
+
+    UdpMulticastSender sender;
+    ASSERT_TRUE(sender.open(group, port, "127.0.0.1").success);
+    ASSERT_TRUE(sender.sendMsg("one", 3).success);
+    ASSERT_TRUE(sender.sendMsg("two", 3).success);
+
+    auto receivedSoFar = [&] {
+        std::lock_guard<std::mutex> lock(receivedMtx);
+        return received;
+    };
+    ASSERT_TRUE(wait_for([&] { return receivedSoFar().size() == 2; }));
+    ASSERT_THAT(receivedSoFar(), ::testing::ElementsAre("one", "two"));
+    ASSERT_TRUE(sender.finish().success);
+    ASSERT_TRUE(receiver.finish().success);
+}
+
+TEST(SequencedFeed, DeliversOverLoopbackMulticast) {
+    const int port = 19324;
+    const int retransmitPort = 19325;
+    const std::string group = "239.255.0.2";
+    SequencedFeedPublisher publisher;
+    ASSERT_TRUE(publisher.open(group, port, "127.0.0.1").success);
+    ASSERT_TRUE(publisher.startRetransmitServer(retransmitPort).success);
+
+    SequencedFeedReceiver receiver;
+    std::mutex deliveredMtx;
+    std::vector<uint64_t> delivered;
+    receiver.setMessageHandler([&](uint64_t sequence, const char *, size_t) {
+        std::lock_guard<std::mutex> lock(deliveredMtx);
+        delivered.push_back(sequence);
+    });
+    ASSERT_TRUE(receiver.start(group, port, "127.0.0.1").success);
+    ASSERT_TRUE(receiver.connectRetransmit("127.0.0.1", retransmitPort).success);
+    for (int i = 0; i < 3; i++) {
+        ASSERT_TRUE(publisher.publish("tick", 4).success);
+    }
+
+    auto deliveredSoFar = [&] {
+        std::lock_guard<std::mutex> lock(deliveredMtx);
+        return delivered;
+    };
+    ASSERT_TRUE(wait_for([&] { return deliveredSoFar().size() == 3; }));
+    ASSERT_THAT(deliveredSoFar(), ::testing::ElementsAre(1, 2, 3));
+    ASSERT_TRUE(receiver.finish().success);
+    ASSERT_TRUE(publisher.finish().success);
+}
+
+TEST(SequencedFeed, RetransmitChannelSkipsMalformedRequests) {
+    const int port = 19326;
+    const int retransmitPort = 19327;
+    SequencedFeedPublisher publisher(2);
+    ASSERT_TRUE(publisher.open("239.255.0.3", port, "127.0.0.1").success);
+    ASSERT_TRUE(publisher.startRetransmitServer(retransmitPort).success);
+    publisher.setSnapshotProvider([](uint64_t &sequence) {
+        sequence = 2;
+        return std::string("state");
+    });
+    for (const char *msg : {"a", "b", "c", "d"}) {
+        ASSERT_TRUE(publisher.publish(msg, 1).success);
+    }
+
+    TcpClient client;
+    std::mutex receivedMtx;
+    std::string received;
+    client_observer_t observer;
+    observer.incoming_packet_func = [&](const char *msg, size_t size) {
+        std::lock_guard<std::mutex> lock(receivedMtx);
+        received.append(msg, size);
+    };
+    client.subscribe(observer);
+    ASSERT_TRUE(client.connectTo("127.0.0.1", retransmitPort).success);
+    std::string requests = "garbage\n1 x\n99999999999999999999999 1\n4 3\n-1 2\n" +
+                           std::string(RETRANSMIT_MAX_REQUEST * 2, '7') + "\n1 4\n";
+    ASSERT_TRUE(client.sendMsg(requests.data(), requests.size()).success);
+
+    // snapshot up to 2, then the retained 3 and 4
+    const size_t expectedSize = 3 * sizeof(retransmit_header_t) + 5 + 1 + 1;
+    auto receivedSoFar = [&] {
+        std::lock_guard<std::mutex> lock(receivedMtx);
+        return received;
+    };
+    ASSERT_TRUE(wait_for([&] { return receivedSoFar().size() >= expectedSize; }));
+    std::string reply = receivedSoFar();
+    ASSERT_EQ(expectedSize, reply.size());
+    std::vector<std::tuple<uint64_t, uint8_t, std::string>> frames;
+    for (size_t pos = 0; pos < reply.size();) {
+        retransmit_header_t header;
+        memcpy(&header, reply.data() + pos, sizeof(header));
+        pos += sizeof(header);
+        frames.emplace_back(be64toh(header.sequence), header.type,
+                            reply.substr(pos, be32toh(header.size)));
+        pos += be32toh(header.size);
+    }
+    ASSERT_THAT(frames, ::testing::ElementsAre(
+                            std::make_tuple(uint64_t(2), uint8_t(RETRANSMIT_SNAPSHOT), "state"),
+                            std::make_tuple(uint64_t(3), uint8_t(RETRANSMIT_MESSAGE), "c"),
+                            std::make_tuple(uint64_t(4), uint8_t(RETRANSMIT_MESSAGE), "d")));
+    ASSERT_TRUE(client.finish().success);
+    ASSERT_TRUE(publisher.finish().success);
+}
+
+TEST(SequencedFeed, GapsFoundBeforeConnectingAreRequestedAndLossesSkipped) {
+    const int port = 19334;
+    const int retransmitPort = 19335;
+    const std::string group = "239.255.0.4";
+    SequencedFeedPublisher publisher(2);
+    ASSERT_TRUE(publisher.open(group, port, "127.0.0.1").success);
+    ASSERT_TRUE(publisher.startRetransmitServer(retransmitPort).success);
+    for (const char *msg : {"a", "b", "c", "d"}) {
+        ASSERT_TRUE(publisher.publish(msg, 1).success);
+    }
+
+    SequencedFeedReceiver receiver;
+    std::mutex deliveredMtx;
+    std::vector<uint64_t> delivered;
+    std::vector<std::pair<uint64_t, uint64_t>> lost;
+    receiver.setMessageHandler([&](uint64_t sequence, const char *, size_t) {
+        std::lock_guard<std::mutex> lock(deliveredMtx);
+        delivered.push_back(sequence);
+    });
+    receiver.setLossHandler([&](uint64_t from, uint64_t to) {
+        std::lock_guard<std::mutex> lock(deliveredMtx);
+        lost.emplace_back(from, to);
+    });
+    ASSERT_TRUE(receiver.start(group, port, "127.0.0.1").success);
+    auto deliveredSoFar = [&] {
+        std::lock_guard<std::mutex> lock(deliveredMtx);
+        return delivered;
+    };
+
+    // the receiver starts at 1, then sees 5 while it can't request 2 to 4
+    UdpMulticastSender sender;
+    ASSERT_TRUE(sender.open(group, port, "127.0.0.1").success);
+    std::string first(sizeof(feed_header_t), '\0');
+    uint64_t sequence = htobe64(1);
+    memcpy(&first[0], &sequence, sizeof(sequence));
+    first += "a";
+    ASSERT_TRUE(sender.sendMsg(first.data(), first.size()).success);
+    ASSERT_TRUE(wait_for([&] { return deliveredSoFar().size() == 1; }));
+    ASSERT_TRUE(publisher.publish("e", 1).success);
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    ASSERT_EQ(1u, deliveredSoFar().size());
+
+    // 2 and 3 fell out of the history of 2 and there is no snapshot
+    ASSERT_TRUE(receiver.connectRetransmit("127.0.0.1", retransmitPort).success);
+    ASSERT_TRUE(wait_for([&] { return deliveredSoFar().size() == 3; }));
+    ASSERT_THAT(deliveredSoFar(), ::testing::ElementsAre(1, 4, 5));
+    {
+        std::lock_guard<std::mutex> lock(deliveredMtx);
+        ASSERT_THAT(lost, ::testing::ElementsAre(std::make_pair(uint64_t(2), uint64_t(3))));
+    }
+    ASSERT_TRUE(sender.finish().success);
+    ASSERT_TRUE(receiver.finish().success);
+    ASSERT_TRUE(publisher.finish().success);
+}
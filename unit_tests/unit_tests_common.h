@@ -6,4 +6,21 @@
 
 #include "../src/common.h"
 #include "gmock/gmock.h"
+#include <chrono>
 #include <exception>
+#include <thread>
+
+/// Poll predicate until it holds or timeout passed. Return its last result,
+/// tests assert on it or on the state it checks.
+template <typename Predicate>
+bool wait_for(Predicate &&predicate,
+              std::chrono::milliseconds timeout = std::chrono::seconds(5)) {
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    while (!predicate()) {
+        if (std::chrono::steady_clock::now() >= deadline) {
+            return predicate();
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    return true;
+}